@@ -0,0 +1,289 @@
+#ifndef DRAGAZO_ADAPTIVE_CFILE_H
+#define DRAGAZO_ADAPTIVE_CFILE_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+#include "cfile.h"
+
+// a cfile that picks its own stream buffer size from the way it is used.
+// every call is counted (size and whether it continues where the last one left off), and every window of calls
+// (or on a seek) the policy is re-evaluated:
+//   small sequential transfers (putc, short lines) - the buffer grows (doubling up to max_buffer) to cut system calls.
+//   large sequential transfers (>= large_op on average) - the buffer shrinks to min_large_buffer, so each transfer that is at
+//     least as big as the buffer goes straight between the caller and the file instead of being copied through it.
+//   random access (frequent seeks elsewhere) - the buffer shrinks to roughly the average transfer, so a seek doesn't
+//     throw away (or read ahead) a large buffer for a few bytes.
+// the buffer is only swapped while it is empty (after a flush when writing, once the read buffer is used up when reading).
+// resizing relies on glibc accepting setvbuf() on a stream that has already done io - elsewhere the statistics are still
+// collected and the policy reported, but the buffer is left alone.
+// all io must go through this object for the statistics to be right (file() gives access to the underlying cfile).
+class adaptive_cfile
+{
+public: // -- types -- //
+
+	enum class policy
+	{
+		initial,           // not enough calls seen yet
+		small_sequential,  // growing buffer
+		large_sequential,  // small buffer, large transfers bypass it
+		random_access,     // buffer sized to the transfers
+	};
+
+	struct options
+	{
+		std::size_t initial_buffer = 64 << 10;   // buffer installed on open
+		std::size_t min_buffer = 4 << 10;        // smallest buffer ever used
+		std::size_t max_buffer = 4 << 20;        // largest buffer ever used
+		std::size_t min_large_buffer = 64 << 10; // buffer used for large sequential transfers
+		std::size_t large_op = 64 << 10;         // average transfer size considered large
+		std::size_t window = 64;                 // calls between evaluations
+	};
+
+	struct stats
+	{
+		policy current;          // the policy chosen at the last evaluation
+		std::size_t buffer_size; // current stream buffer size (0 if unknown)
+		std::size_t ops;         // io calls made
+		std::size_t bytes;       // bytes transferred
+		std::size_t seeks;       // seeks that moved away from the current position
+		std::size_t bypassed;    // transfers at least as big as the buffer (which skip it)
+		std::size_t resizes;     // times the buffer was replaced
+		std::size_t avg_op;      // average transfer size over the last window
+	};
+
+private: // -- data -- //
+
+	cfile f;
+	options opt;
+	stats st = {};
+
+	long long pos = 0;                // logical position (-1 if unknown, e.g. after seeking from the end)
+	std::size_t win_ops = 0, win_bytes = 0, win_seeks = 0;
+	std::size_t want = 0;             // buffer size the policy asks for (0 = keep the current one)
+
+	void reset_state()
+	{
+		st = stats{};
+		st.current = policy::initial;
+		win_ops = win_bytes = win_seeks = 0;
+		want = 0;
+		// the buffer goes in first - setvbuf() only works on a stream nothing else has touched yet
+		if (f && f.set_buffer(opt.initial_buffer) == 0) st.buffer_size = opt.initial_buffer;
+		pos = f ? f.tell() : 0;
+	}
+
+	// records one transfer of n bytes (and re-evaluates the policy once a window is complete).
+	void note(std::size_t n)
+	{
+		++st.ops;
+		st.bytes += n;
+		if (pos >= 0) pos += (long long)n;
+		if (st.buffer_size && n >= st.buffer_size) ++st.bypassed;
+		++win_ops;
+		win_bytes += n;
+		if (win_ops >= opt.window) evaluate();
+		else if (want) apply();
+	}
+
+	// discard: unread input may be thrown away (a seek is about to do so anyway).
+	void evaluate(bool discard = false)
+	{
+		if (win_ops == 0) return;
+		st.avg_op = win_bytes / win_ops;
+
+		// a seek every 8 calls or so means each buffer fill is mostly wasted
+		if (win_seeks * 8 >= win_ops)
+		{
+			st.current = policy::random_access;
+			want = std::max(opt.min_buffer, (st.avg_op + 4095) / 4096 * 4096);
+		}
+		else if (st.avg_op >= opt.large_op)
+		{
+			st.current = policy::large_sequential;
+			want = opt.min_large_buffer;
+		}
+		else
+		{
+			st.current = policy::small_sequential;
+			want = st.buffer_size ? st.buffer_size * 2 : opt.initial_buffer;
+		}
+		want = std::min(std::max(want, opt.min_buffer), opt.max_buffer);
+		if (want == st.buffer_size) want = 0;
+
+		win_ops = win_bytes = win_seeks = 0;
+		apply(discard);
+	}
+
+	// swaps in the wanted buffer if the current one is empty right now (or only holds input that may be discarded).
+	void apply(bool discard = false)
+	{
+#ifdef __GLIBC__
+		if (!want || !f) return;
+		std::FILE *const file = f.get();
+		if (file->_IO_write_ptr > file->_IO_write_base)
+		{
+			// pending output - hand it over first (this is a write the buffer would have made soon anyway)
+			if (std::fflush(file) != 0) return;
+		}
+		else if (f.in_avail() != 0 && !discard) return; // unread input - try again later
+		if (f.set_buffer(want) == 0)
+		{
+			st.buffer_size = want;
+			++st.resizes;
+		}
+		want = 0;
+#endif
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates an unlinked handle.
+	adaptive_cfile() { st.current = policy::initial; }
+
+	// opens a file - equivalent to calling open(filename, mode).
+	adaptive_cfile(const char *filename, const char *mode) { open(filename, mode); }
+	// opens a file with the given options - equivalent to calling open(filename, mode, o).
+	adaptive_cfile(const char *filename, const char *mode, const options &o) { open(filename, mode, o); }
+
+	adaptive_cfile(const adaptive_cfile&) = delete;
+	adaptive_cfile &operator=(const adaptive_cfile&) = delete;
+
+public: // -- file state -- //
+
+	// opens a file and links it to this handle (closing any current file first) with the default options.
+	bool open(const char *filename, const char *mode) { return open(filename, mode, options()); }
+	// opens a file and links it to this handle (closing any current file first).
+	bool open(const char *filename, const char *mode, const options &o)
+	{
+		opt = o;
+		f.open(filename, mode);
+		reset_state();
+		return (bool)f;
+	}
+
+	// closes the file (if any) and enters the unlinked state.
+	void close() { f.close(); }
+
+	// returns true if this handle is currently linked to a file.
+	explicit operator bool() const noexcept { return (bool)f; }
+	// returns true if this handle is currently unlinked.
+	bool operator!() const noexcept { return !f; }
+
+	// the underlying file - io done directly on it is not seen by the policy.
+	cfile &file() noexcept { return f; }
+
+	// returns the statistics collected so far and the current policy.
+	const stats &get_stats() const noexcept { return st; }
+
+	// flushes the stream.
+	void flush() { f.flush(); }
+
+	// gets the current position in the file.
+	// equivalent to calling ftell() with the stored file pointer.
+	long int tell() const { return f.tell(); }
+	// sets the current position in the file - a seek to anywhere but the current position counts as random access.
+	// equivalent to calling fseek() with the stored file pointer.
+	int seek(long int offset, int origin = SEEK_SET)
+	{
+		long long target = origin == SEEK_SET ? offset : origin == SEEK_CUR && pos >= 0 ? pos + offset : -1;
+		if (target < 0 || target != pos)
+		{
+			++st.seeks;
+			++win_seeks;
+		}
+		// don't wait a whole window to react to random access. this happens before the seek, as the buffered input is about
+		// to be dropped anyway (the seek refills the buffer straight away, which would keep a resize waiting indefinitely)
+		if (win_seeks * 8 >= opt.window) evaluate(true);
+		const int r = f.seek(offset, origin);
+		pos = r == 0 ? target : -1;
+		if (pos < 0 && r == 0) pos = f.tell();
+		return r;
+	}
+
+	// checks if the file has reached eof.
+	int eof() const { return f.eof(); }
+	// checks if there was an error.
+	int error() const { return f.error(); }
+
+public: // -- input -- //
+
+	// gets a character from the file.
+	int getc()
+	{
+		const int ch = f.getc();
+		if (ch != EOF) note(1);
+		return ch;
+	}
+
+	// reads (count) elements of size (size) from the file (binary data).
+	std::size_t read(void *ptr, std::size_t size, std::size_t count)
+	{
+		const std::size_t r = f.read(ptr, size, count);
+		note(r * size);
+		return r;
+	}
+	// convenience function - passes correct size parameter to read() based on T.
+	// additionally, guarantees that T is a valid type to be read in this manner.
+	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t read(T *ptr, std::size_t count) { return read(static_cast<void*>(ptr), sizeof(T), count); }
+
+	// reads at most num-1 chars into the specified buffer.
+	char *gets(char *str, int num)
+	{
+		char *const r = f.gets(str, num);
+		if (r) note(std::strlen(r));
+		return r;
+	}
+
+public: // -- output -- //
+
+	// writes a char to the file.
+	int putc(int ch)
+	{
+		const int r = f.putc(ch);
+		if (r != EOF) note(1);
+		return r;
+	}
+
+	// writes a string to the file.
+	int puts(const char *str)
+	{
+		const int r = f.puts(str);
+		if (r >= 0) note(std::strlen(str));
+		return r;
+	}
+
+	// writes (count) elements of size (size) to the file (binary data).
+	std::size_t write(const void *ptr, std::size_t size, std::size_t count)
+	{
+		const std::size_t r = f.write(const_cast<void*>(ptr), size, count);
+		note(r * size);
+		return r;
+	}
+	// convenience function - passes correct size parameter to write() based on T.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t write(const T *ptr, std::size_t count) { return write(static_cast<const void*>(ptr), sizeof(T), count); }
+	// convenience function - passes correct size and count parameters to write() based on T and length of array.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, int len, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t write(const T(&ptr)[len]) { return write(static_cast<const void*>(ptr), sizeof(T), len); }
+
+	// prints a formatted string to the file.
+	int printf(const char *fmt, ...)
+	{
+		va_list v;
+		va_start(v, fmt);
+		const int r = std::vfprintf(f, fmt, v);
+		va_end(v);
+		if (r > 0) note((std::size_t)r);
+		return r;
+	}
+};
+
+#endif
@@ -0,0 +1,496 @@
+#ifndef DRAGAZO_APPEND_LOG_H
+#define DRAGAZO_APPEND_LOG_H
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <limits>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "cfile.h"
+
+// represents an append-only record log that many threads can append to concurrently without locking each other out.
+// appends are batched per thread: each thread reserves a block of the file with a single atomic fetch_add on the shared end
+// offset, frames its records into a private buffer and writes the block with one pwrite() once it is full. the kernel
+// serializes writes to one file (the inode lock), so it's the batching - not the lock-free reservation - that keeps appends
+// from many threads cheap. with a batch size of 0 every record is reserved and written on its own, which is much slower
+// for small records (over 10x for 100-byte records - see append_log_benchmark()) but puts each record in the file at once.
+// records are framed as [header][payload][zero padding to 8 bytes], where the header holds a magic number, the payload length,
+// a crc32c of the payload and a crc32c of the header itself. the unused tail of a block is filled with a pad record.
+// a crash can leave holes (blocks reserved but never written) or torn records anywhere near the end - append_log::reader skips them.
+// the end offset is only shared within one process - do not append to the same file from several processes.
+class append_log
+{
+public: // -- format -- //
+
+	static constexpr std::uint32_t magic = 0x474f4c41;     // "ALOG"
+	static constexpr std::uint32_t pad_magic = 0x44415041; // "APAD" - fills the unused tail of a block, its payload is ignored
+	static constexpr std::size_t alignment = 8;        // records start on multiples of this
+	static constexpr std::size_t max_record = 0x7fffffff;
+
+	struct record_header
+	{
+		std::uint32_t magic;
+		std::uint32_t length;     // payload bytes (excluding header and padding)
+		std::uint32_t data_crc;   // crc32c of the payload
+		std::uint32_t header_crc; // crc32c of the preceding 12 bytes
+	};
+	static_assert(sizeof(record_header) % alignment == 0, "record header must preserve alignment");
+
+	// computes the crc32c (castagnoli) of a buffer, continuing from a previous crc value.
+	static std::uint32_t crc32c(const void *ptr, std::size_t len, std::uint32_t crc = 0) noexcept
+	{
+		const unsigned char *p = static_cast<const unsigned char*>(ptr);
+		crc = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+		for (; len >= 8; p += 8, len -= 8)
+		{
+			std::uint64_t v;
+			std::memcpy(&v, p, 8);
+			crc = (std::uint32_t)__builtin_ia32_crc32di(crc, v);
+		}
+		for (; len > 0; ++p, --len) crc = __builtin_ia32_crc32qi(crc, *p);
+#else
+		static const auto table = []
+		{
+			struct { std::uint32_t v[8][256]; } t;
+			for (std::uint32_t i = 0; i < 256; ++i)
+			{
+				std::uint32_t c = i;
+				for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0x82f63b78 & (0 - (c & 1)));
+				t.v[0][i] = c;
+			}
+			for (std::uint32_t i = 0; i < 256; ++i)
+				for (int k = 1; k < 8; ++k) t.v[k][i] = (t.v[k - 1][i] >> 8) ^ t.v[0][t.v[k - 1][i] & 0xff];
+			return t;
+		}();
+		// slicing-by-8
+		for (; len >= 8; p += 8, len -= 8)
+		{
+			const std::uint32_t lo = crc ^ ((std::uint32_t)p[0] | (std::uint32_t)p[1] << 8 | (std::uint32_t)p[2] << 16 | (std::uint32_t)p[3] << 24);
+			crc = table.v[7][lo & 0xff] ^ table.v[6][(lo >> 8) & 0xff] ^ table.v[5][(lo >> 16) & 0xff] ^ table.v[4][lo >> 24]
+				^ table.v[3][p[4]] ^ table.v[2][p[5]] ^ table.v[1][p[6]] ^ table.v[0][p[7]];
+		}
+		for (; len > 0; ++p, --len) crc = (crc >> 8) ^ table.v[0][(crc ^ *p) & 0xff];
+#endif
+		return ~crc;
+	}
+
+	// builds the header for a payload.
+	static record_header make_header(const void *ptr, std::size_t len) noexcept
+	{
+		record_header h;
+		h.magic = magic;
+		h.length = (std::uint32_t)len;
+		h.data_crc = crc32c(ptr, len);
+		h.header_crc = crc32c(&h, offsetof(record_header, header_crc));
+		return h;
+	}
+	// builds the header of a pad record that covers size bytes in total (a multiple of the alignment, at least a header).
+	static record_header make_pad(std::size_t size) noexcept
+	{
+		record_header h;
+		h.magic = pad_magic;
+		h.length = (std::uint32_t)(size - sizeof(record_header));
+		h.data_crc = 0;
+		h.header_crc = crc32c(&h, offsetof(record_header, header_crc));
+		return h;
+	}
+	// returns true if the header (of a record or a pad) is intact (says nothing about the payload).
+	static bool check_header(const record_header &h) noexcept
+	{
+		return (h.magic == magic || h.magic == pad_magic) && h.length <= max_record
+			&& h.header_crc == crc32c(&h, offsetof(record_header, header_crc));
+	}
+	// returns the total on-disk size of a record with the given payload length.
+	static std::uint64_t record_size(std::size_t len) noexcept
+	{
+		return (sizeof(record_header) + (std::uint64_t)len + alignment - 1) & ~(std::uint64_t)(alignment - 1);
+	}
+
+private: // -- data -- //
+
+	// a thread's batch - a block of the file reserved at base, with the records framed so far in buf
+	struct lease
+	{
+		std::mutex mtx;         // only contended by flush() and sync()
+		std::vector<char> buf;  // empty while no block is reserved
+		std::uint64_t base = 0;
+		std::size_t used = 0;    // bytes framed into buf
+		std::size_t written = 0; // bytes of buf already written to the file
+	};
+
+	int fd = -1;
+	std::size_t batch = 0;
+	std::atomic<std::uint64_t> end{ 0 }; // offset where the next record (or block) will be reserved
+
+	std::mutex leases_mtx; // guards leases (not their contents)
+	std::vector<std::unique_ptr<lease>> leases; // kept until destruction - the thread caches point at them
+
+	const std::uint64_t id = next_id();
+	const std::shared_ptr<char> alive = std::make_shared<char>(); // expires with the log (see cache())
+
+	static std::uint64_t next_id()
+	{
+		static std::atomic<std::uint64_t> counter{ 0 };
+		return counter.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	struct cache_entry
+	{
+		std::uint64_t id;
+		lease *l;
+		std::weak_ptr<char> alive;
+	};
+	// each thread's leases, by log id
+	static std::vector<cache_entry> &cache()
+	{
+		static thread_local std::vector<cache_entry> c;
+		return c;
+	}
+
+	// returns the calling thread's lease, creating it on first use.
+	lease &local()
+	{
+		std::vector<cache_entry> &c = cache();
+		for (const cache_entry &e : c) if (e.id == id) return *e.l;
+
+		// first use on this thread - also a good time to forget the logs that are gone
+		c.erase(std::remove_if(c.begin(), c.end(), [](const cache_entry &e) { return e.alive.expired(); }), c.end());
+		lease *l;
+		{
+			std::lock_guard<std::mutex> lock(leases_mtx);
+			leases.emplace_back(new lease);
+			l = leases.back().get();
+		}
+		c.push_back(cache_entry{ id, l, alive });
+		return *l;
+	}
+
+	// writes len bytes at off, retrying short writes. returns 0 on success, otherwise errno.
+	int write_at(const char *p, std::size_t len, std::uint64_t off)
+	{
+		while (len > 0)
+		{
+			const ssize_t n = ::pwrite(fd, p, len, (off_t)off);
+			if (n < 0)
+			{
+				if (errno == EINTR) continue;
+				return errno;
+			}
+			p += n;
+			len -= (std::size_t)n;
+			off += (std::uint64_t)n;
+		}
+		return 0;
+	}
+
+	// writes the part of a lease's buffer that isn't written yet (the caller holds its mutex).
+	// on failure the data is dropped - it becomes a hole. returns 0 on success, otherwise errno.
+	int write_pending(lease &l)
+	{
+		const int r = write_at(l.buf.data() + l.written, l.used - l.written, l.base + l.written);
+		l.written = l.used;
+		return r;
+	}
+
+	// fills the rest of a lease's block with a pad record, writes it out and releases the block.
+	int retire(lease &l)
+	{
+		const std::size_t rest = l.buf.size() - l.used;
+		if (rest >= sizeof(record_header))
+		{
+			const record_header h = make_pad(rest);
+			std::memcpy(l.buf.data() + l.used, &h, sizeof(h));
+			std::memset(l.buf.data() + l.used + sizeof(h), 0, rest - sizeof(h));
+			l.used += rest;
+		}
+		// a smaller rest (a single alignment unit) is left as a hole, which the reader steps over
+		const int r = write_pending(l);
+		l.buf.clear();
+		return r;
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates an unlinked log.
+	append_log() = default;
+
+	// opens (creating if needed) a log file for appending.
+	// equivalent to calling open(path, batch_size).
+	explicit append_log(const char *path, std::size_t batch_size = 64 * 1024) { open(path, batch_size); }
+
+	append_log(const append_log&) = delete;
+	append_log &operator=(const append_log&) = delete;
+
+	~append_log()
+	{
+		close();
+		std::vector<cache_entry> &c = cache();
+		c.erase(std::remove_if(c.begin(), c.end(), [&](const cache_entry &e) { return e.id == id; }), c.end());
+	}
+
+public: // -- log state -- //
+
+	// opens (creating if needed) a log file and links it to this handle.
+	// new records are placed after the current end of the file (rounded up to the record alignment).
+	// each thread batches its appends in blocks of batch_size bytes (rounded up to the record alignment) - 0 disables batching.
+	// if this handle is already linked, it is first closed - must not race with append().
+	// returns true on success, otherwise this handle is left unlinked.
+	bool open(const char *path, std::size_t batch_size = 64 * 1024)
+	{
+		close();
+		int d = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (d < 0) return false;
+		struct stat st;
+		if (::fstat(d, &st) != 0) { ::close(d); return false; }
+
+		fd = d;
+		batch = (batch_size + alignment - 1) & ~(alignment - 1);
+		end.store(((std::uint64_t)st.st_size + alignment - 1) & ~(std::uint64_t)(alignment - 1), std::memory_order_relaxed);
+		return true;
+	}
+
+	// writes the pending batches, closes the log (if any) and enters the unlinked state - must not race with append().
+	// the last block of the file is cut down to the records it holds - other blocks are padded out.
+	// returns 0 on success, otherwise the errno of the first failed write.
+	int close()
+	{
+		if (fd < 0) return 0;
+
+		std::vector<lease*> held;
+		for (const auto &l : leases) if (!l->buf.empty()) held.push_back(l.get());
+		std::sort(held.begin(), held.end(), [](const lease *a, const lease *b) { return a->base > b->base; });
+
+		int r = 0;
+		for (lease *l : held)
+		{
+			int e;
+			if (l->base + l->buf.size() == end.load(std::memory_order_relaxed))
+			{
+				// the last reservation - give back the unused tail
+				end.store(l->base + l->used, std::memory_order_relaxed);
+				e = write_pending(*l);
+				l->buf.clear();
+			}
+			else e = retire(*l);
+			if (r == 0) r = e;
+		}
+
+		::close(fd);
+		fd = -1;
+		return r;
+	}
+
+	// returns true if this handle is currently linked to a file.
+	explicit operator bool() const noexcept { return fd >= 0; }
+	// returns true if this handle is currently unlinked.
+	bool operator!() const noexcept { return fd < 0; }
+
+	// returns the offset just past the space reserved so far (by records and by the threads' blocks).
+	std::uint64_t size() const noexcept { return end.load(std::memory_order_relaxed); }
+
+	// writes every thread's pending records to the file (their blocks stay reserved for further appends).
+	// safe to call concurrently with append(). returns 0 on success, otherwise the errno of the first failed write.
+	int flush()
+	{
+		std::lock_guard<std::mutex> lock(leases_mtx);
+		int r = 0;
+		for (const auto &l : leases)
+		{
+			std::lock_guard<std::mutex> lease_lock(l->mtx);
+			const int e = write_pending(*l);
+			if (r == 0) r = e;
+		}
+		return r;
+	}
+
+	// flushes pending records (see flush()) and then to stable storage with fdatasync() (fsync() where that is unavailable).
+	// returns 0 on success.
+	int sync()
+	{
+		if (flush() != 0) return -1;
+#if defined(__APPLE__)
+		return ::fsync(fd);
+#else
+		return ::fdatasync(fd);
+#endif
+	}
+
+public: // -- output -- //
+
+	// appends a record holding len bytes of payload - safe to call from any number of threads at once.
+	// the record reaches the file when the calling thread's block fills up, or on flush(), sync() or close().
+	// records that don't fit in a block (or all of them, if batching is disabled) are reserved and written on their own.
+	// returns the offset of the record, or -1 on failure (in which case the reserved space is left as a hole).
+	std::int64_t append(const void *ptr, std::size_t len)
+	{
+		if (fd < 0 || len > max_record) return -1;
+
+		const record_header h = make_header(ptr, len);
+		const std::uint64_t total = record_size(len);
+		if (total > batch) return append_single(h, ptr, len, total);
+
+		lease &l = local();
+		std::lock_guard<std::mutex> lock(l.mtx);
+		if (!l.buf.empty() && l.used + total > l.buf.size())
+		{
+			if (retire(l) != 0) return -1;
+		}
+		if (l.buf.empty())
+		{
+			l.buf.resize(batch);
+			l.base = end.fetch_add(batch, std::memory_order_relaxed);
+			l.used = l.written = 0;
+		}
+
+		char *const p = l.buf.data() + l.used;
+		std::memcpy(p, &h, sizeof(h));
+		std::memcpy(p + sizeof(h), ptr, len);
+		std::memset(p + sizeof(h) + len, 0, total - sizeof(h) - len);
+		const std::uint64_t off = l.base + l.used;
+		l.used += total;
+
+		if (l.used == l.buf.size() && retire(l) != 0) return -1;
+		return (std::int64_t)off;
+	}
+	// convenience function - appends the bytes of obj as a record.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::int64_t append(const T &obj) { return append(&obj, sizeof(T)); }
+
+private: // -- helpers -- //
+
+	// reserves and writes a single record with pwritev().
+	std::int64_t append_single(record_header h, const void *ptr, std::size_t len, std::uint64_t total)
+	{
+		static const char zeros[alignment] = {};
+		const std::uint64_t off = end.fetch_add(total, std::memory_order_relaxed);
+
+		iovec iov[3];
+		iov[0].iov_base = &h;
+		iov[0].iov_len = sizeof(h);
+		iov[1].iov_base = const_cast<void*>(ptr);
+		iov[1].iov_len = len;
+		iov[2].iov_base = const_cast<char*>(zeros);
+		iov[2].iov_len = total - sizeof(h) - len;
+
+		// the common case is a single pwritev() - anything short is finished piecewise
+		std::uint64_t done = 0;
+		for (int i = 0; done < total; )
+		{
+			ssize_t n = ::pwritev(fd, iov + i, 3 - i, (off_t)(off + done));
+			if (n < 0)
+			{
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			done += (std::uint64_t)n;
+
+			std::size_t k = (std::size_t)n;
+			for (; i < 3 && k >= iov[i].iov_len; ++i) k -= iov[i].iov_len;
+			if (i < 3)
+			{
+				iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + k;
+				iov[i].iov_len -= k;
+			}
+		}
+		return (std::int64_t)off;
+	}
+
+public: // -- input -- //
+
+	// sequentially reads the intact records of a log through a cfile, skipping pad records, holes and torn records.
+	// can run while the log is being appended to, but records still in flight when the reader passes them are treated as holes.
+	// offsets past 2 GiB need a 64-bit off_t (e.g. _FILE_OFFSET_BITS=64 on 32-bit systems).
+	class reader
+	{
+	private: // -- data -- //
+
+		cfile &file;
+		std::uint64_t pos = 0;     // offset of the next candidate record
+		std::uint64_t skipped = 0; // bytes skipped as holes or damaged records
+
+		// moves the stream to pos and reads the header there.
+		bool load(record_header &h)
+		{
+			if (pos > (std::uint64_t)std::numeric_limits<off_t>::max() || ::fseeko(file.get(), (off_t)pos, SEEK_SET) != 0) return false;
+			return file.read(&h, 1) == 1;
+		}
+
+	public: // -- ctor / dtor / asgn -- //
+
+		// reads records from file, starting at its beginning.
+		explicit reader(cfile &src) : file(src) {}
+
+	public: // -- input -- //
+
+		// reads the next intact record into payload.
+		// returns false once no further intact record exists (payload is left empty).
+		bool next(std::vector<char> &payload)
+		{
+			payload.clear();
+			record_header h;
+			if (!load(h)) return false;
+			for (;;)
+			{
+				if (!check_header(h))
+				{
+					// a hole or garbage - resynchronize at the next aligned offset, keeping the part of the header already read
+					pos += alignment;
+					skipped += alignment;
+					char *const raw = reinterpret_cast<char*>(&h);
+					std::memmove(raw, raw + alignment, sizeof(h) - alignment);
+					if (file.read(raw + sizeof(h) - alignment, 1, alignment) != alignment) return false;
+					continue;
+				}
+
+				const std::uint64_t total = record_size(h.length);
+				if (h.magic == pad_magic)
+				{
+					pos += total;
+					if (!load(h)) return false;
+					continue;
+				}
+
+				payload.resize(h.length);
+				if (file.read(payload.data(), 1, h.length) != h.length)
+				{
+					// reserved but still being written (or torn at the end of the file)
+					payload.clear();
+					return false;
+				}
+
+				pos += total;
+				if (crc32c(payload.data(), payload.size()) == h.data_crc) return true;
+
+				skipped += total; // the header was intact, so its length is trustworthy
+				if (!load(h)) { payload.clear(); return false; }
+			}
+		}
+
+		// returns the offset the next call to next() will start from.
+		std::uint64_t tell() const noexcept { return pos; }
+		// returns the number of bytes skipped so far as holes or damaged records (pad records don't count).
+		std::uint64_t skipped_bytes() const noexcept { return skipped; }
+	};
+};
+
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef DRAGAZO_BUFFER_ALLOC_H
+#define DRAGAZO_BUFFER_ALLOC_H
+
+#include <cstdlib>
+#include <cstddef>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+
+// allocates io buffers - aligned (e.g. to 4096 for page-aligned / O_DIRECT friendly io) and, from huge_page_size up,
+// optionally backed by huge pages.
+struct buffer_alloc
+{
+	static constexpr std::size_t huge_page_size = 2 << 20;
+
+	// allocates size bytes with the given alignment (0 = malloc's), using huge pages if requested and size is big enough.
+	// returns null on failure. must be freed with deallocate() given the same arguments.
+	static char *allocate(std::size_t size, std::size_t alignment, bool huge_pages) noexcept
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		if (huge_pages && size >= huge_page_size)
+		{
+			// round up so the whole range can be huge pages - deallocate() rounds the same way
+			const std::size_t len = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+			void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+			p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+			if (p == MAP_FAILED)
+			{
+				// no reserved huge pages - fall back to normal pages and ask for transparent huge pages
+				p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (p == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+				::madvise(p, len, MADV_HUGEPAGE);
+#endif
+			}
+			return static_cast<char*>(p);
+		}
+#else
+		(void)huge_pages;
+#endif
+		if (alignment <= alignof(std::max_align_t)) return static_cast<char*>(std::malloc(size));
+#ifdef _WIN32
+		return static_cast<char*>(::_aligned_malloc(size, alignment));
+#else
+		void *p;
+		return ::posix_memalign(&p, alignment, size) == 0 ? static_cast<char*>(p) : nullptr;
+#endif
+	}
+	// frees a buffer obtained from allocate() (null is ignored).
+	static void deallocate(char *data, std::size_t size, std::size_t alignment, bool huge_pages) noexcept
+	{
+		if (!data) return;
+#if defined(__unix__) || defined(__APPLE__)
+		if (huge_pages && size >= huge_page_size)
+		{
+			::munmap(data, (size + huge_page_size - 1) / huge_page_size * huge_page_size);
+			return;
+		}
+#else
+		(void)size; (void)huge_pages;
+#endif
+#ifdef _WIN32
+		if (alignment > alignof(std::max_align_t)) { ::_aligned_free(data); return; }
+#else
+		(void)alignment;
+#endif
+		std::free(data);
+	}
+};
+
+#endif
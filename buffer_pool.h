@@ -0,0 +1,164 @@
+#ifndef DRAGAZO_BUFFER_POOL_H
+#define DRAGAZO_BUFFER_POOL_H
+
+#include <cstdio>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "buffer_alloc.h"
+#include "cfile.h"
+
+// a thread safe pool of stream buffers, so opening many files doesn't allocate (and later free) a fresh buffer each time.
+// sizes are rounded up to power-of-two size classes (min_size and up), and released buffers are kept per class for reuse
+// (up to max_cached bytes in total - anything beyond that is freed).
+// buffers can be aligned (e.g. to 4096 for page-aligned / O_DIRECT friendly io) and, from huge_page_size up, backed by huge pages.
+// a cfile can take its stream buffer from a pool and gives it back once the stream is closed - see open() and install().
+// every buffer must be released before the pool is destroyed.
+class buffer_pool
+{
+public: // -- types -- //
+
+	struct options
+	{
+		std::size_t alignment = 0;         // required buffer alignment (0 = whatever malloc gives, else a power of two)
+		bool huge_pages = false;           // back buffers of at least huge_page_size with huge pages (where supported)
+		std::size_t max_cached = 64 << 20; // most bytes kept around for reuse
+	};
+
+	static constexpr std::size_t min_size = 4096;
+	static constexpr std::size_t huge_page_size = buffer_alloc::huge_page_size;
+	static constexpr std::size_t max_size = ~(std::size_t)0 / 2 + 1; // the largest size class (larger sizes can't be pooled)
+
+private: // -- data -- //
+
+	options opt;
+
+	std::mutex mtx;
+	std::vector<std::vector<char*>> classes; // free buffers by size class (class i holds min_size << i bytes)
+	std::size_t cached = 0;
+	std::size_t hit_count = 0, miss_count = 0;
+
+	// size must not exceed max_size.
+	static std::size_t class_of(std::size_t size) noexcept
+	{
+		std::size_t c = 0;
+		while ((min_size << c) < size) ++c;
+		return c;
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates a pool with the default options.
+	buffer_pool() = default;
+	// creates a pool with the given options.
+	explicit buffer_pool(const options &o) : opt(o) {}
+
+	buffer_pool(const buffer_pool&) = delete;
+	buffer_pool &operator=(const buffer_pool&) = delete;
+
+	// frees every cached buffer.
+	~buffer_pool() { trim(); }
+
+	// returns a process-wide pool with the default options.
+	static buffer_pool &global() { static buffer_pool p; return p; }
+
+public: // -- interface -- //
+
+	// rounds a size up to its size class - the size acquire() actually hands out (0 if size exceeds max_size).
+	static std::size_t round_size(std::size_t size) noexcept { return size <= max_size ? min_size << class_of(size) : 0; }
+
+	// returns the options the pool was created with.
+	const options &get_options() const noexcept { return opt; }
+
+	// takes a buffer of at least size bytes from the pool (allocating one if none is free).
+	// size is updated to the actual size of the buffer, which must be passed back to release().
+	// returns null if allocation fails or size exceeds max_size.
+	char *acquire(std::size_t &size)
+	{
+		if (size > max_size) return nullptr;
+		const std::size_t c = class_of(size);
+		size = min_size << c;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (c < classes.size() && !classes[c].empty())
+			{
+				char *const p = classes[c].back();
+				classes[c].pop_back();
+				cached -= size;
+				++hit_count;
+				return p;
+			}
+			++miss_count;
+		}
+		return buffer_alloc::allocate(size, opt.alignment, opt.huge_pages);
+	}
+
+	// gives a buffer obtained from acquire() back to the pool.
+	void release(char *data, std::size_t size)
+	{
+		if (!data) return;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (cached + size <= opt.max_cached)
+			{
+				const std::size_t c = class_of(size);
+				if (c >= classes.size()) classes.resize(c + 1);
+				classes[c].push_back(data);
+				cached += size;
+				return;
+			}
+		}
+		buffer_alloc::deallocate(data, size, opt.alignment, opt.huge_pages);
+	}
+
+	// frees every cached buffer.
+	void trim()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		for (std::size_t c = 0; c < classes.size(); ++c)
+		{
+			for (char *p : classes[c]) buffer_alloc::deallocate(p, min_size << c, opt.alignment, opt.huge_pages);
+			classes[c].clear();
+		}
+		cached = 0;
+	}
+
+	// sets file's stream buffer to one of (at least) size bytes taken from this pool.
+	// like any setvbuf() call, this must come before any other operation on the stream.
+	// the buffer is owned by the handle and comes back to the pool once the file is closed (the pool must outlive that).
+	// returns 0 on success, otherwise nonzero and the stream buffer is left unchanged.
+	int install(cfile &file, std::size_t size, int mode = _IOFBF)
+	{
+		if (!file) return -1;
+		char *const data = acquire(size);
+		if (!data) return -1;
+		cfile::owned_buffer buf(data, size, mode, [](char *d, std::size_t n, void *ctx) { static_cast<buffer_pool*>(ctx)->release(d, n); }, this);
+		if (file.adopt_buffer(std::move(buf)) != 0)
+		{
+			release(data, size);
+			return -1;
+		}
+		return 0;
+	}
+
+	// opens a file into file (like cfile::open()) with a fully buffered stream buffer of (at least) size bytes from this pool.
+	// if no buffer can be obtained the file is still opened, using the c library's own buffer.
+	cfile &open(cfile &file, const char *filename, const char *mode, std::size_t size = BUFSIZ)
+	{
+		file.open(filename, mode);
+		if (file) install(file, size);
+		return file;
+	}
+
+	// returns the number of bytes currently cached for reuse.
+	std::size_t cached_bytes() { std::lock_guard<std::mutex> lock(mtx); return cached; }
+	// returns the number of acquire() calls served from the cache.
+	std::size_t hits() { std::lock_guard<std::mutex> lock(mtx); return hit_count; }
+	// returns the number of acquire() calls that had to allocate.
+	std::size_t misses() { std::lock_guard<std::mutex> lock(mtx); return miss_count; }
+};
+
+#endif
@@ -2,20 +2,369 @@
 #define DRAGAZO_CFILE_H
 
 #include <cstdio>
+#include <cstring>
+#include <cstdint>
 #include <utility>
 #include <memory>
 #include <cstdarg>
+#include <cwchar>
 #include <type_traits>
+#include <algorithm>
+#include <limits>
+#include <iterator>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "buffer_alloc.h"
 
 // represents an owning wrapper for a C-style FILE*.
 // includes wrapper functions for convenience.
 class cfile
 {
+public: // -- types -- //
+
+	// a stream buffer owned by a handle - it must outlive the stream, so it is only released after fclose().
+	// moving one leaves the source empty.
+	struct owned_buffer
+	{
+		char *data;
+		std::size_t size;
+		int mode;                                                   // buffering mode it was installed with
+		void (*release_fn)(char *data, std::size_t size, void *ctx); // releases data
+		void *ctx;
+
+		constexpr owned_buffer() noexcept : data(nullptr), size(0), mode(_IOFBF), release_fn(nullptr), ctx(nullptr) {}
+		owned_buffer(char *_data, std::size_t _size, int _mode, void (*_free)(char*, std::size_t, void*), void *_ctx) noexcept
+			: data(_data), size(_size), mode(_mode), release_fn(_free), ctx(_ctx) {}
+
+		owned_buffer(owned_buffer &&other) noexcept : owned_buffer() { swap(other); }
+		owned_buffer &operator=(owned_buffer &&other) noexcept { swap(other); return *this; }
+
+		void swap(owned_buffer &other) noexcept
+		{
+			std::swap(data, other.data);
+			std::swap(size, other.size);
+			std::swap(mode, other.mode);
+			std::swap(release_fn, other.release_fn);
+			std::swap(ctx, other.ctx);
+		}
+
+		// releases the buffer (if any) and becomes empty.
+		void reset() noexcept
+		{
+			if (data) release_fn(data, size, ctx);
+			forget();
+		}
+		// becomes empty without releasing the buffer.
+		void forget() noexcept { *this = owned_buffer(); }
+	};
+
+	// closes a file in place of fclose() and then releases its owned buffer (if any) - see set_closer().
+	typedef void (*close_fn)(std::FILE *file, owned_buffer &&buffer);
+
 private: // -- data -- //
 
-	struct deleter { void operator()(std::FILE *f) { std::fclose(f); } };
+	// streaming-scan bookkeeping (see streaming_scan()).
+	struct scan_state
+	{
+		std::size_t chunk;   // drop read pages every time this many bytes have been read (0 = off)
+		std::size_t pending; // bytes read since the last drop
+		long long dropped;   // file offset up to which pages have been dropped
+
+		constexpr scan_state() noexcept : chunk(0), pending(0), dropped(0) {}
+	};
+
+	// per-handle state that has to move (and die) together with the FILE* - only allocated once a handle uses it.
+	struct extras
+	{
+		std::FILE *file = nullptr;
+		close_fn closer = nullptr; // closes the file instead of fclose() (see set_closer())
+		owned_buffer buffer;       // the stream's buffer, if this handle owns it
+		scan_state scan;
+	};
+
+	// owns the FILE* in a single word: the FILE* itself, or (tagged) a pointer to the handle's extras, which hold it.
+	// so a plain handle stays pointer sized and pays nothing for custom closers, owned buffers or streaming scan.
+	class handle
+	{
+	private: // -- data -- //
+
+		static constexpr std::uintptr_t tag_extras = 1;   // word points to extras
+		static constexpr std::uintptr_t tag_scanning = 2; // streaming scan is on (only with extras)
+
+		std::uintptr_t word = 0;
+
+		extras *ptr() const noexcept { return reinterpret_cast<extras*>(word & ~(tag_extras | tag_scanning)); }
+
+		// closes file the way x says to (x may be null).
+		static void close_file(std::FILE *file, extras *x)
+		{
+			if (file && x && x->closer) x->closer(file, std::move(x->buffer));
+			else
+			{
+				if (file) std::fclose(file);
+				if (x) x->buffer.reset();
+			}
+		}
+		void destroy()
+		{
+			extras *const x = find();
+			close_file(get(), x);
+			delete x;
+			word = 0;
+		}
+
+	public: // -- ctor / dtor / asgn -- //
+
+		constexpr handle() noexcept = default;
+		explicit handle(std::FILE *file) noexcept : word(reinterpret_cast<std::uintptr_t>(file)) {}
+
+		handle(handle &&other) noexcept : word(std::exchange(other.word, 0)) {}
+		handle &operator=(handle &&other) noexcept
+		{
+			if (this != &other)
+			{
+				destroy();
+				word = std::exchange(other.word, 0);
+			}
+			return *this;
+		}
+
+		~handle() { destroy(); }
+
+	public: // -- interface -- //
+
+		std::FILE *get() const noexcept { return (word & tag_extras) ? ptr()->file : reinterpret_cast<std::FILE*>(word); }
+
+		// returns the extras, or null if this handle has none.
+		extras *find() const noexcept { return (word & tag_extras) ? ptr() : nullptr; }
+		// returns the extras, allocating them on first use.
+		extras &state()
+		{
+			if (!(word & tag_extras))
+			{
+				extras *const x = new extras;
+				x->file = reinterpret_cast<std::FILE*>(word);
+				word = reinterpret_cast<std::uintptr_t>(x) | tag_extras;
+			}
+			return *ptr();
+		}
+
+		bool scanning() const noexcept { return (word & tag_scanning) != 0; }
+		void set_scanning(bool on) noexcept { word = on && (word & tag_extras) ? word | tag_scanning : word & ~tag_scanning; }
+
+		// closes the current file (if any) and takes ownership of file. the extras (and so the handle's modes) are kept.
+		void reset(std::FILE *file = nullptr)
+		{
+			std::FILE *const old = get();
+			if (extras *const x = find())
+			{
+				x->file = file;
+				close_file(old, x);
+			}
+			else
+			{
+				word = reinterpret_cast<std::uintptr_t>(file);
+				if (old) std::fclose(old);
+			}
+		}
+		// gives up ownership of the file without closing it (an owned buffer is never freed - the stream may still use it).
+		std::FILE *release() noexcept
+		{
+			std::FILE *const old = get();
+			if (extras *const x = find())
+			{
+				x->buffer.forget();
+				x->file = nullptr;
+			}
+			else word = 0;
+			return old;
+		}
+	};
+
+	handle f; // the raw file handle
+
+private: // -- buffer access -- //
+
+	// glibc exposes the stdio buffer pointers through the FILE struct, which lets us work with buffered data directly.
+	// on other c libraries the buffer is reported empty and callers take their plain stdio fallback path.
+	// none of these lock the stream - they must not race with other users of the same FILE.
+
+#ifdef __GLIBC__
+	static constexpr int glibc_in_backup = 0x100;         // _IO_IN_BACKUP (internal to glibc)
+	static constexpr int glibc_currently_putting = 0x800; // _IO_CURRENTLY_PUTTING (internal to glibc)
+	static constexpr int glibc_unbuffered = 0x2;          // _IO_UNBUFFERED (internal to glibc)
+	static constexpr int glibc_line_buf = 0x200;          // _IO_LINE_BUF (internal to glibc)
+	static constexpr int glibc_no_writes = 0x8;           // _IO_NO_WRITES (internal to glibc)
+#endif
+
+	// returns true if the buffer of this stream can be accessed directly.
+	static bool buffer_access(std::FILE *file) noexcept
+	{
+#ifdef __GLIBC__
+		return file && file->_mode <= 0;
+#else
+		(void)file;
+		return false;
+#endif
+	}
+
+	// returns true if the get area is currently the ungetc() backup area (the main buffer may still hold unread data).
+	static bool get_in_backup(std::FILE *file) noexcept
+	{
+#ifdef __GLIBC__
+		return file && (file->_flags & glibc_in_backup);
+#else
+		(void)file;
+		return false;
+#endif
+	}
+
+	// returns the number of buffered input bytes that can be consumed without touching the file and points ptr at the first.
+	static std::size_t get_area(std::FILE *file, const char *&ptr) noexcept
+	{
+#ifdef __GLIBC__
+		if (file && !(file->_flags & glibc_currently_putting) && file->_mode <= 0)
+		{
+			ptr = file->_IO_read_ptr;
+			return file->_IO_read_end - file->_IO_read_ptr;
+		}
+#endif
+		ptr = nullptr;
+		return 0;
+	}
+	// consumes count bytes from the get area (count must not exceed the value returned by get_area()).
+	static void get_advance(std::FILE *file, std::size_t count) noexcept
+	{
+#ifdef __GLIBC__
+		file->_IO_read_ptr += count;
+#else
+		(void)file; (void)count;
+#endif
+	}
+	// refills the get area if it is empty (this includes leaving an ungetc() backup area).
+	// returns false on eof/error or if buffer access is not supported.
+	static bool get_fill(std::FILE *file) noexcept
+	{
+#ifdef __GLIBC__
+		if (!file || file->_mode > 0) return false;
+		if (__uflow(file) == EOF) return false;
+		--file->_IO_read_ptr; // __uflow() consumed a char from a fresh get area - put it back
+		return true;
+#else
+		(void)file;
+		return false;
+#endif
+	}
+
+	// returns the free space in the put area of a fully buffered stream and points ptr at it.
+	// a stream that isn't writing yet (or has just been read from) is switched to writing first if that loses no input.
+	// returns 0 if the stream is unbuffered, line buffered or not writable, or if buffer access is not supported.
+	static std::size_t put_area(std::FILE *file, char *&ptr) noexcept
+	{
+#ifdef __GLIBC__
+		ptr = nullptr;
+		if (!file || file->_mode > 0 || (file->_flags & (glibc_no_writes | glibc_unbuffered | glibc_line_buf))) return 0;
+		if (!(file->_flags & glibc_currently_putting))
+		{
+			// __overflow() with EOF enters put mode (allocating the buffer if needed) and writes nothing
+			if (file->_IO_read_ptr != file->_IO_read_end || get_in_backup(file)) return 0;
+			if (__overflow(file, EOF) == EOF || !(file->_flags & glibc_currently_putting)) return 0;
+		}
+		ptr = file->_IO_write_ptr;
+		return file->_IO_write_end - file->_IO_write_ptr;
+#else
+		(void)file;
+		ptr = nullptr;
+		return 0;
+#endif
+	}
+	// returns the size of the put area of an empty buffer (only meaningful once put_area() has found one).
+	static std::size_t put_capacity(std::FILE *file) noexcept
+	{
+#ifdef __GLIBC__
+		return file->_IO_buf_end - file->_IO_buf_base;
+#else
+		(void)file;
+		return 0;
+#endif
+	}
+	// marks count bytes of the put area as written (count must not exceed the value returned by put_area()).
+	static void put_advance(std::FILE *file, std::size_t count) noexcept
+	{
+#ifdef __GLIBC__
+		file->_IO_write_ptr += count;
+#else
+		(void)file; (void)count;
+#endif
+	}
+
+private: // -- page cache -- //
+
+	// counts bytes read for streaming-scan mode (only a test of the handle word unless the mode is on).
+	void scanned(std::size_t count)
+	{
+		if (!f.scanning()) return;
+		scan_state &s = f.find()->scan;
+		if ((s.pending += count) >= s.chunk) drop_scanned();
+	}
+	// drops the pages between the last drop and the current file offset from the page cache.
+	void drop_scanned()
+	{
+		scan_state &s = f.find()->scan;
+		s.pending = 0;
+#ifdef __linux__
+		const int fd = ::fileno(get());
+		const long long off = ::lseek(fd, 0, SEEK_CUR); // the kernel's offset - stdio may have read ahead, but that data is already copied
+		if (off < 0) return;
+		if (off > s.dropped) ::posix_fadvise(fd, (off_t)s.dropped, (off_t)(off - s.dropped), POSIX_FADV_DONTNEED);
+		// only folios entirely inside the range are dropped, and the page cache uses large folios (naturally aligned, up to 2 MiB)
+		// - so the next range starts at the boundary of the one still being read, which catches it once it is done
+		s.dropped = off & ~(long long)((2 << 20) - 1);
+#endif
+	}
+
+	// starts streaming-scan bookkeeping over for a newly opened file (if the mode is on).
+	void restart_scan()
+	{
+		if (f.scanning()) streaming_scan(true, f.find()->scan.chunk);
+	}
+
+#ifdef __linux__
+	int advise(long long offset, long long len, int advice) { return get() ? ::posix_fadvise(::fileno(get()), (off_t)offset, (off_t)len, advice) : EBADF; }
+#endif
+
+public: // -- types -- //
+
+	// describes the buffer a stream currently uses - see buffer_info().
+	struct buffer_desc
+	{
+		char *data;       // start of the buffer (null if none is allocated yet or it can't be inspected)
+		std::size_t size; // size of the buffer in bytes
+		int mode;         // _IOFBF, _IOLBF or _IONBF (-1 if unknown)
+		bool owned;       // the buffer is owned by the handle (set_buffer() or a pool) and freed after the file is closed
+	};
+
+	// a read-only view of buffered input - only valid until the next operation on the stream.
+	struct input_span
+	{
+		const char *ptr;
+		std::size_t len;
+
+		const char *data() const noexcept { return ptr; }
+		std::size_t size() const noexcept { return len; }
+		bool empty() const noexcept { return len == 0; }
+
+		const char *begin() const noexcept { return ptr; }
+		const char *end() const noexcept { return ptr + len; }
 
-	std::unique_ptr<std::FILE, deleter> f; // the raw file handle
+		char operator[](std::size_t i) const noexcept { return ptr[i]; }
+	};
 
 public: // -- ctor / dtor / asgn -- //
 
@@ -53,6 +402,7 @@ public: // -- accessors -- //
 
 	// returns the raw FILE* of this file handle if linked, otherwise null.
 	// after this operation, this file handle is set to unlinked state without closing the file.
+	// a stream buffer owned by this handle is never freed (the stream may still be using it).
 	std::FILE *release() noexcept { return f.release(); }
 
 	// returns true if this file handle is currently linked (to an open file).
@@ -68,23 +418,199 @@ public: // -- file state -- //
 	cfile &open(const char *filename, const char *mode) &
 	{
 		f.reset(std::fopen(filename, mode));
+		restart_scan();
 		return *this;
 	}
 	cfile &open(const char *filename, const char *mode) && = delete;
-
 	// attempts to reuse the file to open a new file or to change the mode of an already open file.
 	// identical to calling freopen() with the stored file pointer.
 	// returns true if the operation succeeds.
-	bool reopen(const char *filename, const char *mode) & { return std::freopen(filename, mode, get()) != nullptr; }
+	bool reopen(const char *filename, const char *mode) &
+	{
+		if (!std::freopen(filename, mode, get())) return false;
+		restart_scan();
+		return true;
+	}
 	bool reopen(const char *filename, const char *mode) && = delete;
 	// convenience function - passes null as filename param to reopen() to facilitate changing file mode for an opened file.
 	// returns tru if the operation succeeds.
-	bool chmode(const char *mode) & { return std::freopen(nullptr, mode, get()) != nullptr; }
+	bool chmode(const char *mode) & { return reopen(nullptr, mode); }
 	bool chmode(const char *mode) && = delete;
 
 	// closes (and flushes) the stream (if any) and enters the unlinked state.
+	// with a closer set (see set_closer()), the closer is called instead of fclose().
 	void close() { f.reset(); }
 
+	// sets the function that closes this handle's files in place of fclose() - null (the default) means fclose().
+	// it is called whenever this handle closes its file (close(), open(), assignment or destruction) and must also release
+	// the owned buffer it is given once the file is closed. deferred_close.h uses this to close files on a background thread.
+	// the closer belongs to the handle - it moves along with the file on move construction/assignment.
+	void set_closer(close_fn fn)
+	{
+		if (fn || f.find()) f.state().closer = fn;
+	}
+	// returns the function that closes this handle's files (null for fclose()).
+	close_fn get_closer() const noexcept { return f.find() ? f.find()->closer : nullptr; }
+
+public: // -- access hints -- //
+
+	// these tell the kernel how the file will be used (posix_fadvise() / readahead() on linux).
+	// they are only hints - they return 0 on success (or where unsupported), otherwise an error number.
+	// ranges are byte offsets in the file - a len of 0 means "to the end of the file".
+
+	// the file will be read sequentially (more aggressive readahead).
+	int sequential()
+	{
+#ifdef __linux__
+		return advise(0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+		return 0;
+#endif
+	}
+	// the file will be accessed in random order (readahead is pointless).
+	int random()
+	{
+#ifdef __linux__
+		return advise(0, 0, POSIX_FADV_RANDOM);
+#else
+		return 0;
+#endif
+	}
+	// back to the default access pattern.
+	int normal()
+	{
+#ifdef __linux__
+		return advise(0, 0, POSIX_FADV_NORMAL);
+#else
+		return 0;
+#endif
+	}
+	// the range will be needed soon - starts reading it into the page cache without waiting for it.
+	int willneed(long long offset, long long len)
+	{
+#ifdef __linux__
+		if (get() && len > 0 && ::readahead(::fileno(get()), (off64_t)offset, (std::size_t)len) == 0) return 0;
+		return advise(offset, len, POSIX_FADV_WILLNEED);
+#else
+		(void)offset; (void)len;
+		return 0;
+#endif
+	}
+	// the range won't be needed again - its (clean) pages are dropped from the page cache.
+	// data still in the stdio buffer is unaffected, but dirty pages are not dropped - flush() and sync first to drop written data.
+	int dontneed(long long offset, long long len)
+	{
+#ifdef __linux__
+		return advise(offset, len, POSIX_FADV_DONTNEED);
+#else
+		(void)offset; (void)len;
+		return 0;
+#endif
+	}
+
+	// enables or disables streaming-scan mode for this handle (off by default).
+	// in streaming-scan mode, every chunk bytes read through read(), gets() or getc() the pages read since the last time are
+	// dropped from the page cache, so a one-pass scan of a huge file doesn't evict everyone else's data. enabling it also
+	// hints sequential access. pages before the current position (rounded down to 2 MiB) are left alone. linux only.
+	// the mode belongs to the handle - it moves along with the file on move construction/assignment, and carries over to
+	// files opened later (starting over from their current position). while it is off, reads only test a bit of the handle.
+	void streaming_scan(bool enable = true, std::size_t chunk = 8 << 20)
+	{
+		if (!enable && !f.find()) return;
+		scan_state &s = f.state().scan;
+		s.chunk = enable ? std::max<std::size_t>(chunk, 1) : 0;
+		f.set_scanning(enable);
+		s.pending = 0;
+#ifdef __linux__
+		if (enable && get())
+		{
+			const long long off = ::lseek(::fileno(get()), 0, SEEK_CUR);
+			s.dropped = off > 0 ? off : 0;
+			sequential();
+		}
+#endif
+	}
+	// returns true if this handle is in streaming-scan mode.
+	bool streaming_scan_enabled() const noexcept { return f.scanning(); }
+
+public: // -- file layout -- //
+
+	// these work on the underlying file rather than the stream. they return 0 on success, otherwise an error number
+	// (ENOTSUP where the platform or filesystem can't do it).
+
+	// reserves disk space for the first size bytes of the file up front, so a large file written afterwards is allocated in
+	// as few extents as possible (and running out of space shows up now rather than halfway through).
+	// if extend is false the visible file size is unchanged (FALLOC_FL_KEEP_SIZE) - a file written sequentially then simply
+	// grows into the reserved space. if extend is true the file is made at least size bytes long (reading back zeros).
+	int preallocate(long long size, bool extend = false)
+	{
+		if (!get()) return EBADF;
+#ifdef __linux__
+		const int fd = ::fileno(get());
+		if (::fallocate(fd, extend ? 0 : FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0) return 0;
+		if (errno != EOPNOTSUPP || !extend) return errno;
+		return ::posix_fallocate(fd, 0, (off_t)size); // may fall back to writing zeros, which only works if extending
+#else
+		(void)size; (void)extend;
+		return ENOTSUP;
+#endif
+	}
+
+	// deallocates the range (it reads back as zeros afterwards) without changing the file size.
+	// buffered output is flushed first (and buffered input discarded) so the stream never sees stale data.
+	int punch_hole(long long offset, long long len)
+	{
+		if (!get()) return EBADF;
+		flush();
+#ifdef __linux__
+		return ::fallocate(::fileno(get()), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len) == 0 ? 0 : errno;
+#else
+		(void)offset; (void)len;
+		return ENOTSUP;
+#endif
+	}
+
+	// finds the first data extent (a range that isn't a hole) at or after offset, storing it as [begin, end).
+	// returns false if there is no more data. where holes can't be detected the rest of the file is one data extent.
+	// the stream position is not affected.
+	bool next_data(long long offset, long long &begin, long long &end)
+	{
+		if (!get()) return false;
+		flush(); // the file has to reflect what was written through the stream
+#ifdef __linux__
+		const int fd = ::fileno(get());
+		const off_t saved = ::lseek(fd, 0, SEEK_CUR); // SEEK_DATA/SEEK_HOLE move the offset stdio relies on
+		off_t b = ::lseek(fd, (off_t)offset, SEEK_DATA);
+		off_t e = b >= 0 ? ::lseek(fd, b, SEEK_HOLE) : -1;
+		const int err = errno;
+		::lseek(fd, saved, SEEK_SET);
+		if (b >= 0 && e >= 0)
+		{
+			begin = b;
+			end = e;
+			return true;
+		}
+		if (err == ENXIO) return false; // no data at or after offset
+#endif
+		// can't tell holes from data
+		std::fpos_t pos;
+		if (std::fgetpos(get(), &pos) != 0 || std::fseek(get(), 0, SEEK_END) != 0) return false;
+		const long long size = std::ftell(get());
+		std::fsetpos(get(), &pos);
+		if (offset >= size) return false;
+		begin = offset;
+		end = size;
+		return true;
+	}
+
+	// calls callback(begin, end) for every data extent at or after offset (see next_data()).
+	// this lets sparse files be copied or scanned without reading their holes.
+	template<typename F>
+	void for_each_data(F &&callback, long long offset = 0)
+	{
+		for (long long begin, end; next_data(offset, begin, end); offset = end) callback(begin, end);
+	}
+
 	// flushes the stream.
 	void flush() { std::fflush(get()); }
 
@@ -98,6 +624,67 @@ public: // -- file state -- //
 	// sets the buffer used by this stream.
 	// equivalent to calling setvbuf() with the stored file pointer.
 	int setvbuf(char *buffer, int mode, std::size_t size) { return std::setvbuf(get(), buffer, mode, size); }
+	// sets the buffer used by this stream to buffer, which this handle then owns and releases once the file is closed
+	// (after fclose(), so it can never dangle) - see buffer_pool::install() for an example.
+	// like any setvbuf() call, this must come before any other operation on the stream.
+	// returns 0 on success, otherwise nonzero, the stream buffer is left unchanged and buffer still belongs to the caller.
+	int adopt_buffer(owned_buffer &&buffer)
+	{
+		if (!get() || !buffer.data) return -1;
+		owned_buffer &own = f.state().buffer;
+		if (std::setvbuf(get(), buffer.data, buffer.mode, buffer.size) != 0) return -1;
+		// the old buffer (if owned) was never used - setvbuf() only works on untouched streams
+		own.reset();
+		own = std::move(buffer);
+		return 0;
+	}
+	// sets the buffer used by this stream to a freshly allocated one of size bytes (e.g. 4-16 MiB for big sequential io).
+	// alignment (0 = malloc's, else a power of two) and huge_pages are as in buffer_alloc::allocate().
+	// like any setvbuf() call, this must come before any other operation on the stream.
+	// the buffer is owned by this handle and freed once the file is closed (after fclose(), so it can never dangle).
+	// returns 0 on success, otherwise nonzero and the stream buffer is left unchanged.
+	int set_buffer(std::size_t size, int mode = _IOFBF, std::size_t alignment = 0, bool huge_pages = false)
+	{
+		if (!get() || size == 0) return -1;
+		if (alignment <= alignof(std::max_align_t)) alignment = 0; // plain malloc either way
+		char *const data = buffer_alloc::allocate(size, alignment, huge_pages);
+		if (!data) return -1;
+
+		// pack the allocation parameters into ctx so the release function knows how to free it
+		const std::size_t how = alignment | (huge_pages ? 1 : 0); // alignment is now 0 or a power of two > 1, so bit 0 is free
+		owned_buffer own(data, size, mode, [](char *d, std::size_t n, void *ctx)
+		{
+			const std::size_t h = reinterpret_cast<std::size_t>(ctx);
+			buffer_alloc::deallocate(d, n, h & ~(std::size_t)1, h & 1);
+		}, reinterpret_cast<void*>(how));
+		if (adopt_buffer(std::move(own)) != 0)
+		{
+			buffer_alloc::deallocate(data, size, alignment, huge_pages);
+			return -1;
+		}
+		return 0;
+	}
+
+	// returns a description of the buffer this stream currently uses.
+	// on glibc this reflects the stream itself (a stream that hasn't done any io yet may not have allocated its buffer).
+	// elsewhere only a buffer owned by this handle can be reported.
+	buffer_desc buffer_info() const noexcept
+	{
+		const extras *const x = f.find();
+		const owned_buffer *const own = x && x->buffer.data ? &x->buffer : nullptr;
+		buffer_desc res{ nullptr, 0, -1, false };
+		if (!get()) return res;
+#ifdef __GLIBC__
+		std::FILE *const file = get();
+		res.data = file->_IO_buf_base;
+		res.size = file->_IO_buf_end - file->_IO_buf_base;
+		res.mode = (file->_flags & glibc_unbuffered) ? _IONBF : (file->_flags & glibc_line_buf) ? _IOLBF : _IOFBF;
+		res.owned = own && res.data == own->data;
+#else
+		if (own) res = buffer_desc{ own->data, own->size, own->mode, true };
+#endif
+		return res;
+	}
 
 	// gets the current position in the stream.
 	// equivalent to calling fgetpos() with the stored file pointer.
@@ -132,32 +719,269 @@ public: // -- input -- //
 
 	// gets a character from the file.
 	// functions identically to calling fgetc() with the stored file pointer.
-	int getc() { return std::fgetc(get()); }
+	int getc()
+	{
+		const int ch = std::fgetc(get());
+		scanned(1);
+		return ch;
+	}
 
 	// puts a character that was just read back into the stream.
 	// functions identically to calling ungetc() with the stored file pointer.
 	int ungetc(int ch) { return std::ungetc(ch, get()); }
-	// convenience function - equivalent to getting a character, then putting it back, and returning it.
-	int peek() { return std::ungetc(std::fgetc(get()), get()); }
+	// returns the next character without consuming it (EOF at eof).
+	// looks at the stream buffer directly (refilling it if empty), so it's cheap and plays well with a preceding ungetc().
+	// where the buffer can't be inspected this is equivalent to getting a character, then putting it back, and returning it.
+	int peek()
+	{
+		const char *ptr;
+		if (get_area(get(), ptr) || (get_fill(get()) && get_area(get(), ptr))) return (unsigned char)*ptr;
+		if (!buffer_access(get())) return std::ungetc(std::fgetc(get()), get());
+		return EOF;
+	}
+	// returns a view of up to the next count bytes of input without consuming them, refilling the buffer first if it's empty.
+	// the view holds fewer than count bytes if the buffer ends sooner - consume() what it has and peek again for more.
+	// an empty view means eof (or an error), or that the buffer can't be inspected (then eof() is false - use read() instead).
+	input_span peek(std::size_t count)
+	{
+		const char *ptr;
+		std::size_t avail = get_area(get(), ptr);
+		if (!avail && get_fill(get())) avail = get_area(get(), ptr);
+		return input_span{ ptr, std::min(avail, count) };
+	}
+	// consumes count bytes of input that were just looked at with peek(count) (count must not exceed that view's size).
+	void consume(std::size_t count)
+	{
+		get_advance(get(), count);
+		scanned(count);
+	}
+
+private: // -- chunk helpers -- //
+
+	template<typename F>
+	static bool call_chunk(F &callback, input_span span, std::true_type) { callback(span); return true; }
+	template<typename F>
+	static bool call_chunk(F &callback, input_span span, std::false_type) { return (bool)callback(span); }
+
+public: // -- chunked input -- //
+
+	// a range over the rest of the input, one contiguous span of the stream buffer at a time (see chunks()).
+	// the stream must not be used otherwise while iterating.
+	class chunk_range
+	{
+	private: // -- data -- //
+
+		friend class cfile;
+
+		cfile *file;
+		input_span cur;
+		std::unique_ptr<char[]> fallback; // where the buffer can't be inspected, spans are read into this instead
+		bool fallback_span = false;       // cur points into fallback (already consumed from the stream)
+
+		static constexpr std::size_t fallback_size = 64 << 10;
+
+		explicit chunk_range(cfile &f) : file(&f), cur{ nullptr, 0 } { fetch(); }
+
+		void fetch()
+		{
+			cur = file->peek((std::size_t)-1);
+			fallback_span = false;
+			if (cur.empty() && !buffer_access(file->get()) && file->get())
+			{
+				if (!fallback) fallback.reset(new char[fallback_size]);
+				cur = input_span{ fallback.get(), std::fread(fallback.get(), 1, fallback_size, file->get()) };
+				fallback_span = true;
+			}
+		}
+		void advance()
+		{
+			if (!fallback_span) file->consume(cur.size());
+			fetch();
+		}
+
+	public: // -- iteration -- //
+
+		class iterator
+		{
+		private: // -- data -- //
+
+			friend class chunk_range;
+			chunk_range *range;
+
+			explicit iterator(chunk_range *r) noexcept : range(r) {}
+
+		public: // -- interface -- //
+
+			typedef std::input_iterator_tag iterator_category;
+			typedef input_span value_type;
+			typedef std::ptrdiff_t difference_type;
+			typedef const input_span *pointer;
+			typedef const input_span &reference;
+
+			reference operator*() const noexcept { return range->cur; }
+			pointer operator->() const noexcept { return &range->cur; }
+
+			// consumes the current span and moves to the next one.
+			iterator &operator++() { range->advance(); return *this; }
+
+			// iterators only compare equal when both are at the end.
+			bool operator==(const iterator &other) const noexcept { return at_end() && other.at_end(); }
+			bool operator!=(const iterator &other) const noexcept { return !(*this == other); }
+
+		private:
+
+			bool at_end() const noexcept { return !range || range->cur.empty(); }
+		};
+
+		iterator begin() noexcept { return iterator(this); }
+		iterator end() noexcept { return iterator(nullptr); }
+	};
+
+	// returns a range over the rest of the input as contiguous spans of the stream buffer, e.g.
+	//     for (cfile::input_span span : file.chunks()) for (char ch : span) ...
+	// each span is consumed when the iteration moves past it - leaving the loop early leaves the stream at the start of the
+	// current span. spans are refilled only at span boundaries, so per-character work runs over raw memory.
+	chunk_range chunks() { return chunk_range(*this); }
+
+	// calls callback(input_span) for each contiguous span of the rest of the input (see chunks()) and returns the number
+	// of bytes handed over. each span is consumed once the callback returns. if the callback returns something other than
+	// void, returning false stops the iteration (after that span).
+	template<typename F>
+	std::size_t for_each_chunk(F &&callback)
+	{
+		typedef std::is_void<decltype(callback(std::declval<input_span>()))> returns_void;
+		std::size_t total = 0;
+		chunk_range range(*this);
+		for (; !range.cur.empty(); range.advance())
+		{
+			total += range.cur.size();
+			if (!call_chunk(callback, range.cur, returns_void()))
+			{
+				if (!range.fallback_span) consume(range.cur.size());
+				break;
+			}
+		}
+		return total;
+	}
+
+	// returns the number of bytes that can be read without touching the underlying file (i.e. already buffered).
+	// a read() of at most this many bytes never blocks or issues a system call.
+	// always 0 where the c library's buffer can't be inspected.
+	std::size_t in_avail() const noexcept
+	{
+		const char *ptr;
+		return get_area(get(), ptr);
+	}
+
+	// skips the next count bytes of input and returns how many were skipped (fewer only at eof or on error).
+	// bytes already buffered are skipped in place. if the rest to skip is at least a buffer's worth, the stream seeks
+	// over it instead of reading it (stopping at the current end of the file).
+	// otherwise (or if the stream can't seek) the buffer is refilled and skipping continues in it.
+	std::size_t skip(std::size_t count)
+	{
+		std::size_t done = 0;
+		for (const char *ptr; done < count; )
+		{
+			const std::size_t avail = get_area(get(), ptr);
+			if (avail)
+			{
+				const std::size_t n = std::min(avail, count - done);
+				get_advance(get(), n);
+				scanned(n);
+				done += n;
+				continue;
+			}
+			if (get_in_backup(get()) && get_fill(get())) continue;
+
+			const buffer_desc b = buffer_info();
+			const std::size_t rest = count - done;
+			const bool wide = std::fwide(get(), 0) > 0; // its byte buffer isn't ours to use - seek over any distance instead
+			if ((wide || rest >= std::max<std::size_t>(b.size, BUFSIZ)) && rest <= (std::size_t)std::numeric_limits<long>::max())
+			{
+				// seek no further than eof - the stream is empty here, so its position is the file's
+				const long cur = std::ftell(get());
+				if (cur >= 0 && std::fseek(get(), 0, SEEK_END) == 0)
+				{
+					const long end = std::ftell(get());
+					const std::size_t n = end > cur ? std::min(rest, (std::size_t)(end - cur)) : 0;
+					if (end < 0 || std::fseek(get(), cur + (long)n, SEEK_SET) != 0) return done;
+					scanned(n);
+					return done + n;
+				}
+			}
+
+#ifdef __GLIBC__
+			if (!wide)
+			{
+				if (!get_fill(get())) break;
+				continue;
+			}
+#endif
+			if (std::fgetc(get()) == EOF) break; // no buffer access - plain reads
+			scanned(1);
+			++done;
+		}
+		return done;
+	}
+
+	// skips input up to and including the next occurrence of delim (found with memchr() over the buffered data).
+	// returns delim if it was found, otherwise EOF (everything up to eof was skipped).
+	int skip_until(char delim)
+	{
+		for (const char *ptr; ; )
+		{
+			const std::size_t avail = get_area(get(), ptr);
+			if (avail)
+			{
+				const char *const hit = static_cast<const char*>(std::memchr(ptr, delim, avail));
+				const std::size_t n = hit ? (std::size_t)(hit - ptr) + 1 : avail;
+				get_advance(get(), n);
+				scanned(n);
+				if (hit) return (unsigned char)delim;
+				continue;
+			}
+#ifdef __GLIBC__
+			if (buffer_access(get()))
+			{
+				if (!get_fill(get())) return EOF;
+				continue;
+			}
+#endif
+			const int ch = std::fgetc(get()); // no buffer access - plain reads
+			if (ch == EOF) return EOF;
+			scanned(1);
+			if (ch == (unsigned char)delim) return ch;
+		}
+	}
 
 	// reads at most num-1 chars into the specified buffer.
 	// functions identically to calling fgets() with the stored file pointer.
-	char *gets(char *str, int num) { return std::fgets(str, num, get()); }
+	char *gets(char *str, int num)
+	{
+		char *const r = std::fgets(str, num, get());
+		if (r && f.scanning()) scanned(std::strlen(r));
+		return r;
+	}
 	// convenience function - given a buffer of known size calls gets() with correct size arg.
 	template<int len>
-	char *gets(char(&str)[len]) { return std::fgets(str, len, get()); }
+	char *gets(char(&str)[len]) { return gets(str, len); }
 
 	// reads (count) elements of size (size) from the file (binary data).
 	// functions identically to calling fread() with the stored file pointer.
-	std::size_t read(void *ptr, std::size_t size, std::size_t count) { return std::fread(ptr, size, count, get()); }
+	std::size_t read(void *ptr, std::size_t size, std::size_t count)
+	{
+		const std::size_t r = std::fread(ptr, size, count, get());
+		scanned(r * size);
+		return r;
+	}
 	// convenience function - passes correct size parameter to read() based on T.
 	// additionally, guarantees that T is a valid type to be read in this manner.
 	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
-	std::size_t read(T *ptr, std::size_t count) { return std::fread(ptr, sizeof(T), count, get()); }
+	std::size_t read(T *ptr, std::size_t count) { return read(static_cast<void*>(ptr), sizeof(T), count); }
 	// convenience function - passes correct size and count parameters to read() based on T and length of array.
 	// additionally, guarantees that T is a valid type to be read in this manner.
 	template<typename T, int len, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
-	std::size_t read(T(&ptr)[len]) { return std::fread(ptr, sizeof(T), len, get()); }
+	std::size_t read(T(&ptr)[len]) { return read(static_cast<void*>(ptr), sizeof(T), len); }
 
 	// prints a formatted string to the file.
 	// equivalent to calling fprintf() with the stored file pointer.
@@ -192,6 +1016,24 @@ public: // -- output -- //
 	template<typename T, int len, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
 	std::size_t write(T(&ptr)[len]) { return std::fwrite(ptr, sizeof(T), len, get()); }
 
+	// returns a pointer to count bytes of free space in the stream buffer (flushing it first if there isn't enough room).
+	// write the output there and then commit() it - this skips the copy and the per-call overhead of fwrite().
+	// returns null if count bytes can't be provided (count exceeds the buffer, the stream is unbuffered or line buffered,
+	// the flush failed, or the buffer can't be accessed) - use write() instead.
+	char *reserve(std::size_t count)
+	{
+		char *ptr;
+		std::size_t avail = put_area(get(), ptr);
+		if (avail >= count) return ptr;
+		// a flush can't make room for more than the whole buffer - don't write anything out for nothing
+		if (!ptr || count > put_capacity(get()) || std::fflush(get()) != 0) return nullptr;
+		avail = put_area(get(), ptr);
+		return avail >= count ? ptr : nullptr;
+	}
+	// emits count bytes written at the pointer returned by the last reserve() (count must not exceed the size reserved).
+	// nothing else may be done with the stream between the two calls.
+	void commit(std::size_t count) { put_advance(get(), count); }
+
 	// reads a formatted string from the file.
 	// equivalent to calling fscanf() with the stored file pointer.
 	int scanf(const char *fmt, ...)
@@ -202,6 +1044,106 @@ public: // -- output -- //
 		va_end(v);
 		return r;
 	}
+
+public: // -- transfer -- //
+
+	// moves up to len bytes from this file to dst (or until eof) and returns the number of bytes moved.
+	// any bytes already buffered by this stream are written to dst first, then dst is flushed.
+	// on linux the rest is moved kernel-side with splice() (through an intermediate pipe if neither end is a pipe).
+	// otherwise (or if the kernel refuses, e.g. dst was opened in append mode) this falls back to a read/write copy loop.
+	// the file position of both streams is left consistent with the bytes moved.
+	std::size_t splice_to(cfile &dst, std::size_t len = (std::size_t)-1)
+	{
+		if (!*this || !dst) return 0;
+
+		std::size_t total = 0;
+
+		// drain whatever stdio has already buffered for us - the kernel doesn't know about it
+		for (const char *ptr; total < len; )
+		{
+			std::size_t avail = get_area(get(), ptr);
+			if (avail == 0)
+			{
+				if (get_in_backup(get()) && get_fill(get())) continue;
+				break;
+			}
+
+			avail = std::min(avail, len - total);
+			std::size_t written = std::fwrite(ptr, 1, avail, dst.get());
+			get_advance(get(), written);
+			total += written;
+			if (written != avail) return total;
+		}
+		if (total == len || std::fflush(dst.get()) != 0) return total;
+		const std::size_t drained = total;
+
+#ifdef __linux__
+		// emptying the buffers also drops glibc's cached file offsets, so ftell() etc. stay correct after raw transfers
+		std::fflush(get());
+
+		const int in = ::fileno(get()), out = ::fileno(dst.get());
+		struct stat in_st, out_st;
+		// the kernel refuses to splice into append-mode files
+		if (::fstat(in, &in_st) == 0 && ::fstat(out, &out_st) == 0 && !(::fcntl(out, F_GETFL) & O_APPEND))
+		{
+			const std::size_t chunk = (std::size_t)1 << 20;
+			const bool direct = S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode);
+
+			int p[2] = { -1, -1 };
+			if (direct || ::pipe2(p, O_CLOEXEC) == 0)
+			{
+				bool eof = false, fallback = false;
+				while (total < len)
+				{
+					const std::size_t want = std::min(chunk, len - total);
+					ssize_t n;
+
+					if (direct) n = ::splice(in, nullptr, out, nullptr, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+					else
+					{
+						n = ::splice(in, nullptr, p[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+						// pump everything that made it into the pipe out the other side before continuing
+						for (ssize_t left = n; left > 0; )
+						{
+							ssize_t m = ::splice(p[0], nullptr, out, nullptr, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+							if (m < 0 && errno == EINTR) continue;
+							if (m <= 0) { ::close(p[0]); ::close(p[1]); return total + (n - left); }
+							left -= m;
+						}
+					}
+
+					if (n > 0) total += n;
+					else if (n == 0) { eof = true; break; }
+					else if (errno == EINTR) continue;
+					else { fallback = total == drained && (errno == EINVAL || errno == ENOSYS); break; }
+				}
+				if (!direct) { ::close(p[0]); ::close(p[1]); }
+
+				if (eof)
+				{
+#ifdef __GLIBC__
+					get()->_flags |= _IO_EOF_SEEN; // mirror what fread() would have reported
+#endif
+					return total;
+				}
+				if (!fallback) return total;
+			}
+		}
+#endif
+
+		// portable fallback - plain copy loop through a user buffer
+		const std::size_t chunk = 64 * 1024;
+		std::unique_ptr<char[]> buf(new char[chunk]);
+		while (total < len)
+		{
+			std::size_t n = std::fread(buf.get(), 1, std::min(chunk, len - total), get());
+			std::size_t written = std::fwrite(buf.get(), 1, n, dst.get());
+			total += written;
+			if (written != n || n == 0) break;
+		}
+		std::fflush(dst.get());
+		return total;
+	}
 };
 
 #endif
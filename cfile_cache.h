@@ -0,0 +1,230 @@
+#ifndef DRAGAZO_CFILE_CACHE_H
+#define DRAGAZO_CFILE_CACHE_H
+
+#include <cstdio>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "cfile.h"
+
+// keeps recently used files open so that code touching the same files over and over doesn't pay fopen()/fclose() every time.
+// handles are keyed by (path, mode) and handed out as leases - a leased handle is never closed, and once every lease on it is
+// released it becomes a candidate for eviction (least recently used first) whenever the cache is over capacity.
+// the capacity is always kept below the process descriptor limit (RLIMIT_NOFILE) so the cache can't starve the rest of the program.
+// cached handles keep their state between leases (notably the file position), and evicting one closes (and so flushes) it.
+// a handle evicted and later reopened is opened again with its original mode, so "w" modes truncate again - cache "r+b" or "ab" instead.
+// not thread safe - use one cache per thread (or guard it externally).
+class cfile_cache
+{
+private: // -- data -- //
+
+	struct entry
+	{
+		cfile file;
+		std::string key;
+		std::size_t leases = 0;
+		std::list<entry*>::iterator pos; // position in lru
+	};
+
+	std::unordered_map<std::string, entry> entries;
+	std::list<entry*> lru; // most recently used first
+	std::size_t cap;
+
+	std::size_t hit_count = 0, miss_count = 0;
+
+	static std::string make_key(const char *path, const char *mode)
+	{
+		std::string key(mode);
+		key.push_back('\0'); // modes never contain a null, so this can't collide
+		key += path;
+		return key;
+	}
+
+	// closes unleased handles (oldest first) until the cache is within capacity.
+	void trim()
+	{
+		for (auto it = lru.end(); entries.size() > cap && it != lru.begin(); )
+		{
+			entry *const e = *--it;
+			if (e->leases != 0) continue;
+			it = lru.erase(it);
+			entries.erase(entries.find(e->key));
+		}
+	}
+
+	void release(entry *e)
+	{
+		if (--e->leases == 0 && entries.size() > cap) trim();
+	}
+
+public: // -- types -- //
+
+	// a lease on a cached handle - the handle stays open at least until the lease is destroyed.
+	// a default constructed (or failed) lease holds no handle.
+	class lease
+	{
+	private: // -- data -- //
+
+		friend class cfile_cache;
+
+		cfile_cache *owner = nullptr;
+		entry *e = nullptr;
+
+		lease(cfile_cache &c, entry *_e) : owner(&c), e(_e) { ++e->leases; }
+
+	public: // -- ctor / dtor / asgn -- //
+
+		lease() = default;
+
+		lease(const lease&) = delete;
+		lease &operator=(const lease&) = delete;
+
+		lease(lease &&other) noexcept : owner(other.owner), e(other.e) { other.owner = nullptr; other.e = nullptr; }
+		lease &operator=(lease &&other) noexcept
+		{
+			using std::swap;
+			swap(owner, other.owner);
+			swap(e, other.e);
+			return *this;
+		}
+
+		~lease() { reset(); }
+
+	public: // -- access -- //
+
+		// gives up the lease (if any) and becomes empty.
+		void reset()
+		{
+			if (e) owner->release(e);
+			owner = nullptr;
+			e = nullptr;
+		}
+
+		// returns true if this lease holds an open handle.
+		explicit operator bool() const noexcept { return e != nullptr; }
+		// returns true if this lease holds no handle.
+		bool operator!() const noexcept { return e == nullptr; }
+
+		// accesses the leased handle - undefined if the lease is empty.
+		cfile &operator*() const noexcept { return e->file; }
+		cfile *operator->() const noexcept { return &e->file; }
+	};
+
+public: // -- ctor / dtor / asgn -- //
+
+	// the capacity used when none is given.
+	// bigger isn't free: glibc's fclose() scans the list of all open streams, and the lru victim is always at its far end.
+	static constexpr std::size_t default_capacity = 1024;
+
+	// creates a cache holding up to capacity open handles (clamped to what the descriptor limit allows).
+	explicit cfile_cache(std::size_t capacity = default_capacity) : cap(std::min(capacity, max_capacity())) {}
+
+	cfile_cache(const cfile_cache&) = delete;
+	cfile_cache &operator=(const cfile_cache&) = delete;
+
+	// every lease must have been released before the cache is destroyed.
+	~cfile_cache() = default;
+
+public: // -- cache state -- //
+
+	// returns the most handles a cache may keep open: half of the soft descriptor limit (the rest is left to the program).
+	// returns 256 where the limit can't be queried.
+	static std::size_t max_capacity() noexcept
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		struct rlimit rl;
+		if (::getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) return std::max<std::size_t>((std::size_t)rl.rlim_cur / 2, 1);
+#endif
+		return 256;
+	}
+
+	// returns the capacity of the cache.
+	std::size_t capacity() const noexcept { return cap; }
+	// returns the number of handles currently open (may briefly exceed capacity while too many are leased).
+	std::size_t size() const noexcept { return entries.size(); }
+
+	// returns the number of acquire() calls served by an already open handle.
+	std::size_t hits() const noexcept { return hit_count; }
+	// returns the number of acquire() calls that had to open the file.
+	std::size_t misses() const noexcept { return miss_count; }
+
+	// changes the capacity (clamped like the constructor) and evicts handles if now over it.
+	void set_capacity(std::size_t capacity)
+	{
+		cap = std::min(capacity, max_capacity());
+		trim();
+	}
+
+	// flushes every open handle.
+	void flush()
+	{
+		for (entry *e : lru) e->file.flush();
+	}
+
+	// closes every handle that isn't leased.
+	void clear()
+	{
+		const std::size_t old = cap;
+		cap = 0;
+		trim();
+		cap = old;
+	}
+
+	// closes a file's handle if it is open and not leased (e.g. before renaming or deleting the file).
+	// returns true if no handle for it remains open.
+	bool evict(const char *path, const char *mode)
+	{
+		auto it = entries.find(make_key(path, mode));
+		if (it == entries.end()) return true;
+		if (it->second.leases != 0) return false;
+		lru.erase(it->second.pos);
+		entries.erase(it);
+		return true;
+	}
+
+public: // -- access -- //
+
+	// leases the handle for a file opened with the given mode, opening it (equivalent to cfile(path, mode)) if it isn't cached.
+	// if the file can't be opened the returned lease is empty and nothing is cached.
+	// the cache only goes over capacity if every cached handle is leased - it shrinks back as leases are released.
+	lease acquire(const char *path, const char *mode)
+	{
+		std::string key = make_key(path, mode);
+		auto it = entries.find(key);
+		if (it != entries.end())
+		{
+			++hit_count;
+			lru.splice(lru.begin(), lru, it->second.pos);
+			return lease(*this, &it->second);
+		}
+
+		++miss_count;
+		if (entries.size() >= cap)
+		{
+			// make room before opening, so we never hold more descriptors than allowed
+			const std::size_t old = cap;
+			cap = cap > 0 ? cap - 1 : 0;
+			trim();
+			cap = old;
+		}
+
+		cfile f(path, mode);
+		if (!f) return lease();
+
+		entry &e = entries[key];
+		e.file = std::move(f);
+		e.key = std::move(key);
+		lru.push_front(&e);
+		e.pos = lru.begin();
+		return lease(*this, &e);
+	}
+};
+
+#endif
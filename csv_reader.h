@@ -0,0 +1,287 @@
+#ifndef DRAGAZO_CSV_READER_H
+#define DRAGAZO_CSV_READER_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef __PCLMUL__
+#include <wmmintrin.h>
+#endif
+
+#include "cfile.h"
+
+// reads rows of RFC 4180 csv (or any single-char delimiter, e.g. tsv) from a cfile.
+// input is classified 64 bytes at a time with simd compares into bitmasks of quotes, delimiters and newlines; the regions
+// inside quotes come from a prefix-xor of the quote mask (carried across blocks), so structural characters are found
+// without looking at bytes one at a time.
+// fields are returned as views. whenever a row lies entirely in the stream buffer and its fields need no unescaping, the
+// views point straight into the stream buffer (zero copy) - rows split across buffer refills are gathered into an internal
+// buffer, and only quoted fields containing doubled quotes ("") are copied to be unescaped.
+// views are only valid until the next call to next() (or any other use of the stream).
+// quoted fields may contain delimiters and newlines. \r\n line endings are accepted and empty lines are skipped - so a
+// row of a single empty field has to be written as "" to be read back (csv_writer does).
+class csv_reader
+{
+public: // -- types -- //
+
+	typedef cfile::input_span field;
+
+private: // -- data -- //
+
+	cfile &file;
+	const char delim, quote;
+
+	std::vector<field> fields;
+	std::vector<std::size_t> bounds; // offsets of the structural delimiters of the row being scanned (relative to its start)
+	std::vector<char> carry;         // a row gathered across buffer refills
+	std::vector<char> unescaped;     // storage for unescaped fields (reserved per row so it never moves)
+	std::vector<char> own;           // input read with fread() where the stream buffer can't be inspected
+	std::size_t own_pos = 0;
+	bool use_own = false;
+
+	std::size_t pending = 0;         // bytes of the current row still to be consumed from the stream
+	std::size_t rows = 0, copied = 0;
+
+	struct masks
+	{
+		std::uint64_t quote, delim, newline;
+	};
+
+	// computes the quote/delimiter/newline masks of the 64 bytes at p (bit i = byte i).
+	void classify(const char *p, masks &m) const noexcept
+	{
+#if defined(__AVX2__)
+		const __m256i q = _mm256_set1_epi8(quote), d = _mm256_set1_epi8(delim), n = _mm256_set1_epi8('\n');
+		const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+		const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+		auto mask = [&](__m256i c) { return (std::uint64_t)(std::uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, c)) | (std::uint64_t)(std::uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, c)) << 32; };
+		m.quote = mask(q); m.delim = mask(d); m.newline = mask(n);
+#elif defined(__SSE2__) || defined(_M_X64)
+		const __m128i q = _mm_set1_epi8(quote), d = _mm_set1_epi8(delim), n = _mm_set1_epi8('\n');
+		m.quote = m.delim = m.newline = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+			m.quote |= (std::uint64_t)(std::uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, q)) << (16 * i);
+			m.delim |= (std::uint64_t)(std::uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, d)) << (16 * i);
+			m.newline |= (std::uint64_t)(std::uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, n)) << (16 * i);
+		}
+#else
+		m.quote = m.delim = m.newline = 0;
+		for (int i = 0; i < 64; ++i)
+		{
+			m.quote |= (std::uint64_t)(p[i] == quote) << i;
+			m.delim |= (std::uint64_t)(p[i] == delim) << i;
+			m.newline |= (std::uint64_t)(p[i] == '\n') << i;
+		}
+#endif
+	}
+
+	// bit i of the result is the parity of the quotes at or before i - i.e. set for bytes inside quotes (and opening quotes).
+	static std::uint64_t prefix_xor(std::uint64_t x) noexcept
+	{
+#ifdef __PCLMUL__
+		return (std::uint64_t)_mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_set_epi64x(0, (long long)x), _mm_set1_epi8(-1), 0));
+#else
+		x ^= x << 1; x ^= x << 2; x ^= x << 4; x ^= x << 8; x ^= x << 16; x ^= x << 32;
+		return x;
+#endif
+	}
+
+	static unsigned ctz(std::uint64_t x) noexcept
+	{
+#if defined(__GNUC__)
+		return (unsigned)__builtin_ctzll(x);
+#else
+		unsigned n = 0;
+		while (!(x & 1)) { x >>= 1; ++n; }
+		return n;
+#endif
+	}
+
+	// scans data[0, len) for the structural newline ending the current row (continuing the quote state in in_quote),
+	// recording structural delimiters in bounds at base + their offset. returns the newline's offset, or len if there is none.
+	bool in_quote = false;
+	std::size_t find_row_end(const char *data, std::size_t len, std::size_t base)
+	{
+		masks m;
+		char tail[64];
+		for (std::size_t i = 0; i < len; i += 64)
+		{
+			const char *block = data + i;
+			const std::size_t n = std::min<std::size_t>(len - i, 64);
+			if (n < 64)
+			{
+				// pad the last partial block with nulls (which match nothing)
+				std::memset(tail, 0, sizeof(tail));
+				std::memcpy(tail, block, n);
+				block = tail;
+			}
+			classify(block, m);
+
+			const std::uint64_t inside = prefix_xor(m.quote) ^ (in_quote ? ~(std::uint64_t)0 : 0);
+			for (std::uint64_t structural = (m.delim | m.newline) & ~inside; structural; structural &= structural - 1)
+			{
+				const unsigned bit = ctz(structural);
+				if (m.newline >> bit & 1)
+				{
+					in_quote = false;
+					return i + bit;
+				}
+				bounds.push_back(base + i + bit);
+			}
+			in_quote = (inside >> (n - 1) & 1) != 0;
+		}
+		return len;
+	}
+
+	// splits the row data[0, len) at the recorded bounds into fields.
+	void split(const char *data, std::size_t len)
+	{
+		if (len > 0 && data[len - 1] == '\r') --len;
+		fields.clear();
+		unescaped.clear();
+		unescaped.reserve(len);
+
+		std::size_t start = 0;
+		for (std::size_t i = 0; i <= bounds.size(); ++i)
+		{
+			const std::size_t stop = i < bounds.size() ? bounds[i] : len;
+			const char *p = data + start;
+			std::size_t n = stop - start;
+			if (n > 0 && *p == quote)
+			{
+				// quoted - strip the quotes, and unescape doubled ones if there are any
+				++p; --n;
+				if (n > 0 && p[n - 1] == quote) --n;
+				if (std::memchr(p, quote, n))
+				{
+					const std::size_t at = unescaped.size();
+					for (std::size_t k = 0; k < n; ++k)
+					{
+						unescaped.push_back(p[k]);
+						if (p[k] == quote && k + 1 < n && p[k + 1] == quote) ++k;
+					}
+					fields.push_back(field{ unescaped.data() + at, unescaped.size() - at });
+					start = stop + 1;
+					continue;
+				}
+			}
+			fields.push_back(field{ p, n });
+			start = stop + 1;
+		}
+	}
+
+	// returns the unconsumed input - the stream buffer, or our own buffer where the stream buffer can't be inspected.
+	field source_peek()
+	{
+		if (!use_own)
+		{
+			const field span = file.peek((std::size_t)-1);
+			if (!span.empty() || file.eof() || file.error()) return span;
+			use_own = true; // no buffer access - read the input ourselves from now on
+		}
+		if (own_pos == own.size())
+		{
+			own.resize(64 << 10);
+			own.resize(file.read(own.data(), 1, own.size()));
+			own_pos = 0;
+		}
+		return field{ own.data() + own_pos, own.size() - own_pos };
+	}
+	void source_consume(std::size_t count)
+	{
+		if (use_own) own_pos += count;
+		else file.consume(count);
+	}
+
+	// true if data[0, len) is an empty line (sans newline).
+	static bool blank(const char *data, std::size_t len) noexcept { return len == 0 || (len == 1 && *data == '\r'); }
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates a reader for the rest of file using the given delimiter and quote characters.
+	explicit csv_reader(cfile &f, char delimiter = ',', char quote_char = '"') : file(f), delim(delimiter), quote(quote_char) {}
+
+	csv_reader(const csv_reader&) = delete;
+	csv_reader &operator=(const csv_reader&) = delete;
+
+	// consumes the last row from the stream.
+	~csv_reader() { if (pending) source_consume(pending); }
+
+public: // -- input -- //
+
+	// reads the next row. returns false at the end of the input (the previous row's fields are then invalid).
+	bool next()
+	{
+		if (pending) source_consume(pending);
+		pending = 0;
+		carry.clear();
+		bounds.clear();
+		in_quote = false;
+
+		for (field span = source_peek(); ; span = source_peek())
+		{
+			if (span.empty())
+			{
+				// the last row has no newline
+				if (blank(carry.data(), carry.size())) return false;
+				split(carry.data(), carry.size());
+				++rows; ++copied;
+				return true;
+			}
+
+			const std::size_t end = find_row_end(span.data(), span.size(), carry.size());
+			if (end == span.size())
+			{
+				// the row continues past the buffered data - gather it until its end shows up
+				carry.insert(carry.end(), span.begin(), span.end());
+				source_consume(span.size());
+				continue;
+			}
+
+			if (carry.empty())
+			{
+				if (blank(span.data(), end)) { source_consume(end + 1); continue; }
+				split(span.data(), end); // zero copy - consumed on the next call
+				pending = end + 1;
+				++rows;
+				return true;
+			}
+
+			carry.insert(carry.end(), span.begin(), span.begin() + (std::ptrdiff_t)end);
+			source_consume(end + 1);
+			if (blank(carry.data(), carry.size())) { carry.clear(); bounds.clear(); continue; }
+			split(carry.data(), carry.size());
+			++rows; ++copied;
+			return true;
+		}
+	}
+
+	// returns the number of fields in the current row.
+	std::size_t size() const noexcept { return fields.size(); }
+	// returns a field of the current row.
+	const field &operator[](std::size_t i) const noexcept { return fields[i]; }
+	// returns the fields of the current row.
+	const std::vector<field> &row() const noexcept { return fields; }
+
+	const field *begin() const noexcept { return fields.data(); }
+	const field *end() const noexcept { return fields.data() + fields.size(); }
+
+	// returns the number of rows read so far.
+	std::size_t row_count() const noexcept { return rows; }
+	// returns how many of them had to be gathered into the internal buffer (the rest were zero copy).
+	std::size_t copied_rows() const noexcept { return copied; }
+};
+
+#endif
@@ -0,0 +1,366 @@
+#ifndef DRAGAZO_CSV_WRITER_H
+#define DRAGAZO_CSV_WRITER_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include "cfile.h"
+
+// writes rows of RFC 4180 csv (or any single-char delimiter, e.g. tsv) to a cfile from typed values.
+// numbers are formatted by hand instead of through printf: integers two digits at a time, and floating point values
+// in fixed notation (like "%.*f", precision 6 by default) with exact integer arithmetic - output matches printf digit
+// for digit, and the rare values this can't do exactly (huge, non-finite, precision > 9, exact ties) go through snprintf.
+// strings are scanned 16 bytes at a time for quotes, delimiters and line breaks and only quoted (with doubled quotes) if
+// they contain any.
+// everything is formatted straight into the stream buffer (see cfile::reserve()) - where that isn't possible it goes
+// through a scratch buffer and write() instead.
+// rows end with "\n" by default - use set_line_ending("\r\n") for strict RFC 4180 output.
+// a row holding a single empty field is written as "" rather than an empty line, which readers (csv_reader too) skip.
+class csv_writer
+{
+private: // -- data -- //
+
+	cfile &file;
+	const char delim, quote;
+	int precision = 6;
+	char eol[2] = { '\n', 0 };
+	std::size_t eol_len = 1;
+
+	bool first = true;         // the next field starts a row (no delimiter before it)
+	bool blank = true;         // nothing but empty fields without delimiters has been written for the current row
+	bool direct = false;       // the current output area is the stream buffer
+	std::vector<char> scratch; // output area where the stream buffer can't be used
+	std::size_t rows = 0;
+
+	// strings longer than this are written with write() rather than copied into the stream buffer.
+	static constexpr std::size_t long_field = 4096;
+
+	char *area = nullptr;      // start of the current output area
+
+	// sets up an output area for a field of up to count bytes, writes the delimiter (if the field needs one) and returns
+	// where the field goes.
+	char *open_field(std::size_t count)
+	{
+		++count;
+		area = file.reserve(count);
+		direct = area != nullptr;
+		if (!direct)
+		{
+			if (scratch.size() < count) scratch.resize(count);
+			area = scratch.data();
+		}
+		char *p = area;
+		if (!first) *p++ = delim;
+		return p;
+	}
+	// emits the output area up to end.
+	void close_field(char *end)
+	{
+		if (direct) file.commit(end - area);
+		else file.write(area, 1, end - area);
+		if (end != area) blank = false;
+		first = false;
+	}
+	// writes a field that needs no escaping.
+	csv_writer &raw_field(const char *str, std::size_t len)
+	{
+		char *const p = open_field(len);
+		std::memcpy(p, str, len);
+		close_field(p + len);
+		return *this;
+	}
+
+	// returns the two-digit strings "00" to "99" back to back.
+	static const char *digit_pairs() noexcept
+	{
+		static const char digits[] =
+			"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+			"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+			"8081828384858687888990919293949596979899";
+		return digits;
+	}
+
+	// writes the decimal digits of v ending at end and returns a pointer to the first one.
+	static char *format_uint(std::uint64_t v, char *end) noexcept
+	{
+		const char *const digits = digit_pairs();
+		while (v >= 100)
+		{
+			const unsigned i = (unsigned)(v % 100) * 2;
+			v /= 100;
+			*--end = digits[i + 1];
+			*--end = digits[i];
+		}
+		if (v >= 10)
+		{
+			*--end = digits[v * 2 + 1];
+			*--end = digits[v * 2];
+		}
+		else *--end = (char)('0' + v);
+		return end;
+	}
+
+	// returns the number of decimal digits in v.
+	static unsigned count_digits(std::uint64_t v) noexcept
+	{
+		for (unsigned n = 1; ; n += 4, v /= 10000)
+		{
+			if (v < 10) return n;
+			if (v < 100) return n + 1;
+			if (v < 1000) return n + 2;
+			if (v < 10000) return n + 3;
+		}
+	}
+
+	// returns the rounding error of the product p = a * b (so that a * b == p + error exactly).
+	static double product_error(double a, double b, double p) noexcept
+	{
+#if defined(__FMA__) || defined(FP_FAST_FMA)
+		return std::fma(a, b, -p);
+#else
+		// dekker's product - without hardware fma, std::fma() is a library call (and can be very slow)
+		const double split = 134217729.0; // 2^27 + 1
+		double t = split * a;
+		const double ah = t - (t - a), al = a - ah;
+		t = split * b;
+		const double bh = t - (t - b), bl = b - bh;
+		return ((ah * bh - p) + ah * bl + al * bh) + al * bl;
+#endif
+	}
+
+	// formats v like "%.*f" with precision p into out (which must have room for 32 bytes) and returns the length - or 0
+	// if it can't be done exactly here.
+	static std::size_t format_fixed(double v, int p, char *out) noexcept
+	{
+		static const double scales[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+		if (p < 0 || p > 9) return 0;
+
+		const double a = std::fabs(v);
+		const double prod = a * scales[p];
+		if (!(prod < 9007199254740992.0)) return 0; // 2^53 (also catches nan and inf)
+
+		// round the exact product a * 10^p to an integer: prod + err is exact, so the sign of d says which way to go
+		const std::int64_t whole = (std::int64_t)prod; // signed conversions are single instructions
+		const double d = ((prod - (double)whole) - 0.5) + product_error(a, scales[p], prod);
+		if (d == 0) return 0; // a tie - leave it to printf's rounding
+		std::uint64_t n = (std::uint64_t)whole + (d > 0);
+
+		// formatted backwards, then copied as a fixed 32 bytes (cheaper than a variable sized copy - the slack is
+		// never committed)
+		char buf[96];
+		char *const end = buf + 48;
+		char *begin = end;
+		int i = p;
+		for (; i >= 2; i -= 2, n /= 100)
+		{
+			const unsigned k = (unsigned)(n % 100) * 2;
+			*--begin = digit_pairs()[k + 1];
+			*--begin = digit_pairs()[k];
+		}
+		if (i)
+		{
+			*--begin = (char)('0' + n % 10);
+			n /= 10;
+		}
+		if (p > 0) *--begin = '.';
+		begin = format_uint(n, begin);
+		if (std::signbit(v)) *--begin = '-';
+
+		std::memcpy(out, begin, 32);
+		return end - begin;
+	}
+
+	template<typename T>
+	static bool negative(T v, std::true_type) noexcept { return v < 0; }
+	template<typename T>
+	static bool negative(T, std::false_type) noexcept { return false; }
+
+	// returns true if str[0, len) has to be quoted (contains a quote, the delimiter, \r or \n).
+	bool needs_quotes(const char *str, std::size_t len) const noexcept
+	{
+		std::size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+		const __m128i q = _mm_set1_epi8(quote), d = _mm_set1_epi8(delim), n = _mm_set1_epi8('\n'), r = _mm_set1_epi8('\r');
+		for (; i + 16 <= len; i += 16)
+		{
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+			const __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, d)), _mm_or_si128(_mm_cmpeq_epi8(v, n), _mm_cmpeq_epi8(v, r)));
+			if (_mm_movemask_epi8(hit)) return true;
+		}
+#endif
+		for (; i < len; ++i)
+		{
+			const char ch = str[i];
+			if (ch == quote || ch == delim || ch == '\n' || ch == '\r') return true;
+		}
+		return false;
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates a writer appending to file with the given delimiter and quote characters.
+	explicit csv_writer(cfile &f, char delimiter = ',', char quote_char = '"') : file(f), delim(delimiter), quote(quote_char) {}
+
+	csv_writer(const csv_writer&) = delete;
+	csv_writer &operator=(const csv_writer&) = delete;
+
+public: // -- settings -- //
+
+	// sets the number of digits after the decimal point for floating point fields (like the precision of "%.*f").
+	void set_precision(int p) noexcept { precision = p < 0 ? 0 : p; }
+	// returns the number of digits after the decimal point for floating point fields.
+	int get_precision() const noexcept { return precision; }
+
+	// sets the line ending written by end_row() - "\n" (the default) or "\r\n".
+	void set_line_ending(const char *ending) noexcept
+	{
+		eol_len = ending[0] && ending[1] ? 2 : 1;
+		eol[0] = ending[0] ? ending[0] : '\n';
+		eol[1] = eol_len == 2 ? ending[1] : 0;
+	}
+
+	// returns the number of rows written so far.
+	std::size_t row_count() const noexcept { return rows; }
+
+public: // -- output -- //
+
+	// writes a string field (quoted and escaped only if needed).
+	csv_writer &field(const char *str, std::size_t len)
+	{
+		const bool quoted = needs_quotes(str, len);
+		if (len >= long_field)
+		{
+			// too big to be worth staging - hand it to write() in pieces
+			if (!first) file.putc(delim);
+			first = blank = false;
+			if (!quoted)
+			{
+				file.write(const_cast<char*>(str), 1, len);
+				return *this;
+			}
+			file.putc(quote);
+			for (const char *end = str + len; str < end; )
+			{
+				const char *q = static_cast<const char*>(std::memchr(str, quote, end - str));
+				const char *stop = q ? q + 1 : end;
+				file.write(const_cast<char*>(str), 1, stop - str);
+				if (q) file.putc(quote);
+				str = stop;
+			}
+			file.putc(quote);
+			return *this;
+		}
+
+		char *p = open_field(quoted ? 2 * len + 2 : len);
+		if (!quoted)
+		{
+			std::memcpy(p, str, len);
+			p += len;
+		}
+		else
+		{
+			*p++ = quote;
+			for (const char *end = str + len; str < end; )
+			{
+				const char *q = static_cast<const char*>(std::memchr(str, quote, end - str));
+				const char *stop = q ? q + 1 : end;
+				std::memcpy(p, str, stop - str);
+				p += stop - str;
+				if (q) *p++ = quote;
+				str = stop;
+			}
+			*p++ = quote;
+		}
+		close_field(p);
+		return *this;
+	}
+	// writes a null-terminated string field.
+	csv_writer &field(const char *str) { return field(str, std::strlen(str)); }
+	// writes a string field.
+	csv_writer &field(const std::string &str) { return field(str.data(), str.size()); }
+	// writes a field read by csv_reader (or any other span of input).
+	csv_writer &field(cfile::input_span str) { return field(str.data(), str.size()); }
+	// writes a single character field.
+	csv_writer &field(char ch) { return field(&ch, 1); }
+
+	// writes an integer field - its digits are counted first, so they can be formatted in place.
+	template<typename T, std::enable_if_t<std::is_integral<T>::value, int> = 0>
+	csv_writer &field(T v)
+	{
+		const bool neg = negative(v, std::is_signed<T>());
+		const std::uint64_t u = neg ? 0 - (std::uint64_t)(long long)v : (std::uint64_t)v;
+		const unsigned digits = count_digits(u);
+
+		char *p = open_field(digits + neg);
+		if (neg) *p++ = '-';
+		format_uint(u, p + digits);
+		close_field(p + digits);
+		return *this;
+	}
+
+	// writes a floating point field with the current precision.
+	csv_writer &field(double v)
+	{
+		char *const p = open_field(32);
+		const std::size_t len = format_fixed(v, precision, p);
+		if (len != 0)
+		{
+			close_field(p + len);
+			return *this;
+		}
+
+		// out of the fast path's reach - let printf do it (nothing was emitted, so the area is simply abandoned)
+		char buf[512];
+		const int n = std::snprintf(buf, sizeof(buf), "%.*f", precision, v);
+		if (n < 0) return *this;
+		if ((std::size_t)n < sizeof(buf)) return raw_field(buf, (std::size_t)n);
+		std::vector<char> big((std::size_t)n + 1);
+		std::snprintf(big.data(), big.size(), "%.*f", precision, v);
+		return raw_field(big.data(), (std::size_t)n);
+	}
+	// writes a floating point field with the current precision.
+	csv_writer &field(float v) { return field((double)v); }
+
+	// ends the current row.
+	void end_row()
+	{
+		if (!first && blank)
+		{
+			// a single empty field - quoted, so the line isn't taken for a blank one
+			file.putc(quote);
+			file.putc(quote);
+		}
+		char *p = file.reserve(eol_len);
+		if (p)
+		{
+			std::memcpy(p, eol, eol_len);
+			file.commit(eol_len);
+		}
+		else file.write(eol, 1, eol_len);
+		first = blank = true;
+		++rows;
+	}
+
+	// writes each value as a field and ends the row, e.g. row(id, name, price).
+	template<typename ...Ts>
+	void row(const Ts &...values)
+	{
+		using swallow = int[];
+		(void)swallow{ 0, ((void)field(values), 0)... };
+		end_row();
+	}
+
+	// flushes the stream.
+	void flush() { file.flush(); }
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef DRAGAZO_DEFERRED_CLOSE_H
+#define DRAGAZO_DEFERRED_CLOSE_H
+
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <utility>
+#include <condition_variable>
+
+#include "cfile.h"
+
+// closes files on a shared background thread, so slow closes (e.g. flushing a big buffer to a network filesystem) don't
+// stall the caller.
+// enable(file) puts a handle in deferred-close mode: whenever it closes its file (close(), open(), assignment or
+// destruction), the FILE* is handed to the background thread, which performs the fclose() and then releases the stream
+// buffer (if the handle owns one). the mode belongs to the handle - it moves along with the file.
+// use wait() to make sure the data has reached the file and to learn whether any close failed.
+// the thread is started on first use - at program exit it finishes the queued closes, and later closes happen synchronously.
+class deferred_close
+{
+private: // -- data -- //
+
+	std::mutex mtx;
+	std::condition_variable work, idle;
+	std::deque<std::pair<std::FILE*, cfile::owned_buffer>> queue;
+	std::size_t busy = 0;       // files taken off the queue but not yet closed
+	std::size_t failures = 0;   // closes that failed since the last wait()
+	bool stopping = false;
+	std::thread worker;
+
+	static std::atomic<bool> &shut_down() { static std::atomic<bool> v{ false }; return v; }
+
+	deferred_close() : worker([this] { run(); }) {}
+	~deferred_close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		work.notify_one();
+		worker.join();
+		shut_down() = true;
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		for (;;)
+		{
+			work.wait(lock, [&] { return stopping || !queue.empty(); });
+			if (queue.empty()) return; // only when stopping
+
+			auto item = std::move(queue.front());
+			queue.pop_front();
+			++busy;
+			lock.unlock();
+			const int r = std::fclose(item.first);
+			item.second.reset();
+			lock.lock();
+			--busy;
+			if (r != 0) ++failures;
+			if (queue.empty() && busy == 0) idle.notify_all();
+		}
+	}
+
+	static deferred_close &instance() { static deferred_close c; return c; }
+
+public: // -- interface -- //
+
+	// enables or disables deferred-close mode for file (off by default).
+	static void enable(cfile &file, bool on = true) { file.set_closer(on ? &close : nullptr); }
+	// returns true if file is in deferred-close mode.
+	static bool enabled(const cfile &file) noexcept { return file.get_closer() == &close; }
+
+	// hands a file to the background thread to be closed - its buffer (if owned) is released afterwards.
+	// this is the closer enable() installs (see cfile::set_closer()).
+	static void close(std::FILE *file, cfile::owned_buffer &&buffer)
+	{
+		if (!shut_down())
+		{
+			deferred_close &c = instance();
+			std::lock_guard<std::mutex> lock(c.mtx);
+			if (!c.stopping)
+			{
+				c.queue.emplace_back(file, std::move(buffer));
+				c.work.notify_one();
+				return;
+			}
+		}
+		std::fclose(file);
+		buffer.reset();
+	}
+
+	// blocks until every deferred close issued so far (by any handle) has completed.
+	// returns the number of deferred closes that failed since the previous call (0 means all succeeded).
+	static std::size_t wait()
+	{
+		if (shut_down()) return 0;
+		deferred_close &c = instance();
+		std::unique_lock<std::mutex> lock(c.mtx);
+		c.idle.wait(lock, [&] { return c.queue.empty() && c.busy == 0; });
+		return std::exchange(c.failures, 0);
+	}
+};
+
+#endif
@@ -0,0 +1,407 @@
+#ifndef DRAGAZO_DIRECT_FILE_H
+#define DRAGAZO_DIRECT_FILE_H
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "buffer_alloc.h"
+#include "format_output.h"
+
+// a file accessed with direct io (O_DIRECT, or F_NOCACHE on apple), bypassing the page cache.
+// meant for large sequential scans/writes that would otherwise evict everything else from the cache.
+// direct io requires block-aligned offsets, sizes and memory (the block size is queried from the file, see block_size()),
+// so data goes through an internally managed aligned buffer
+// (a window onto the file) - transfers that happen to be aligned in memory and in the file skip the buffer entirely.
+// unaligned tails are handled by writing whole blocks and truncating the file back to its real size.
+// filesystems that reject direct io (e.g. tmpfs) get the same code path with normal cached io - see direct().
+// offers cfile's read/write/seek interface, but is not a FILE* - it is unrelated to stdio.
+class direct_file
+{
+public: // -- types -- //
+
+	static constexpr std::size_t default_buffer = 1 << 20;   // default window size
+
+private: // -- data -- //
+
+	struct buffer_deleter
+	{
+		std::size_t size, alignment;
+		void operator()(char *p) const noexcept { buffer_alloc::deallocate(p, size, alignment, false); }
+	};
+
+	int fd = -1;
+	bool is_direct = false;
+	bool readable = false, writable = false, appending = false;
+	bool at_eof = false, failed = false;
+	std::size_t block = 4096; // alignment used for memory, offsets and sizes
+
+	std::unique_ptr<char, buffer_deleter> buf{ nullptr, buffer_deleter{ 0, 0 } };
+	std::size_t buf_cap = 0;
+
+	long long pos = 0;       // logical position
+	long long file_size = 0; // logical size of the file (what it is truncated to)
+	long long win_off = 0;   // file offset of the window (block aligned)
+	std::size_t win_len = 0; // bytes of the window holding file content
+	bool win_valid = false;
+	bool win_dirty = false;
+
+	long long align_down(long long v) const noexcept { return v / (long long)block * (long long)block; }
+	std::size_t align_up(std::size_t v) const noexcept { return (v + block - 1) / block * block; }
+	bool aligned(const void *p) const noexcept { return reinterpret_cast<std::uintptr_t>(p) % block == 0; }
+
+	// finds the alignment direct io needs for fd - the file system's own answer where the kernel gives one (statx()),
+	// otherwise the preferred io size from st (a multiple of the device's logical block size).
+	std::size_t query_block(const struct stat &st) noexcept
+	{
+		auto usable = [](std::size_t b) { return b >= 512 && (b & (b - 1)) == 0; };
+#ifdef STATX_DIOALIGN
+		struct statx sx;
+		if (::statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx) == 0 && (sx.stx_mask & STATX_DIOALIGN))
+		{
+			if (sx.stx_dio_offset_align == 0) drop_direct(); // the file system doesn't do direct io for this file
+			const std::size_t b = std::max(sx.stx_dio_offset_align, sx.stx_dio_mem_align);
+			if (usable(b)) return b;
+		}
+#endif
+		return usable((std::size_t)st.st_blksize) ? (std::size_t)st.st_blksize : 4096;
+	}
+
+	// turns direct io off for this file (the filesystem accepted the flag but rejects the io).
+	bool drop_direct() noexcept
+	{
+		if (!is_direct) return false;
+#ifdef O_DIRECT
+		::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_DIRECT);
+#elif defined(F_NOCACHE)
+		::fcntl(fd, F_NOCACHE, 0);
+#endif
+		is_direct = false;
+		return true;
+	}
+
+	// pread/pwrite the whole range, retrying on interrupts and short transfers (a short read means eof).
+	// returns the number of bytes transferred, or -1 on error.
+	long long xfer(bool out, char *p, std::size_t n, long long off) noexcept
+	{
+		std::size_t done = 0;
+		while (done < n)
+		{
+			const ssize_t r = out ? ::pwrite(fd, p + done, n - done, (off_t)(off + (long long)done)) : ::pread(fd, p + done, n - done, (off_t)(off + (long long)done));
+			if (r < 0 && errno == EINTR) continue;
+			if (r < 0 && errno == EINVAL && drop_direct()) continue;
+			if (r < 0) return -1;
+			if (r == 0) break;
+			done += (std::size_t)r;
+		}
+		return (long long)done;
+	}
+
+	// writes the window back if it was modified.
+	bool flush_window() noexcept
+	{
+		if (!win_valid || !win_dirty) return true;
+		const std::size_t len = align_up(win_len);
+		std::memset(buf.get() + win_len, 0, len - win_len); // padding - truncated away below
+		if (xfer(true, buf.get(), len, win_off) != (long long)len) { failed = true; return false; }
+
+		const long long end = win_off + (long long)win_len;
+		if (end > file_size) file_size = end;
+		if (win_off + (long long)len > file_size && ::ftruncate(fd, (off_t)file_size) != 0) { failed = true; return false; }
+		win_dirty = false;
+		return true;
+	}
+
+	// points the window at the block holding pos, loading its current content.
+	bool load_window() noexcept
+	{
+		if (!flush_window()) return false;
+		win_off = align_down(pos);
+		win_valid = false;
+		long long n = 0;
+		if (win_off < file_size)
+		{
+			n = xfer(false, buf.get(), buf_cap, win_off);
+			if (n < 0) { failed = true; return false; }
+		}
+		win_len = (std::size_t)n;
+		win_valid = true;
+		return true;
+	}
+
+	bool in_window(long long p) const noexcept { return win_valid && p >= win_off && p < win_off + (long long)buf_cap; }
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates an unlinked handle.
+	direct_file() = default;
+
+	// opens a file - equivalent to calling open(filename, mode, buffer_size).
+	direct_file(const char *filename, const char *mode, std::size_t buffer_size = default_buffer) { open(filename, mode, buffer_size); }
+
+	direct_file(const direct_file&) = delete;
+	direct_file &operator=(const direct_file&) = delete;
+
+	// flushes and closes the file.
+	~direct_file() { close(); }
+
+public: // -- file state -- //
+
+	// opens a file with an fopen()-style mode ("rb", "wb", "ab", "r+b", ...) and links it to this handle,
+	// closing the current file first. buffer_size is rounded up to a multiple of block_size().
+	// as with fopen(), every write in append mode goes to the end of the file, wherever seek() moved the position - but the
+	// end is this handle's view of the file, so appends from other handles or processes aren't accounted for.
+	// returns true on success, otherwise this handle is left unlinked.
+	bool open(const char *filename, const char *mode, std::size_t buffer_size = default_buffer)
+	{
+		close();
+
+		const bool plus = std::strchr(mode, '+') != nullptr;
+		int flags;
+		switch (mode[0])
+		{
+		case 'r': flags = plus ? O_RDWR : O_RDONLY; break;
+		// partial blocks are read before they are written back, so the file is opened for reading either way
+		case 'w': flags = O_RDWR | O_CREAT | O_TRUNC; break;
+		case 'a': flags = O_RDWR | O_CREAT; break; // positions are explicit, so O_APPEND isn't needed
+		default: return false;
+		}
+		readable = mode[0] == 'r' || plus;
+		writable = mode[0] != 'r' || plus;
+		appending = mode[0] == 'a';
+
+#ifdef O_DIRECT
+		fd = ::open(filename, flags | O_DIRECT, 0666);
+		is_direct = fd >= 0;
+		if (fd < 0 && errno == EINVAL) fd = ::open(filename, flags, 0666); // e.g. tmpfs
+#else
+		fd = ::open(filename, flags, 0666);
+#ifdef F_NOCACHE
+		is_direct = fd >= 0 && ::fcntl(fd, F_NOCACHE, 1) == 0;
+#endif
+#endif
+		if (fd < 0) return false;
+
+		struct stat st;
+		if (::fstat(fd, &st) == 0)
+		{
+			block = query_block(st);
+			buf_cap = align_up(std::max(buffer_size, block));
+			buf = std::unique_ptr<char, buffer_deleter>(buffer_alloc::allocate(buf_cap, block, false), buffer_deleter{ buf_cap, block });
+		}
+		if (!buf)
+		{
+			::close(fd);
+			fd = -1;
+			return false;
+		}
+		file_size = st.st_size;
+		pos = mode[0] == 'a' ? file_size : 0;
+		return true;
+	}
+
+	// flushes and closes the file (if any) and enters the unlinked state.
+	// returns 0 on success (or if there was nothing to close).
+	int close()
+	{
+		if (fd < 0) return 0;
+		int r = flush();
+		if (::close(fd) != 0) r = EOF;
+		fd = -1;
+		buf.reset();
+		win_valid = win_dirty = at_eof = failed = false;
+		pos = file_size = win_off = 0;
+		win_len = 0;
+		return r;
+	}
+
+	// returns true if this handle is currently linked to a file.
+	explicit operator bool() const noexcept { return fd >= 0; }
+	// returns true if this handle is currently unlinked.
+	bool operator!() const noexcept { return fd < 0; }
+
+	// returns true if io really bypasses the page cache (false after falling back to cached io).
+	bool direct() const noexcept { return is_direct; }
+	// returns the alignment used for memory, offsets and sizes of the direct transfers.
+	std::size_t block_size() const noexcept { return block; }
+
+	// returns the underlying file descriptor (-1 if unlinked).
+	int fileno() const noexcept { return fd; }
+
+	// returns the logical size of the file.
+	long long size() const noexcept { return std::max(file_size, win_valid && win_dirty ? win_off + (long long)win_len : 0); }
+
+	// writes back buffered output. returns 0 on success, EOF on failure.
+	int flush() { return flush_window() ? 0 : EOF; }
+
+	// gets the current position in the file.
+	long long tell() const noexcept { return pos; }
+	// sets the current position in the file (SEEK_SET, SEEK_CUR or SEEK_END). returns 0 on success.
+	int seek(long long offset, int origin = SEEK_SET)
+	{
+		const long long base = origin == SEEK_SET ? 0 : origin == SEEK_CUR ? pos : size();
+		if (base + offset < 0) return -1;
+		pos = base + offset;
+		at_eof = false;
+		return 0;
+	}
+	// repositions the file to the beginning.
+	void rewind() { seek(0); failed = false; }
+
+	// checks if a read has hit the end of the file.
+	int eof() const noexcept { return at_eof; }
+	// checks if there was an error.
+	int error() const noexcept { return failed; }
+	// clears the eof and error states.
+	void clearerr() noexcept { at_eof = failed = false; }
+
+public: // -- input -- //
+
+	// reads (count) elements of size (size) from the file (binary data).
+	// returns the number of whole elements read.
+	std::size_t read(void *ptr, std::size_t size, std::size_t count)
+	{
+		if (fd < 0 || !readable || size == 0) return 0;
+		char *dst = static_cast<char*>(ptr);
+		std::size_t want = size * count, got = 0;
+
+		while (got < want)
+		{
+			if (in_window(pos))
+			{
+				const std::size_t at = (std::size_t)(pos - win_off);
+				if (at >= win_len)
+				{
+					// past the loaded data - eof, unless the file has grown since the window was loaded
+					if (pos >= this->size()) { at_eof = true; break; }
+					if (!load_window()) break;
+					if ((std::size_t)(pos - win_off) >= win_len) { at_eof = true; break; }
+					continue;
+				}
+				const std::size_t n = std::min(want - got, win_len - at);
+				std::memcpy(dst + got, buf.get() + at, n);
+				got += n;
+				pos += (long long)n;
+				continue;
+			}
+
+			// aligned in memory and in the file - read whole blocks straight into the caller's buffer
+			if (pos % (long long)block == 0 && aligned(dst + got) && want - got >= block && !(win_valid && win_dirty))
+			{
+				const std::size_t n = (want - got) / block * block;
+				const long long r = xfer(false, dst + got, n, pos);
+				if (r < 0) { failed = true; break; }
+				got += (std::size_t)r;
+				pos += r;
+				if ((std::size_t)r < n) { at_eof = true; break; }
+				continue;
+			}
+
+			if (!load_window()) break;
+		}
+		return got / size;
+	}
+	// convenience function - passes correct size parameter to read() based on T.
+	// additionally, guarantees that T is a valid type to be read in this manner.
+	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t read(T *ptr, std::size_t count) { return read(static_cast<void*>(ptr), sizeof(T), count); }
+	// convenience function - passes correct size and count parameters to read() based on T and length of array.
+	// additionally, guarantees that T is a valid type to be read in this manner.
+	template<typename T, int len, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t read(T(&ptr)[len]) { return read(static_cast<void*>(ptr), sizeof(T), len); }
+
+	// gets a character from the file.
+	int getc()
+	{
+		unsigned char ch;
+		return read(&ch, 1, 1) == 1 ? ch : EOF;
+	}
+
+public: // -- output -- //
+
+	// writes (count) elements of size (size) to the file (binary data).
+	// returns the number of whole elements written.
+	std::size_t write(const void *ptr, std::size_t size, std::size_t count)
+	{
+		if (fd < 0 || !writable || size == 0) return 0;
+		const char *src = static_cast<const char*>(ptr);
+		std::size_t want = size * count, put = 0;
+		if (appending) pos = this->size();
+
+		while (put < want)
+		{
+			// aligned in memory and in the file - write whole blocks straight from the caller's buffer
+			if (!in_window(pos) && pos % (long long)block == 0 && aligned(src + put) && want - put >= block)
+			{
+				const std::size_t n = (want - put) / block * block;
+				if (!flush_window()) break;
+				if (win_valid && win_off < pos + (long long)n && pos < win_off + (long long)buf_cap) win_valid = false; // now stale
+				if (xfer(true, const_cast<char*>(src + put), n, pos) != (long long)n) { failed = true; break; }
+				put += n;
+				pos += (long long)n;
+				file_size = std::max(file_size, pos);
+				continue;
+			}
+
+			if (!in_window(pos) && !load_window()) break;
+
+			const std::size_t at = (std::size_t)(pos - win_off);
+			if (at > win_len) std::memset(buf.get() + win_len, 0, at - win_len); // seeked past the end - the gap reads as zeros
+			const std::size_t n = std::min(want - put, buf_cap - at);
+			std::memcpy(buf.get() + at, src + put, n);
+			put += n;
+			pos += (long long)n;
+			win_len = std::max(win_len, at + n);
+			win_dirty = true;
+		}
+		return put / size;
+	}
+	// convenience function - passes correct size parameter to write() based on T.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t write(const T *ptr, std::size_t count) { return write(static_cast<const void*>(ptr), sizeof(T), count); }
+	// convenience function - passes correct size and count parameters to write() based on T and length of array.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, int len, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t write(const T(&ptr)[len]) { return write(static_cast<const void*>(ptr), sizeof(T), len); }
+
+	// writes a char to the file.
+	int putc(int ch)
+	{
+		const unsigned char c = (unsigned char)ch;
+		return write(&c, 1, 1) == 1 ? c : EOF;
+	}
+
+	// writes a string to the file.
+	int puts(const char *str) { return write(str, 1, std::strlen(str)) == std::strlen(str) ? 0 : EOF; }
+
+	// prints a formatted string to the file.
+	int printf(const char *fmt, ...)
+	{
+		char small[512];
+		va_list v;
+		va_start(v, fmt);
+		const int n = vformat(fmt, v,
+			[&](std::size_t count, std::size_t &avail) { avail = sizeof(small); return count <= avail ? small : nullptr; },
+			[&](std::size_t count) { write(small, 1, count); },
+			[&](const char *str, std::size_t count) { write(str, 1, count); });
+		va_end(v);
+		return n;
+	}
+};
+
+#endif
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef DRAGAZO_FLUSH_SCHEDULER_H
+#define DRAGAZO_FLUSH_SCHEDULER_H
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <stdio_ext.h>
+#endif
+
+#include "cfile.h"
+
+// a background service that keeps registered cfiles flushed and written back, so the kernel never builds up
+// huge amounts of dirty pages that it later has to flush all at once (stalling writers).
+// every tick the worker thread estimates how much of each file is dirty (bytes in the stdio buffer plus bytes written since
+// the last sync) and how long it has been dirty. once either threshold is crossed it fflush()es the file and then either
+// starts writeback of the new range with sync_file_range() (linux, the default) or waits for it with fdatasync().
+// files are assumed to be written sequentially (the synced range is tracked by file offset).
+// fflush() takes the FILE lock, so writers may keep using a file while it is registered.
+class flush_scheduler
+{
+public: // -- types -- //
+
+	enum class sync_mode
+	{
+		none,      // only fflush() - data reaches the page cache but nothing forces writeback
+		writeback, // fflush() + start asynchronous writeback of the new range (sync_file_range on linux, else fdatasync)
+		datasync,  // fflush() + fdatasync() - data is durable when the tick completes
+	};
+
+	struct options
+	{
+		std::chrono::milliseconds interval{ 50 };      // how often registered files are examined
+		std::size_t dirty_bytes = 8 << 20;             // flush once a file has this many unsynced bytes
+		std::chrono::milliseconds max_age{ 1000 };     // ... or once it has had unsynced bytes for this long
+		sync_mode mode = sync_mode::writeback;
+	};
+
+private: // -- data -- //
+
+	struct entry
+	{
+		cfile *file;
+		off_t synced;                                 // file offset up to which data has been handed to the kernel for writeback
+		bool dirty;
+		std::chrono::steady_clock::time_point since;  // when the file was first seen dirty
+	};
+
+	options opt;
+
+	typedef std::vector<std::pair<cfile*, std::promise<int>>> request_list;
+
+	std::mutex mtx;                // guards everything below (but isn't held while files are being flushed)
+	std::condition_variable wake;
+	std::condition_variable idle;  // signalled when a batch of files is done
+	std::vector<entry> entries;
+	request_list requests;         // explicit sync() calls
+	std::vector<cfile*> busy;      // files the worker is working on right now
+	bool stopping = false;
+
+	std::thread worker;
+
+	static off_t position(int fd) { return ::lseek(fd, 0, SEEK_CUR); }
+
+	// bytes sitting in the stdio buffer.
+	// only glibc can tell - elsewhere this reports 1 (maybe something) so age still gets buffered data flushed.
+	static std::size_t pending(std::FILE *file)
+	{
+#ifdef __GLIBC__
+		::flockfile(file); // a writer may be moving the buffer pointers
+		const std::size_t n = ::__fpending(file);
+		::funlockfile(file);
+		return n;
+#else
+		(void)file;
+		return 1;
+#endif
+	}
+
+	// flushes a file and syncs the range written since the last sync according to mode. returns 0 on success.
+	static int flush_entry(entry &e, sync_mode mode)
+	{
+		std::FILE *const f = e.file->get();
+		if (!f) return -1;
+		int r = std::fflush(f);
+
+		const int fd = ::fileno(f);
+		const off_t pos = position(fd);
+		e.dirty = false;
+		if (pos < 0) return r; // can't seek (a pipe, terminal or socket) - nothing to sync
+
+		if (mode == sync_mode::datasync)
+		{
+			if (::fdatasync(fd) != 0) r = -1;
+		}
+		else if (mode == sync_mode::writeback && pos > e.synced)
+		{
+#ifdef __linux__
+			if (::sync_file_range(fd, e.synced, pos - e.synced, SYNC_FILE_RANGE_WRITE) != 0) r = -1;
+#else
+			if (::fdatasync(fd) != 0) r = -1;
+#endif
+		}
+
+		e.synced = pos;
+		return r;
+	}
+
+	// serves the sync requests and flushes whichever files of batch are due.
+	void tick(std::vector<entry> &batch, request_list &reqs)
+	{
+		// explicit requests are always a full fdatasync()
+		for (auto &req : reqs)
+		{
+			auto it = std::find_if(batch.begin(), batch.end(), [&](const entry &e) { return e.file == req.first; });
+			if (it != batch.end()) req.second.set_value(flush_entry(*it, sync_mode::datasync));
+			else
+			{
+				entry tmp{ req.first, 0, false, {} };
+				req.second.set_value(flush_entry(tmp, sync_mode::datasync));
+			}
+		}
+
+		const auto now = std::chrono::steady_clock::now();
+		for (entry &e : batch)
+		{
+			std::FILE *const f = e.file->get();
+			if (!f) continue;
+
+			const off_t pos = position(::fileno(f));
+			const std::size_t dirty = pending(f) + (pos > e.synced ? (std::size_t)(pos - e.synced) : 0);
+			if (dirty == 0)
+			{
+				if (pos >= 0) e.synced = pos; // e.g. the file was rewound
+				continue;
+			}
+			if (!e.dirty)
+			{
+				e.dirty = true;
+				e.since = now;
+			}
+			if (dirty >= opt.dirty_bytes || now - e.since >= opt.max_age) flush_entry(e, opt.mode);
+		}
+	}
+
+	void run()
+	{
+		std::vector<entry> batch;
+		request_list reqs;
+		std::unique_lock<std::mutex> lock(mtx);
+		while (!stopping)
+		{
+			wake.wait_for(lock, opt.interval, [&] { return stopping || !requests.empty(); });
+
+			// files are examined and flushed on copies of their entries without holding the lock, so add(), remove() and
+			// sync() never wait behind an fflush() or a sync (remove() does wait for a file that is in the batch)
+			batch.assign(entries.begin(), entries.end());
+			reqs.swap(requests);
+			for (const entry &e : batch) busy.push_back(e.file);
+			lock.unlock();
+
+			tick(batch, reqs);
+			reqs.clear();
+
+			lock.lock();
+			for (const entry &e : batch)
+			{
+				auto it = std::find_if(entries.begin(), entries.end(), [&](const entry &x) { return x.file == e.file; });
+				if (it != entries.end()) *it = e;
+			}
+			busy.clear();
+			idle.notify_all();
+		}
+
+		// final pass so nothing registered is left behind unsynced
+		for (entry &e : entries) flush_entry(e, opt.mode);
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// starts the scheduler thread with the default options.
+	flush_scheduler() : worker(&flush_scheduler::run, this) {}
+	// starts the scheduler thread with the given options.
+	explicit flush_scheduler(const options &o) : opt(o), worker(&flush_scheduler::run, this) {}
+
+	flush_scheduler(const flush_scheduler&) = delete;
+	flush_scheduler &operator=(const flush_scheduler&) = delete;
+
+	// gives every registered file a final flush/sync and stops the scheduler thread.
+	~flush_scheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		wake.notify_one();
+		worker.join();
+	}
+
+public: // -- registration -- //
+
+	// registers a file with the scheduler - it must stay alive (and linked to the same stream) until removed.
+	// registering a file twice has no effect.
+	void add(cfile &file)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (std::none_of(entries.begin(), entries.end(), [&](const entry &e) { return e.file == &file; }))
+		{
+			entries.push_back(entry{ &file, file ? position(::fileno(file)) : 0, false, {} });
+		}
+	}
+
+	// unregisters a file. once this returns the scheduler no longer touches it (waits for a flush in progress).
+	// data written since the last tick is not flushed - close or flush the file yourself.
+	void remove(cfile &file)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const entry &e) { return e.file == &file; }), entries.end());
+		idle.wait(lock, [&] { return std::find(busy.begin(), busy.end(), &file) == busy.end(); });
+	}
+
+	// asks the scheduler thread to fflush() + fdatasync() a file right away, without blocking the caller.
+	// the file need not be registered, but must stay alive until the returned future is ready.
+	// the future holds 0 on success.
+	std::future<int> sync(cfile &file)
+	{
+		std::promise<int> p;
+		std::future<int> res = p.get_future();
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			requests.emplace_back(&file, std::move(p));
+		}
+		wake.notify_one();
+		return res;
+	}
+};
+
+#endif
+
+#endif
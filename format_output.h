@@ -0,0 +1,113 @@
+#ifndef DRAGAZO_FORMAT_OUTPUT_H
+#define DRAGAZO_FORMAT_OUTPUT_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <memory>
+#include <type_traits>
+
+// prints a formatted string into the space returned by area(count, avail) - space for at least count bytes (its size is
+// stored in avail), or null if count bytes can never fit there - and calls commit(n) with the length of the text.
+// the text is formatted in place and only formatted again if it didn't fit the first time; text that can never fit is
+// formatted on the side and handed to spill(str, n) instead.
+// returns the length of the text, or a negative value on a format error.
+template<typename Area, typename Commit, typename Spill>
+int vformat(const char *fmt, va_list v, Area &&area, Commit &&commit, Spill &&spill)
+{
+	std::size_t avail = 0;
+	char *dest = area(1, avail);
+
+	va_list v2;
+	va_copy(v2, v);
+	const int n = std::vsnprintf(dest, avail, fmt, v2); // the terminator lands in free space and is never committed
+	va_end(v2);
+	if (n < 0) return n;
+
+	if ((std::size_t)n >= avail)
+	{
+		// didn't fit - make room (plus the terminator) and format again
+		dest = area((std::size_t)n + 1, avail);
+		if (!dest)
+		{
+			std::unique_ptr<char[]> tmp(new char[(std::size_t)n + 1]);
+			va_copy(v2, v);
+			std::vsnprintf(tmp.get(), (std::size_t)n + 1, fmt, v2);
+			va_end(v2);
+			spill(tmp.get(), (std::size_t)n);
+			return n;
+		}
+		va_copy(v2, v);
+		std::vsnprintf(dest, avail, fmt, v2);
+		va_end(v2);
+	}
+
+	commit((std::size_t)n);
+	return n;
+}
+
+// provides cfile's output interface (write() overloads, putc(), puts(), printf()) for a class that buffers its output.
+// the derived class implements write(const void*, size, count) - and brings the overloads here into scope with a using
+// declaration - along with these two (which it can keep private by befriending format_output):
+//     char *output_area(std::size_t count, std::size_t &avail) - see vformat() (null for a count of 1 means the output failed)
+//     void output_commit(std::size_t count)                    - count bytes were written at the start of the area
+template<typename Derived>
+class format_output
+{
+private: // -- helpers -- //
+
+	Derived &self() noexcept { return static_cast<Derived&>(*this); }
+
+protected: // -- ctor / dtor / asgn -- //
+
+	format_output() = default;
+
+public: // -- output -- //
+
+	// convenience function - passes correct size parameter to write() based on T.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t write(const T *ptr, std::size_t count) { return self().write(static_cast<const void*>(ptr), sizeof(T), count); }
+	// convenience function - passes correct size and count parameters to write() based on T and length of array.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, int len, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t write(const T(&ptr)[len]) { return self().write(static_cast<const void*>(ptr), sizeof(T), len); }
+
+	// writes a char.
+	int putc(int ch)
+	{
+		std::size_t avail;
+		char *const p = self().output_area(1, avail);
+		if (!p) return EOF;
+		*p = (char)ch;
+		self().output_commit(1);
+		return (unsigned char)ch;
+	}
+
+	// writes a string (not including the terminator).
+	int puts(const char *str)
+	{
+		self().write(static_cast<const void*>(str), 1, std::strlen(str));
+		return 0;
+	}
+
+	// prints a formatted string straight into the output area.
+	int printf(const char *fmt, ...)
+	{
+		va_list v;
+		va_start(v, fmt);
+		int r = vprintf(fmt, v);
+		va_end(v);
+		return r;
+	}
+	// prints a formatted string straight into the output area (va_list version).
+	int vprintf(const char *fmt, va_list v)
+	{
+		return vformat(fmt, v,
+			[this](std::size_t count, std::size_t &avail) { return self().output_area(count, avail); },
+			[this](std::size_t count) { self().output_commit(count); },
+			[this](const char *str, std::size_t count) { self().write(static_cast<const void*>(str), 1, count); });
+	}
+};
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef DRAGAZO_FORMAT_PIPELINE_H
+#define DRAGAZO_FORMAT_PIPELINE_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "cfile.h"
+#include "format_output.h"
+
+// formats a long sequence of records on several threads and writes the result to a cfile in record order.
+// records are numbered 0 to count-1 and grouped into batches of consecutive records. worker threads claim batches in order,
+// format every record of a batch into the batch's private buffer, and the thread that called run() acts as the writer:
+// it writes finished batches to the file strictly in sequence (one fwrite() each), so the output is byte for byte what
+// formatting the records one after another on a single thread would give.
+// memory is bounded: only in_flight batches exist at a time (formatted and waiting, or being formatted) - a worker that
+// gets that far ahead of the writer waits for it (backpressure), and batch buffers are reused rather than reallocated.
+class format_pipeline
+{
+public: // -- types -- //
+
+	// the buffer a batch is formatted into - offers cfile's output interface.
+	class buffer : public format_output<buffer>
+	{
+	private: // -- data -- //
+
+		friend class format_pipeline;
+		friend class format_output<buffer>;
+
+		std::vector<char> buf;
+		std::size_t used = 0;
+
+		void make_room(std::size_t count)
+		{
+			if (buf.size() - used < count) buf.resize(std::max(buf.size() * 2, used + count));
+		}
+
+		char *output_area(std::size_t count, std::size_t &avail)
+		{
+			make_room(count);
+			avail = buf.size() - used;
+			return buf.data() + used;
+		}
+		void output_commit(std::size_t count) { used += count; }
+
+	public: // -- output -- //
+
+		using format_output<buffer>::write;
+
+		// writes (count) elements of size (size) into the buffer (binary data).
+		// returns count.
+		std::size_t write(const void *ptr, std::size_t size, std::size_t count)
+		{
+			const std::size_t total = size * count;
+			make_room(total);
+			std::memcpy(buf.data() + used, ptr, total);
+			used += total;
+			return count;
+		}
+
+		// returns the number of bytes formatted into this buffer so far.
+		std::size_t size() const noexcept { return used; }
+	};
+
+	struct options
+	{
+		std::size_t threads = 0;            // formatting threads (0 = one per hardware thread)
+		std::size_t batch = 4096;           // records per batch
+		std::size_t in_flight = 0;          // batches in existence at once (0 = 4 per thread)
+		std::size_t buffer_size = 64 << 10; // initial size of a batch buffer (they grow as needed)
+	};
+
+	struct stats
+	{
+		std::uint64_t records;  // records formatted
+		std::uint64_t batches;  // batches written
+		std::uint64_t bytes;    // bytes written
+		std::uint64_t stalls;   // times a worker had to wait for the writer to catch up
+	};
+
+private: // -- data -- //
+
+	options opt;
+	stats st = {};
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates a pipeline with the default options.
+	format_pipeline() = default;
+	// creates a pipeline with the given options.
+	explicit format_pipeline(const options &o) : opt(o) {}
+
+public: // -- interface -- //
+
+	// returns the options the pipeline was created with.
+	const options &get_options() const noexcept { return opt; }
+	// returns the statistics of the last run().
+	const stats &get_stats() const noexcept { return st; }
+
+	// formats records [0, count) with format(buffer&, std::uint64_t index) and writes them to file in index order.
+	// format is called concurrently from the worker threads (never twice for the same index) and must be thread safe.
+	// the calling thread writes the batches. if a write fails, no further batches are started and the rest is dropped.
+	// returns the number of records whose output was written in full.
+	template<typename F>
+	std::uint64_t run(cfile &file, std::uint64_t count, F &&format)
+	{
+		const std::size_t threads = opt.threads ? opt.threads : std::max(std::thread::hardware_concurrency(), 1u);
+		const std::uint64_t batch = std::max<std::size_t>(opt.batch, 1);
+		const std::uint64_t batches = (count + batch - 1) / batch;
+		const std::size_t slots = std::max<std::size_t>(opt.in_flight ? opt.in_flight : 4 * threads, 2);
+
+		struct slot
+		{
+			buffer buf;
+			bool ready = false;
+		};
+		std::vector<slot> ring(slots);
+		for (slot &s : ring) s.buf.buf.resize(std::max<std::size_t>(opt.buffer_size, 64));
+
+		std::mutex mtx;
+		std::condition_variable room_cv, ready_cv; // workers wait for room in the ring, the writer for the next batch
+		std::uint64_t next_claim = 0, written = 0, stalls = 0;
+		bool failed = false;
+
+		auto work = [&]
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			for (;;)
+			{
+				// a batch may only start once the one using its slot before (seq - slots) has been written
+				if (!failed && next_claim < batches && next_claim >= written + slots)
+				{
+					++stalls;
+					room_cv.wait(lock, [&] { return failed || next_claim >= batches || next_claim < written + slots; });
+				}
+				if (failed || next_claim >= batches) return;
+				const std::uint64_t seq = next_claim++;
+				lock.unlock();
+
+				slot &s = ring[seq % slots];
+				s.buf.used = 0;
+				const std::uint64_t end = std::min(count, (seq + 1) * batch);
+				for (std::uint64_t i = seq * batch; i < end; ++i) format(s.buf, i);
+
+				lock.lock();
+				s.ready = true;
+				if (seq == written) ready_cv.notify_one();
+			}
+		};
+
+		std::vector<std::thread> workers;
+		workers.reserve(threads);
+		for (std::size_t i = 0; i < threads; ++i) workers.emplace_back(work);
+
+		std::uint64_t bytes = 0, done = 0;
+		for (std::uint64_t seq = 0; seq < batches; ++seq)
+		{
+			slot &s = ring[seq % slots];
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				ready_cv.wait(lock, [&] { return s.ready; });
+			}
+
+			// written without the lock - workers keep formatting meanwhile
+			const bool ok = file.write(s.buf.buf.data(), 1, s.buf.used) == s.buf.used;
+			if (ok)
+			{
+				bytes += s.buf.used;
+				done = std::min(count, (seq + 1) * batch);
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				s.ready = false;
+				++written;
+				if (!ok) failed = true;
+			}
+			room_cv.notify_all();
+			if (!ok) break;
+		}
+
+		for (std::thread &t : workers) t.join();
+
+		st.records = done;
+		st.batches = failed ? written - 1 : written;
+		st.bytes = bytes;
+		st.stalls = stalls;
+		return done;
+	}
+};
+
+#endif
@@ -0,0 +1,588 @@
+#ifndef DRAGAZO_LOG_SINK_H
+#define DRAGAZO_LOG_SINK_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+#include "cfile.h"
+
+// returns the log_sink format id for a string literal, registering it once per call site.
+// usage: sink.log(LOG_SINK_ID("%s took %d ms\n"), name, ms);
+#define LOG_SINK_ID(fmt) ([] { static const std::uint32_t dragazo_log_sink_id = ::log_sink::format_id(fmt); return dragazo_log_sink_id; }())
+
+// a logging sink that moves formatting off the logging threads.
+// a log call only serializes its format id and raw argument values into a per-thread lock-free ring (no locks, no parsing);
+// a background thread drains the rings and either formats the records into text or copies them as compact binary records
+// into a cfile. binary logs are self-describing (format strings are written the first time they are used) and are turned
+// back into text with decode().
+// formats are printf-style. integer conversions accept any integer argument (length modifiers are ignored), floating
+// conversions any floating argument, %s takes const char* or std::string (the text is copied), %p any pointer.
+// %n is not supported. records from one thread stay in order - records from different threads are interleaved by the drain.
+// the drain thread blocks while every ring is empty - the first record logged after that wakes it (which takes a lock once).
+class log_sink
+{
+public: // -- types -- //
+
+	enum class output_mode { text, binary };
+
+	struct options
+	{
+		std::size_t queue_size = 1 << 20;          // bytes per thread ring (rounded up to a power of 2)
+		bool drop_when_full = false;               // drop records when a ring is full instead of waiting for the drain
+		output_mode mode = output_mode::text;
+	};
+
+private: // -- format registry -- //
+
+	// one printf conversion (and the literal text before it) - formatted with a single snprintf() call.
+	struct segment
+	{
+		std::string fmt; // literal text + normalized conversion spec (integer conversions get an ll length)
+		char kind;       // 'i' integer, 'f' floating, 'c' char, 's' string, 'p' pointer, 0 literal text only (already unescaped)
+		int stars;       // number of '*' width/precision arguments
+	};
+	typedef std::vector<segment> parsed_format;
+
+	// turns the %% escapes of literal text into plain %.
+	static std::string unescape(const std::string &lit)
+	{
+		std::string res;
+		for (std::size_t i = 0; i < lit.size(); ++i)
+		{
+			res += lit[i];
+			if (lit[i] == '%' && i + 1 < lit.size() && lit[i + 1] == '%') ++i;
+		}
+		return res;
+	}
+
+	static parsed_format parse(const char *fmt)
+	{
+		parsed_format res;
+		std::string lit;
+		for (const char *p = fmt; *p; )
+		{
+			if (*p != '%') { lit += *p++; continue; }
+			if (p[1] == '%') { lit += "%%"; p += 2; continue; }
+
+			segment seg{ lit, 0, 0 };
+			const std::size_t lit_len = lit.size();
+			lit.clear();
+			seg.fmt += *p++;
+			for (; *p && std::strchr("-+ #0'", *p); ++p) seg.fmt += *p;
+			if (*p == '*') { seg.fmt += *p++; ++seg.stars; }
+			else for (; *p >= '0' && *p <= '9'; ++p) seg.fmt += *p;
+			if (*p == '.')
+			{
+				seg.fmt += *p++;
+				if (*p == '*') { seg.fmt += *p++; ++seg.stars; }
+				else for (; *p >= '0' && *p <= '9'; ++p) seg.fmt += *p;
+			}
+			for (; *p && std::strchr("hlLqjzt", *p); ++p); // length modifiers are normalized below
+
+			const char conv = *p;
+			if (conv) ++p;
+			switch (conv)
+			{
+			case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': seg.kind = 'i'; seg.fmt += "ll"; seg.fmt += conv; break;
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': seg.kind = 'f'; seg.fmt += conv; break;
+			case 'c': case 's': case 'p': seg.kind = conv; seg.fmt += conv; break;
+			default: seg.fmt = unescape(seg.fmt.substr(0, lit_len)); seg.stars = 0; break; // unsupported (or truncated) spec - dropped
+			}
+			res.push_back(std::move(seg));
+		}
+		if (!lit.empty()) res.push_back(segment{ unescape(lit), 0, 0 });
+		return res;
+	}
+
+	struct registry
+	{
+		std::mutex mtx;
+		std::vector<std::string> formats;
+		std::vector<std::shared_ptr<const parsed_format>> parsed;
+	};
+	static registry &formats()
+	{
+		static registry r;
+		return r;
+	}
+
+public: // -- format registry -- //
+
+	// registers a format string and returns its id - prefer LOG_SINK_ID(), which does this once per call site.
+	// registering the same text twice returns the same id.
+	static std::uint32_t format_id(const char *fmt)
+	{
+		registry &r = formats();
+		std::lock_guard<std::mutex> lock(r.mtx);
+		for (std::size_t i = 0; i < r.formats.size(); ++i) if (r.formats[i] == fmt) return (std::uint32_t)i;
+		r.formats.emplace_back(fmt);
+		r.parsed.emplace_back(std::make_shared<const parsed_format>(parse(fmt)));
+		return (std::uint32_t)(r.formats.size() - 1);
+	}
+
+private: // -- serialization -- //
+
+	// argument encoding: a tag byte followed by the value ('i' int64, 'u' uint64, 'f' double, 'p' uint64, 's' uint32 length + text)
+	template<typename T, std::enable_if_t<std::is_arithmetic<T>::value || std::is_enum<T>::value, int> = 0>
+	static std::size_t arg_size(const T&) { return 9; }
+	template<typename T, std::enable_if_t<std::is_pointer<T>::value && !std::is_same<std::decay_t<std::remove_pointer_t<T>>, char>::value, int> = 0>
+	static std::size_t arg_size(const T&) { return 9; }
+	static std::size_t arg_size(const char *s) { return 5 + (s ? std::strlen(s) : 6); }
+	static std::size_t arg_size(const std::string &s) { return 5 + s.size(); }
+
+	static char *put_tag(char *p, char tag, const void *v, std::size_t n) { *p++ = tag; std::memcpy(p, v, n); return p + n; }
+
+	template<typename T, std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value, int> = 0>
+	static char *put(char *p, const T &v) { const std::int64_t x = v; return put_tag(p, 'i', &x, 8); }
+	template<typename T, std::enable_if_t<std::is_integral<T>::value && !std::is_signed<T>::value, int> = 0>
+	static char *put(char *p, const T &v) { const std::uint64_t x = v; return put_tag(p, 'u', &x, 8); }
+	template<typename T, std::enable_if_t<std::is_enum<T>::value, int> = 0>
+	static char *put(char *p, const T &v) { const std::int64_t x = (std::int64_t)v; return put_tag(p, 'i', &x, 8); }
+	template<typename T, std::enable_if_t<std::is_floating_point<T>::value, int> = 0>
+	static char *put(char *p, const T &v) { const double x = (double)v; return put_tag(p, 'f', &x, 8); }
+	template<typename T, std::enable_if_t<std::is_pointer<T>::value && !std::is_same<std::decay_t<std::remove_pointer_t<T>>, char>::value, int> = 0>
+	static char *put(char *p, const T &v) { const std::uint64_t x = (std::uint64_t)(std::uintptr_t)v; return put_tag(p, 'p', &x, 8); }
+	static char *put(char *p, const char *s)
+	{
+		if (!s) s = "(null)";
+		const std::uint32_t n = (std::uint32_t)std::strlen(s);
+		p = put_tag(p, 's', &n, 4);
+		std::memcpy(p, s, n);
+		return p + n;
+	}
+	static char *put(char *p, const std::string &s)
+	{
+		const std::uint32_t n = (std::uint32_t)s.size();
+		p = put_tag(p, 's', &n, 4);
+		std::memcpy(p, s.data(), n);
+		return p + n;
+	}
+
+	static std::size_t sum_sizes() { return 0; }
+	template<typename T, typename ...Rest>
+	static std::size_t sum_sizes(const T &v, const Rest &...rest) { return arg_size(v) + sum_sizes(rest...); }
+
+	static char *put_all(char *p) { return p; }
+	template<typename T, typename ...Rest>
+	static char *put_all(char *p, const T &v, const Rest &...rest) { return put_all(put(p, v), rest...); }
+
+	// a decoded argument.
+	struct arg
+	{
+		char tag;
+		union { std::int64_t i; std::uint64_t u; double f; };
+		const char *s;
+		std::uint32_t len;
+
+		long long as_int() const { return tag == 'f' ? (long long)f : tag == 's' ? 0 : (long long)i; }
+		double as_float() const { return tag == 'f' ? f : tag == 'u' || tag == 'p' ? (double)u : tag == 'i' ? (double)i : 0.0; }
+	};
+
+	// decodes the next argument - returns false if the payload is exhausted or malformed.
+	static bool next_arg(const char *&p, const char *end, arg &a)
+	{
+		if (p >= end) return false;
+		a.tag = *p++;
+		if (a.tag == 's')
+		{
+			if (end - p < 4) return false;
+			std::memcpy(&a.len, p, 4);
+			p += 4;
+			if ((std::size_t)(end - p) < a.len) return false;
+			a.s = p;
+			p += a.len;
+			return true;
+		}
+		if (end - p < 8) return false;
+		std::memcpy(&a.u, p, 8);
+		p += 8;
+		return true;
+	}
+
+	template<typename T>
+	static void format_one(std::string &out, const segment &seg, const int *star, T v)
+	{
+		char small[256];
+		int n = seg.stars == 0 ? std::snprintf(small, sizeof(small), seg.fmt.c_str(), v)
+			: seg.stars == 1 ? std::snprintf(small, sizeof(small), seg.fmt.c_str(), star[0], v)
+			: std::snprintf(small, sizeof(small), seg.fmt.c_str(), star[0], star[1], v);
+		if (n < 0) return;
+		if ((std::size_t)n < sizeof(small)) { out.append(small, (std::size_t)n); return; }
+
+		const std::size_t at = out.size();
+		out.resize(at + (std::size_t)n + 1);
+		if (seg.stars == 0) std::snprintf(&out[at], (std::size_t)n + 1, seg.fmt.c_str(), v);
+		else if (seg.stars == 1) std::snprintf(&out[at], (std::size_t)n + 1, seg.fmt.c_str(), star[0], v);
+		else std::snprintf(&out[at], (std::size_t)n + 1, seg.fmt.c_str(), star[0], star[1], v);
+		out.resize(at + (std::size_t)n);
+	}
+
+	// formats one record's payload according to fmt and appends the text to out.
+	// missing arguments format as 0 / empty strings rather than reading garbage.
+	static void format_record(std::string &out, const parsed_format &fmt, const char *p, const char *end)
+	{
+		for (const segment &seg : fmt)
+		{
+			if (seg.kind == 0)
+			{
+				out += seg.fmt;
+				continue;
+			}
+
+			int star[2] = { 0, 0 };
+			arg a{};
+			for (int i = 0; i < seg.stars; ++i) star[i] = next_arg(p, end, a) ? (int)a.as_int() : 0;
+			if (!next_arg(p, end, a)) { a.tag = 'i'; a.i = 0; a.s = ""; a.len = 0; }
+
+			switch (seg.kind)
+			{
+			case 'i': format_one(out, seg, star, a.as_int()); break;
+			case 'f': format_one(out, seg, star, a.as_float()); break;
+			case 'c': format_one(out, seg, star, (int)a.as_int()); break;
+			case 'p': format_one(out, seg, star, (void*)(std::uintptr_t)(a.tag == 's' ? 0 : a.u)); break;
+			case 's':
+			{
+				const std::string s = a.tag == 's' ? std::string(a.s, a.len) : std::string();
+				format_one(out, seg, star, s.c_str());
+				break;
+			}
+			}
+		}
+	}
+
+private: // -- queues -- //
+
+	// a per-thread single-producer single-consumer byte ring.
+	// records are [u32 size][u32 format id][args...] padded to 8 bytes - a size of 0 marks padding up to the end of the ring.
+	struct queue
+	{
+		std::atomic<std::uint64_t> head{ 0 }; // written by the producer
+		char pad1[56];
+		std::atomic<std::uint64_t> tail{ 0 }; // written by the drain
+		char pad2[56];
+		std::uint64_t cached_tail = 0;        // producer's last view of tail
+		std::size_t cap;
+		std::unique_ptr<char[]> buf;
+
+		explicit queue(std::size_t size) : cap(size), buf(new char[size]) { (void)pad1; (void)pad2; }
+	};
+
+	static std::size_t round8(std::size_t n) { return (n + 7) & ~(std::size_t)7; }
+
+	cfile &out;
+	const options opt;
+	const std::uint64_t id; // distinguishes sinks in the per-thread queue caches (never reused)
+
+	std::mutex mtx; // guards queues and the flush handshake
+	std::vector<std::unique_ptr<queue>> queues;
+	std::condition_variable work;    // wakes the drain (new records, flush requests, stopping)
+	std::condition_variable flushed; // signalled when flush requests have been served
+	std::uint64_t flush_requests = 0, flush_done = 0;
+	bool stopping = false;
+	std::atomic<bool> sleeping{ false }; // the drain found every ring empty and waits for work
+
+	std::atomic<std::uint64_t> drop_count{ 0 };
+	const std::shared_ptr<char> alive = std::make_shared<char>(); // expires with the sink (see cache())
+	std::thread worker;
+
+	static std::uint64_t next_id()
+	{
+		static std::atomic<std::uint64_t> counter{ 0 };
+		return counter.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	struct cache_entry
+	{
+		std::uint64_t id;
+		queue *q;
+		std::weak_ptr<char> alive; // expired once the sink is gone - the entry is dropped on the next miss
+	};
+	// the calling thread's queues of every sink it has logged to.
+	static std::vector<cache_entry> &cache()
+	{
+		thread_local std::vector<cache_entry> c;
+		return c;
+	}
+
+	queue &local()
+	{
+		std::vector<cache_entry> &c = cache();
+		for (const cache_entry &e : c) if (e.id == id) return *e.q;
+
+		// first use on this thread - also a good time to forget the sinks that are gone
+		c.erase(std::remove_if(c.begin(), c.end(), [](const cache_entry &e) { return e.alive.expired(); }), c.end());
+		queue *q;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			queues.emplace_back(new queue(opt.queue_size));
+			q = queues.back().get();
+		}
+		c.push_back(cache_entry{ id, q, alive });
+		return *q;
+	}
+
+	// returns true if any queue holds undrained records (mtx must be held).
+	bool pending_locked() const
+	{
+		for (const auto &q : queues)
+			if (q->head.load(std::memory_order_acquire) != q->tail.load(std::memory_order_relaxed)) return true;
+		return false;
+	}
+
+	// drains every queue once, appending output to text. returns true if anything was drained.
+	// parsed caches the registry for text mode, seen tracks the format ids already written in binary mode.
+	bool drain(const std::vector<queue*> &qs, std::string &text, std::vector<std::shared_ptr<const parsed_format>> &parsed, std::vector<char> &seen)
+	{
+		bool any = false;
+		for (queue *q : qs)
+		{
+			std::uint64_t t = q->tail.load(std::memory_order_relaxed);
+			const std::uint64_t h = q->head.load(std::memory_order_acquire);
+			while (t != h)
+			{
+				const std::size_t idx = (std::size_t)(t & (q->cap - 1));
+				std::uint32_t size, fid;
+				std::memcpy(&size, q->buf.get() + idx, 4);
+				if (size == 0) { t += q->cap - idx; continue; }
+				std::memcpy(&fid, q->buf.get() + idx + 4, 4);
+				const char *payload = q->buf.get() + idx + 8, *end = q->buf.get() + idx + size;
+
+				if (opt.mode == output_mode::text)
+				{
+					if (fid >= parsed.size() || !parsed[fid])
+					{
+						registry &r = formats();
+						std::lock_guard<std::mutex> lock(r.mtx);
+						parsed = r.parsed;
+					}
+					if (fid < parsed.size()) format_record(text, *parsed[fid], payload, end);
+				}
+				else
+				{
+					if (fid >= seen.size()) seen.resize(fid + 1, 0);
+					if (!seen[fid])
+					{
+						seen[fid] = 1;
+						std::string f;
+						{
+							registry &r = formats();
+							std::lock_guard<std::mutex> lock(r.mtx);
+							if (fid < r.formats.size()) f = r.formats[fid];
+						}
+						const std::uint32_t n = (std::uint32_t)f.size();
+						text += 'F';
+						text.append((const char*)&fid, 4);
+						text.append((const char*)&n, 4);
+						text += f;
+					}
+					const std::uint32_t n = size - 8;
+					text += 'R';
+					text.append((const char*)&fid, 4);
+					text.append((const char*)&n, 4);
+					text.append(payload, n);
+				}
+
+				t += round8(size);
+				any = true;
+				if (text.size() >= (1 << 16))
+				{
+					out.write(&text[0], 1, text.size());
+					text.clear();
+				}
+			}
+			q->tail.store(t, std::memory_order_release);
+		}
+		return any;
+	}
+
+	void run()
+	{
+		std::string text;
+		std::vector<std::shared_ptr<const parsed_format>> parsed;
+		std::vector<char> seen;
+		std::vector<queue*> qs;
+
+		std::unique_lock<std::mutex> lock(mtx);
+		for (;;)
+		{
+			const std::uint64_t requests = flush_requests;
+			const bool stop = stopping;
+			qs.clear();
+			for (auto &q : queues) qs.push_back(q.get());
+			lock.unlock();
+
+			const bool any = drain(qs, text, parsed, seen);
+			if (!text.empty())
+			{
+				out.write(&text[0], 1, text.size());
+				text.clear();
+			}
+
+			lock.lock();
+			if (requests != flush_done) // this pass started after those requests, so it covered everything logged before them
+			{
+				out.flush();
+				flush_done = requests;
+				flushed.notify_all();
+			}
+			if (stop && !any) break;
+			if (!any)
+			{
+				// announce the nap before the last look at the rings - a producer publishes its record before it checks
+				// the flag, so either this sees the record or the producer sees the flag and wakes us
+				sleeping.store(true, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!pending_locked())
+				{
+					work.wait(lock, [&] { return stopping || flush_requests != flush_done || !sleeping.load(std::memory_order_relaxed); });
+				}
+				sleeping.store(false, std::memory_order_relaxed);
+			}
+		}
+		out.flush();
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates a sink writing into out (which must outlive it) and starts its drain thread.
+	explicit log_sink(cfile &file) : log_sink(file, options()) {}
+	log_sink(cfile &file, const options &o) : out(file), opt(fix(o)), id(next_id()), worker([this] { run(); }) {}
+
+	log_sink(const log_sink&) = delete;
+	log_sink &operator=(const log_sink&) = delete;
+
+	// drains everything that was logged and stops the drain thread - no thread may still be logging.
+	~log_sink()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		work.notify_one();
+		worker.join();
+		std::vector<cache_entry> &c = cache();
+		c.erase(std::remove_if(c.begin(), c.end(), [&](const cache_entry &e) { return e.id == id; }), c.end());
+	}
+
+private:
+
+	static options fix(options o)
+	{
+		std::size_t c = 64;
+		while (c < o.queue_size) c <<= 1;
+		o.queue_size = c;
+		return o;
+	}
+
+public: // -- output -- //
+
+	// logs a record with format fmt_id (see LOG_SINK_ID()) and the given arguments - lock-free and allocation-free
+	// after the thread's first call. returns false if the record was dropped (ring full with drop_when_full, or
+	// larger than a whole ring).
+	template<typename ...Args>
+	bool log(std::uint32_t fmt_id, const Args &...args)
+	{
+		queue &q = local();
+		const std::size_t size = 8 + sum_sizes(args...);
+		const std::size_t need = round8(size);
+
+		std::uint64_t h = q.head.load(std::memory_order_relaxed);
+		std::size_t idx = (std::size_t)(h & (q.cap - 1));
+		const std::size_t to_end = q.cap - idx;
+		const std::size_t total = need + (to_end < need ? to_end : 0);
+		if (total > q.cap || size > 0xffffffff) { drop_count.fetch_add(1, std::memory_order_relaxed); return false; }
+
+		while (q.cap - (h - q.cached_tail) < total)
+		{
+			q.cached_tail = q.tail.load(std::memory_order_acquire);
+			if (q.cap - (h - q.cached_tail) >= total) break;
+			if (opt.drop_when_full) { drop_count.fetch_add(1, std::memory_order_relaxed); return false; }
+			std::this_thread::yield();
+		}
+
+		if (to_end < need)
+		{
+			const std::uint32_t zero = 0;
+			std::memcpy(q.buf.get() + idx, &zero, 4);
+			h += to_end;
+			idx = 0;
+		}
+
+		char *p = q.buf.get() + idx;
+		const std::uint32_t s32 = (std::uint32_t)size;
+		std::memcpy(p, &s32, 4);
+		std::memcpy(p + 4, &fmt_id, 4);
+		put_all(p + 8, args...);
+
+		q.head.store(h + need, std::memory_order_release);
+
+		// pairs with the fence in run() - the record is visible before the flag is read
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false, std::memory_order_relaxed))
+		{
+			{ std::lock_guard<std::mutex> lock(mtx); } // the drain is either not yet waiting (and sees the flag) or waiting
+			work.notify_one();
+		}
+		return true;
+	}
+
+	// blocks until everything logged before this call has been written out, then flushes the file.
+	void flush()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		const std::uint64_t ticket = ++flush_requests;
+		work.notify_one();
+		flushed.wait(lock, [&] { return flush_done >= ticket; });
+	}
+
+	// returns the number of records dropped so far.
+	std::uint64_t dropped() const noexcept { return drop_count.load(std::memory_order_relaxed); }
+
+public: // -- decoding -- //
+
+	// converts a binary log (written in output_mode::binary) read from in to text written to out.
+	// returns false if the log is truncated or malformed (everything before that point is still decoded).
+	static bool decode(cfile &in, cfile &out)
+	{
+		std::vector<std::shared_ptr<const parsed_format>> fmts;
+		std::vector<char> payload;
+		std::string text;
+
+		for (int tag; (tag = in.getc()) != EOF; )
+		{
+			std::uint32_t fid, n;
+			if (in.read(&fid, 1) != 1 || in.read(&n, 1) != 1) return false;
+			payload.resize(n);
+			if (n && in.read(payload.data(), 1, n) != n) return false;
+
+			if (tag == 'F')
+			{
+				if (fid >= fmts.size()) fmts.resize(fid + 1);
+				payload.push_back('\0');
+				fmts[fid] = std::make_shared<const parsed_format>(parse(payload.data()));
+			}
+			else if (tag == 'R')
+			{
+				if (fid >= fmts.size() || !fmts[fid]) return false;
+				text.clear();
+				format_record(text, *fmts[fid], payload.data(), payload.data() + n);
+				out.write(&text[0], 1, text.size());
+			}
+			else return false;
+		}
+		return true;
+	}
+};
+
+#endif
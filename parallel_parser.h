@@ -0,0 +1,230 @@
+#ifndef DRAGAZO_PARALLEL_PARSER_H
+#define DRAGAZO_PARALLEL_PARSER_H
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "cfile.h"
+
+// parses a text file on several threads at once.
+// the file is cut into one byte range per thread, each cut moved forward to just past the next newline so no line is split,
+// and every range is handed to a parse function on its own thread. results come back one per range, in file order.
+// the file is mapped into memory (or, where that fails, each range is read with pread()), and the parse function gets its
+// range either as raw memory or as a cfile reading just that range:
+//     parse(cfile::input_span range, Result &out) - zero copy, for hand written parsers
+//     parse(cfile &range, Result &out)            - a stdio stream over the range (fmemopen()), so existing scanf()/gets()
+//                                                   based readers run unchanged
+// the parse function is called concurrently and must be thread safe (each call gets its own Result).
+// its parameter types must be spelled out (not auto) so the right form can be picked.
+// the file must not change while it is being parsed.
+class parallel_parser
+{
+public: // -- types -- //
+
+	// a range of the file [begin, end) - begins at the start of a line and ends just after a newline (or at eof).
+	struct range
+	{
+		std::uint64_t begin, end;
+
+		std::uint64_t size() const noexcept { return end - begin; }
+	};
+
+private: // -- data -- //
+
+	int fd = -1;
+	std::uint64_t file_size = 0;
+	const char *map = nullptr; // the whole file, or null if it couldn't be mapped
+	std::vector<range> parts;
+
+	// returns the offset just past the first newline at or after pos (or the file size).
+	std::uint64_t line_end_after(std::uint64_t pos) const
+	{
+		if (map)
+		{
+			const void *nl = std::memchr(map + pos, '\n', file_size - pos);
+			return nl ? (std::uint64_t)(static_cast<const char*>(nl) - map) + 1 : file_size;
+		}
+		char buf[4096];
+		while (pos < file_size)
+		{
+			const ssize_t n = ::pread(fd, buf, sizeof(buf), (off_t)pos);
+			if (n <= 0) break;
+			const void *nl = std::memchr(buf, '\n', (std::size_t)n);
+			if (nl) return pos + (std::uint64_t)(static_cast<const char*>(nl) - buf) + 1;
+			pos += (std::uint64_t)n;
+		}
+		return file_size;
+	}
+
+	void split(std::size_t count)
+	{
+		parts.clear();
+		if (count == 0) count = 1;
+		std::uint64_t begin = 0;
+		for (std::size_t i = 1; i <= count && begin < file_size; ++i)
+		{
+			// aim for an even share, then move the cut past the end of the line it lands in
+			const std::uint64_t target = i == count ? file_size : file_size / count * i;
+			if (target <= begin) continue; // the previous range's last line already reaches past this cut
+			const std::uint64_t end = target == file_size ? file_size : line_end_after(target - 1);
+			parts.push_back(range{ begin, end });
+			begin = end;
+		}
+	}
+
+	template<typename F, typename R>
+	static auto call_parse(F &parse, cfile::input_span span, R &out, int) -> decltype(parse(span, out), void()) { parse(span, out); }
+	template<typename F, typename R>
+	static void call_parse(F &parse, cfile::input_span span, R &out, long)
+	{
+		// no span overload - give it a stream over the range instead
+		if (span.empty()) return;
+		cfile f(::fmemopen(const_cast<char*>(span.data()), span.size(), "r"));
+		if (f) parse(f, out);
+	}
+
+	// runs parse over the given range (on the calling thread).
+	template<typename F, typename R>
+	bool parse_range(F &parse, const range &r, R &out) const
+	{
+		if (map)
+		{
+			call_parse(parse, cfile::input_span{ map + r.begin, (std::size_t)r.size() }, out, 0);
+			return true;
+		}
+		std::vector<char> buf((std::size_t)r.size());
+		for (std::size_t done = 0; done < buf.size(); )
+		{
+			const ssize_t n = ::pread(fd, buf.data() + done, buf.size() - done, (off_t)(r.begin + done));
+			if (n <= 0) return false;
+			done += (std::size_t)n;
+		}
+		call_parse(parse, cfile::input_span{ buf.data(), buf.size() }, out, 0);
+		return true;
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates a parser without a file.
+	parallel_parser() = default;
+
+	// opens a file and splits it into one range per thread - equivalent to calling open(path, threads).
+	explicit parallel_parser(const char *path, std::size_t threads = 0) { open(path, threads); }
+
+	parallel_parser(const parallel_parser&) = delete;
+	parallel_parser &operator=(const parallel_parser&) = delete;
+
+	~parallel_parser() { close(); }
+
+public: // -- file state -- //
+
+	// opens a (regular) file and splits it into one range per thread (0 = one per hardware thread).
+	// returns true on success.
+	bool open(const char *path, std::size_t threads = 0)
+	{
+		close();
+		fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		{
+			close();
+			return false;
+		}
+		file_size = (std::uint64_t)st.st_size;
+
+		if (file_size > 0)
+		{
+			void *p = ::mmap(nullptr, (std::size_t)file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				map = static_cast<const char*>(p);
+				::madvise(p, (std::size_t)file_size, MADV_SEQUENTIAL); // each thread scans its range front to back
+			}
+		}
+		set_threads(threads);
+		return true;
+	}
+
+	// unmaps and closes the file.
+	void close()
+	{
+		if (map) ::munmap(const_cast<char*>(map), (std::size_t)file_size);
+		if (fd >= 0) ::close(fd);
+		map = nullptr;
+		fd = -1;
+		file_size = 0;
+		parts.clear();
+	}
+
+	// returns true if a file is open.
+	explicit operator bool() const noexcept { return fd >= 0; }
+	// returns true if no file is open.
+	bool operator!() const noexcept { return fd < 0; }
+
+	// re-splits the file into one range per thread (0 = one per hardware thread).
+	// fewer ranges result if the file has fewer lines than that.
+	void set_threads(std::size_t threads)
+	{
+		if (threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+		split(threads);
+	}
+
+	// returns the size of the file.
+	std::uint64_t size() const noexcept { return file_size; }
+	// returns true if the file is memory mapped (otherwise ranges are read with pread()).
+	bool mapped() const noexcept { return map != nullptr; }
+	// returns the ranges the file is split into, in file order (one thread each).
+	const std::vector<range> &ranges() const noexcept { return parts; }
+
+public: // -- parsing -- //
+
+	// parses every range on its own thread with parse(range, Result&) (see the class comment for the accepted
+	// signatures) and returns the results in file order - one default constructed Result per range.
+	// a range that can't be read leaves its Result untouched.
+	template<typename Result, typename F>
+	std::vector<Result> run(F &&parse) const
+	{
+		std::vector<Result> results(parts.size());
+		if (parts.empty()) return results;
+
+		std::vector<std::thread> workers;
+		workers.reserve(parts.size() - 1);
+		for (std::size_t i = 1; i < parts.size(); ++i) workers.emplace_back([&, i] { parse_range(parse, parts[i], results[i]); });
+		parse_range(parse, parts[0], results[0]); // the first range on this thread
+		for (std::thread &t : workers) t.join();
+		return results;
+	}
+
+	// like run() with a std::vector<T> per range, but concatenates them (in file order) into one.
+	template<typename T, typename F>
+	std::vector<T> run_concat(F &&parse) const
+	{
+		std::vector<std::vector<T>> results = run<std::vector<T>>(std::forward<F>(parse));
+		std::size_t total = 0;
+		for (const std::vector<T> &r : results) total += r.size();
+
+		std::vector<T> all;
+		all.reserve(total);
+		for (std::vector<T> &r : results) all.insert(all.end(), std::make_move_iterator(r.begin()), std::make_move_iterator(r.end()));
+		return all;
+	}
+};
+
+#endif
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef DRAGAZO_PARTITIONED_WRITER_H
+#define DRAGAZO_PARTITIONED_WRITER_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <list>
+#include <set>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+#include "cfile.h"
+#include "format_output.h"
+
+// writes records into many partition files (e.g. the output of a shuffle) under one global memory budget.
+// instead of every partition holding an open cfile with its own stdio buffer, partitions buffer their output in fixed-size
+// slabs taken from a shared pool. when the pool runs dry the partition holding the most data is written out (one fwrite()
+// per slab) and its slabs are recycled, so memory stays bounded and writes stay large no matter how many partitions there are.
+// partition files are opened on demand and at most max_open of them are open at a time (least recently used are closed).
+// a partition's file is created (truncated) the first time it is written to - partitions that never get data have no file.
+// not thread safe - use one partitioned_writer per thread (or guard it externally).
+class partitioned_writer
+{
+public: // -- types -- //
+
+	struct options
+	{
+		std::size_t budget = 64 << 20;   // total bytes of buffered output across all partitions
+		std::size_t slab_size = 64 << 10; // unit of allocation (and the smallest write issued when under memory pressure)
+		std::size_t max_open = 64;       // max number of partition files open at once
+	};
+
+private: // -- data -- //
+
+	struct partition
+	{
+		std::vector<char*> slabs;            // buffered output - all slabs but the last are full
+		std::size_t tail = 0;                // bytes used in the last slab
+		cfile file;
+		bool created = false;                // the file exists (reopen for appending rather than truncate)
+		bool open = false;
+		std::list<std::size_t>::iterator lru; // position in open_files (if open)
+	};
+
+	const std::string pattern;
+	const options opt;
+
+	std::vector<partition> parts;
+
+	std::vector<std::unique_ptr<char[]>> arena; // every slab ever allocated
+	std::vector<char*> free_slabs;
+	std::size_t max_slabs;
+
+	std::set<std::pair<std::size_t, std::size_t>, std::greater<std::pair<std::size_t, std::size_t>>> by_size; // (slab count, partition) of non-empty partitions
+	std::list<std::size_t> open_files; // most recently used first
+	bool failed = false;
+
+	std::string make_path(std::size_t index) const
+	{
+		int n = std::snprintf(nullptr, 0, pattern.c_str(), (unsigned long long)index);
+		std::string res(n > 0 ? (std::size_t)n : 0, '\0');
+		std::snprintf(&res[0], res.size() + 1, pattern.c_str(), (unsigned long long)index);
+		return res;
+	}
+
+	// makes sure a partition's file is open, closing the least recently used one if at the limit.
+	// returns null (and sets the error flag) if the file can't be opened.
+	cfile *open_file(std::size_t index)
+	{
+		partition &p = parts[index];
+		if (p.open)
+		{
+			open_files.splice(open_files.begin(), open_files, p.lru);
+			return &p.file;
+		}
+		if (open_files.size() >= std::max<std::size_t>(opt.max_open, 1))
+		{
+			partition &victim = parts[open_files.back()];
+			victim.file.close();
+			victim.open = false;
+			open_files.pop_back();
+		}
+
+		if (!p.file.open(make_path(index).c_str(), p.created ? "ab" : "wb"))
+		{
+			failed = true;
+			return nullptr;
+		}
+		// whole slabs are written at once, so stdio buffering would only add a copy
+		if (p.file.setvbuf(nullptr, _IONBF, 0) != 0) failed = true;
+		p.created = true;
+		p.open = true;
+		open_files.push_front(index);
+		p.lru = open_files.begin();
+		return &p.file;
+	}
+
+	// writes out everything a partition has buffered and recycles its slabs.
+	// if the file can't be opened the data is dropped (the slabs are needed elsewhere) - error() reports it.
+	void write_out(std::size_t index)
+	{
+		partition &p = parts[index];
+		if (p.slabs.empty()) return;
+		by_size.erase({ p.slabs.size(), index });
+
+		cfile *const f = open_file(index);
+		for (std::size_t i = 0; i < p.slabs.size(); ++i)
+		{
+			const std::size_t n = i + 1 < p.slabs.size() ? opt.slab_size : p.tail;
+			if (f && f->write(p.slabs[i], 1, n) != n) failed = true;
+			free_slabs.push_back(p.slabs[i]);
+		}
+		p.slabs.clear();
+		p.tail = 0;
+	}
+
+	// gives a partition a fresh slab - from the pool if possible, otherwise by writing out the largest partition.
+	void add_slab(std::size_t index)
+	{
+		if (free_slabs.empty())
+		{
+			if (arena.size() < max_slabs)
+			{
+				arena.emplace_back(new char[opt.slab_size]);
+				free_slabs.push_back(arena.back().get());
+			}
+			else write_out(by_size.begin()->second); // largest first (may be index itself)
+		}
+
+		partition &p = parts[index];
+		if (!p.slabs.empty()) by_size.erase({ p.slabs.size(), index });
+		p.slabs.push_back(free_slabs.back());
+		free_slabs.pop_back();
+		p.tail = 0;
+		by_size.insert({ p.slabs.size(), index });
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates a writer for count partitions. partition paths come from a printf-style pattern with a single
+	// unsigned long long conversion for the partition index (e.g. "shuffle/part-%05llu").
+	partitioned_writer(const char *path_pattern, std::size_t count, const options &o)
+		: pattern(path_pattern), opt(o), parts(count)
+	{
+		max_slabs = std::max<std::size_t>(opt.budget / std::max<std::size_t>(opt.slab_size, 1), 1);
+	}
+	// creates a writer for count partitions with the default options.
+	partitioned_writer(const char *path_pattern, std::size_t count) : partitioned_writer(path_pattern, count, options()) {}
+
+	partitioned_writer(const partitioned_writer&) = delete;
+	partitioned_writer &operator=(const partitioned_writer&) = delete;
+
+	// writes out all buffered data and closes every partition file.
+	~partitioned_writer() { close(); }
+
+public: // -- partitions -- //
+
+	// returns the number of partitions.
+	std::size_t size() const noexcept { return parts.size(); }
+
+	// returns the partition a key hashes to (fnv-1a).
+	std::size_t partition_of(const void *key, std::size_t len) const noexcept
+	{
+		std::uint64_t h = 0xcbf29ce484222325ull;
+		for (std::size_t i = 0; i < len; ++i) h = (h ^ static_cast<const unsigned char*>(key)[i]) * 0x100000001b3ull;
+		return (std::size_t)(h % parts.size());
+	}
+	// returns the partition a string key hashes to.
+	std::size_t partition_of(const char *key) const noexcept { return partition_of(key, std::strlen(key)); }
+
+	// returns the number of bytes currently buffered across all partitions.
+	std::size_t buffered() const noexcept
+	{
+		std::size_t res = 0;
+		for (const auto &e : by_size) res += (e.first - 1) * opt.slab_size + parts[e.second].tail;
+		return res;
+	}
+	// returns the number of partition files currently open.
+	std::size_t open_count() const noexcept { return open_files.size(); }
+
+	// returns true if opening or writing some partition file has failed.
+	bool error() const noexcept { return failed; }
+
+	// writes out everything buffered, largest partitions first. files stay open.
+	void flush()
+	{
+		while (!by_size.empty()) write_out(by_size.begin()->second);
+	}
+
+	// writes out everything buffered and closes every partition file. the writer can still be used afterwards.
+	void close()
+	{
+		flush();
+		for (std::size_t index : open_files)
+		{
+			parts[index].file.close();
+			parts[index].open = false;
+		}
+		open_files.clear();
+	}
+
+public: // -- output -- //
+
+	// writes (count) elements of size (size) to a partition (binary data).
+	// returns count - failures to open or write partition files show up in error().
+	std::size_t write(std::size_t index, const void *ptr, std::size_t size, std::size_t count)
+	{
+		const char *src = static_cast<const char*>(ptr);
+		std::size_t total = size * count;
+
+		// at least a whole slab - no point in buffering it
+		if (total >= opt.slab_size)
+		{
+			write_out(index);
+			cfile *const f = open_file(index);
+			if (f && f->write(const_cast<char*>(src), 1, total) != total) failed = true;
+			return count;
+		}
+
+		partition &p = parts[index];
+		while (total > 0)
+		{
+			if (p.slabs.empty() || p.tail == opt.slab_size) add_slab(index);
+			const std::size_t n = std::min(total, opt.slab_size - p.tail);
+			std::memcpy(p.slabs.back() + p.tail, src, n);
+			p.tail += n;
+			src += n;
+			total -= n;
+		}
+		return count;
+	}
+	// convenience function - passes correct size parameter to write() based on T.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t write(std::size_t index, const T *ptr, std::size_t count) { return write(index, static_cast<const void*>(ptr), sizeof(T), count); }
+	// convenience function - passes correct size and count parameters to write() based on T and length of array.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, int len, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t write(std::size_t index, const T(&ptr)[len]) { return write(index, static_cast<const void*>(ptr), sizeof(T), len); }
+
+	// writes a string to a partition.
+	int puts(std::size_t index, const char *str)
+	{
+		write(index, str, 1, std::strlen(str));
+		return 0;
+	}
+
+	// prints a formatted string to a partition.
+	int printf(std::size_t index, const char *fmt, ...)
+	{
+		char small[512];
+		va_list v;
+		va_start(v, fmt);
+		const int n = vformat(fmt, v,
+			[&](std::size_t count, std::size_t &avail) { avail = sizeof(small); return count <= avail ? small : nullptr; },
+			[&](std::size_t count) { write(index, small, 1, count); },
+			[&](const char *str, std::size_t count) { write(index, str, 1, count); });
+		va_end(v);
+		return n;
+	}
+};
+
+#endif
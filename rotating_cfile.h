@@ -0,0 +1,290 @@
+#ifndef DRAGAZO_ROTATING_CFILE_H
+#define DRAGAZO_ROTATING_CFILE_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <chrono>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <utility>
+#include <type_traits>
+
+#include <sys/stat.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <spawn.h>
+#include <sys/wait.h>
+extern char **environ;
+#endif
+
+#include "cfile.h"
+
+// represents an output file that rolls over to a new segment once the current one reaches a size or age limit.
+// segment paths come from a printf-style pattern with a single unsigned long long conversion for the segment index
+// (e.g. "logs/app-%06llu.log").
+// a worker thread always keeps the next segment opened ahead of time, so a rotation is only a swap of two handles.
+// only new files are opened ahead - a segment file that already exists is opened when the rotation reaches it, so one that
+// ends up unused (e.g. at shutdown) is neither truncated nor deleted.
+// retired segments are closed on the worker thread, which then runs the optional on_rotated callback (e.g. to compress them),
+// so writers never wait on fclose() or compression. writers only wait if rotations outpace the worker opening files.
+// if the next segment can't be opened, writing carries on in the current one for another full segment before the open is
+// retried (see failed_rotations()) - after open_retries retries that segment index is skipped.
+// writes only fail while no segment is open at all.
+// all functions are safe to call from multiple threads - each call is written to a single segment as a unit.
+class rotating_cfile
+{
+public: // -- types -- //
+
+	struct options
+	{
+		std::size_t max_size = 64 << 20;                       // rotate once a segment holds this many bytes (0 = no limit)
+		std::chrono::seconds max_age{ 0 };                     // rotate once a segment is this old (0 = no limit)
+		const char *mode = "wb";                               // mode segments are opened with
+		unsigned long long first_index = 0;                    // index of the first segment
+		unsigned open_retries = 3;                             // failed opens of a segment that are retried before skipping it
+		std::function<void(const std::string&)> on_rotated;    // called on the worker thread with each closed segment's path
+	};
+
+private: // -- data -- //
+
+	typedef std::chrono::steady_clock clock;
+
+	const std::string pattern;
+	const options opt;
+
+	std::mutex mtx;                    // guards the current segment
+	cfile cur;
+	std::string cur_path;
+	std::size_t cur_size = 0;
+	clock::time_point cur_opened;
+	std::size_t failures = 0;          // rotations that found the next segment couldn't be opened
+
+	std::mutex wmtx;                   // guards everything the worker touches
+	std::condition_variable wcv;       // wakes the worker
+	std::condition_variable ready_cv;  // signalled when the next segment is ready
+	cfile next;
+	std::string next_path;
+	bool next_ready = false;
+	bool next_existing = false;        // next_path already existed - it is opened by rotate_locked() instead
+	unsigned long long next_index;
+	unsigned retries = 0;              // failed opens of next_index so far
+	std::deque<std::pair<cfile, std::string>> retired;
+	bool stopping = false;
+
+	std::thread worker;
+
+	std::string make_path(unsigned long long index) const
+	{
+		int n = std::snprintf(nullptr, 0, pattern.c_str(), index);
+		std::string res(n > 0 ? (std::size_t)n : 0, '\0');
+		std::snprintf(&res[0], res.size() + 1, pattern.c_str(), index);
+		return res;
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(wmtx);
+		for (;;)
+		{
+			wcv.wait(lock, [&] { return stopping || !next_ready || !retired.empty(); });
+
+			while (!retired.empty())
+			{
+				auto seg = std::move(retired.front());
+				retired.pop_front();
+				lock.unlock();
+				seg.first.close();
+				if (opt.on_rotated) opt.on_rotated(seg.second);
+				lock.lock();
+			}
+
+			if (stopping) break;
+			if (!next_ready)
+			{
+				const std::string path = make_path(next_index);
+				lock.unlock();
+				struct stat st;
+				const bool existing = ::stat(path.c_str(), &st) == 0;
+				cfile f;
+				if (!existing) f.open(path.c_str(), opt.mode);
+				lock.lock();
+				// a failed open is retried with the same index, until it has failed open_retries times more
+				if (f || existing || ++retries > opt.open_retries)
+				{
+					++next_index;
+					retries = 0;
+				}
+				next = std::move(f);
+				next_path = path;
+				next_existing = existing;
+				next_ready = true; // published either way - rotate_locked() checks whether it is open
+				ready_cv.notify_all();
+			}
+		}
+
+		// the pre-opened segment was never written to and only ever opened ahead if this writer created it - don't leave it behind
+		if (next_ready && next)
+		{
+			next.close();
+			std::remove(next_path.c_str());
+		}
+	}
+
+	// switches to the pre-opened segment (opening it now if its file already existed), handing the current one to the worker
+	// if retire is set (mtx must be held).
+	// if the worker couldn't open it, the current segment (if any) is kept - its limits start over, so the next attempt
+	// comes a full segment later.
+	void rotate_locked(bool retire = true)
+	{
+		std::unique_lock<std::mutex> lock(wmtx);
+		ready_cv.wait(lock, [&] { return next_ready; });
+
+		if (next_existing) next.open(next_path.c_str(), opt.mode);
+		if (next)
+		{
+			if (retire && cur) retired.emplace_back(std::move(cur), std::move(cur_path));
+			cur = std::move(next);
+			cur_path = std::move(next_path);
+		}
+		else ++failures;
+		next_ready = false; // either way the worker prepares (or retries) the next one
+		lock.unlock();
+		wcv.notify_one();
+
+		cur_size = 0;
+		cur_opened = clock::now();
+	}
+
+	// rotates first if the current segment has hit a limit, or there is none (mtx must be held).
+	void check_locked()
+	{
+		if (!cur || (opt.max_size && cur_size >= opt.max_size) || (opt.max_age.count() > 0 && clock::now() - cur_opened >= opt.max_age)) rotate_locked();
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// starts writing segments named after path_pattern, beginning with segment opt.first_index.
+	// the first segment is opened before this returns - check with operator bool().
+	rotating_cfile(const char *path_pattern, const options &o)
+		: pattern(path_pattern), opt(o), next_index(o.first_index)
+	{
+		worker = std::thread([this] { run(); });
+		std::lock_guard<std::mutex> lock(mtx);
+		rotate_locked(false);
+	}
+	// starts writing segments named after path_pattern with the default options.
+	explicit rotating_cfile(const char *path_pattern) : rotating_cfile(path_pattern, options()) {}
+
+	rotating_cfile(const rotating_cfile&) = delete;
+	rotating_cfile &operator=(const rotating_cfile&) = delete;
+
+	// closes the current segment (running on_rotated for it as well) and stops the worker thread.
+	~rotating_cfile()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			std::lock_guard<std::mutex> wlock(wmtx);
+			if (cur) retired.emplace_back(std::move(cur), std::move(cur_path));
+			stopping = true;
+		}
+		wcv.notify_one();
+		worker.join();
+	}
+
+public: // -- file state -- //
+
+	// returns true if the current segment is open.
+	explicit operator bool() { std::lock_guard<std::mutex> lock(mtx); return (bool)cur; }
+
+	// returns the path of the current segment.
+	std::string path() { std::lock_guard<std::mutex> lock(mtx); return cur_path; }
+
+	// returns the number of rotations (or retries, while no segment is open) that couldn't open the next segment.
+	std::size_t failed_rotations() { std::lock_guard<std::mutex> lock(mtx); return failures; }
+
+	// switches to the next segment right away.
+	void rotate() { std::lock_guard<std::mutex> lock(mtx); rotate_locked(); }
+
+	// flushes the current segment.
+	void flush() { std::lock_guard<std::mutex> lock(mtx); if (cur) cur.flush(); }
+
+public: // -- output -- //
+
+	// writes (count) elements of size (size) to the current segment (binary data).
+	// all output fails (returns 0 or EOF) while no segment is open.
+	std::size_t write(const void *ptr, std::size_t size, std::size_t count)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		check_locked();
+		if (!cur) return 0;
+		const std::size_t r = cur.write(const_cast<void*>(ptr), size, count);
+		cur_size += r * size;
+		return r;
+	}
+	// convenience function - passes correct size parameter to write() based on T.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t write(const T *ptr, std::size_t count) { return write(static_cast<const void*>(ptr), sizeof(T), count); }
+	// convenience function - passes correct size and count parameters to write() based on T and length of array.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, int len, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t write(const T(&ptr)[len]) { return write(static_cast<const void*>(ptr), sizeof(T), len); }
+
+	// writes a char to the current segment.
+	int putc(int ch)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		check_locked();
+		if (!cur) return EOF;
+		const int r = cur.putc(ch);
+		if (r != EOF) ++cur_size;
+		return r;
+	}
+
+	// writes a string to the current segment.
+	int puts(const char *str)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		check_locked();
+		if (!cur) return EOF;
+		const int r = cur.puts(str);
+		if (r >= 0) cur_size += std::strlen(str);
+		return r;
+	}
+
+	// prints a formatted string to the current segment.
+	int printf(const char *fmt, ...)
+	{
+		va_list v;
+		va_start(v, fmt);
+		std::lock_guard<std::mutex> lock(mtx);
+		check_locked();
+		const int r = cur ? std::vfprintf(cur, fmt, v) : -1;
+		va_end(v);
+		if (r > 0) cur_size += (std::size_t)r;
+		return r;
+	}
+
+public: // -- helpers -- //
+
+#if defined(__unix__) || defined(__APPLE__)
+	// an on_rotated callback that compresses a closed segment in place with an external `gzip` (producing path.gz).
+	static void gzip(const std::string &path)
+	{
+		const char *argv[] = { "gzip", "-f", path.c_str(), nullptr };
+		pid_t pid;
+		if (::posix_spawnp(&pid, "gzip", nullptr, nullptr, const_cast<char**>(argv), environ) == 0)
+		{
+			int status;
+			::waitpid(pid, &status, 0);
+		}
+	}
+#endif
+};
+
+#endif
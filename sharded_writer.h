@@ -0,0 +1,256 @@
+#ifndef DRAGAZO_SHARDED_WRITER_H
+#define DRAGAZO_SHARDED_WRITER_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <new>
+
+#include "cfile.h"
+#include "buffer_alloc.h"
+#include "format_output.h"
+
+// funnels the output of many threads into a single cfile without contending on it for every call.
+// each thread writes into its own large buffer (its shard) and only whole buffers are handed to the file, each with one fwrite().
+// output of one shard is never split or interleaved with another, but the order of whole buffers is the order they fill up.
+// in ordered mode shards are never flushed automatically - instead each thread submits its buffer with flush(seq),
+// and buffers are written in increasing sequence order (starting at 0, no gaps), holding early arrivals until their turn.
+// flush() gives up on a gap: the held batches are written and the sequence continues after the last of them.
+class sharded_writer
+{
+public: // -- types -- //
+
+	// the per-thread buffer - obtained with sharded_writer::local() and only ever used by that thread.
+	// cache line aligned so the bookkeeping of different shards never shares a cache line.
+	class alignas(64) shard : public format_output<shard>
+	{
+	private: // -- data -- //
+
+		friend class sharded_writer;
+		friend class format_output<shard>;
+
+		sharded_writer &owner;
+		std::vector<char> buf; // capacity is the shard size (ordered shards may grow past it)
+		std::size_t used = 0;
+
+		explicit shard(sharded_writer &w) : owner(w), buf(w.buffer_size) {}
+
+		// makes room for at least count more bytes, flushing (unordered) or growing (ordered) as needed.
+		// returns false if count can never fit in an unordered shard (the caller then bypasses the buffer).
+		bool make_room(std::size_t count)
+		{
+			if (buf.size() - used >= count) return true;
+			if (owner.ordered)
+			{
+				buf.resize(std::max(buf.size() * 2, used + count));
+				return true;
+			}
+			owner.submit(*this);
+			return count <= buf.size();
+		}
+
+		char *output_area(std::size_t count, std::size_t &avail)
+		{
+			if (!make_room(count)) return nullptr;
+			avail = buf.size() - used;
+			return buf.data() + used;
+		}
+		void output_commit(std::size_t count) { used += count; }
+
+	public: // -- allocation -- //
+
+		// plain operator new ignores the extended alignment before c++17
+		static void *operator new(std::size_t size)
+		{
+			if (void *p = buffer_alloc::allocate(size, alignof(shard), false)) return p;
+			throw std::bad_alloc();
+		}
+		static void operator delete(void *p, std::size_t size) noexcept { buffer_alloc::deallocate(static_cast<char*>(p), size, alignof(shard), false); }
+
+	public: // -- output -- //
+
+		using format_output<shard>::write;
+
+		// writes (count) elements of size (size) into the shard (binary data).
+		// returns count.
+		std::size_t write(const void *ptr, std::size_t size, std::size_t count)
+		{
+			const std::size_t total = size * count;
+			if (!make_room(total)) owner.emit(static_cast<const char*>(ptr), total); // bigger than a whole buffer - send it straight through
+			else
+			{
+				std::memcpy(buf.data() + used, ptr, total);
+				used += total;
+			}
+			return count;
+		}
+
+		// hands the buffered data to the file (unordered mode).
+		void flush() { owner.submit(*this); }
+		// submits the buffered data as the batch with sequence number seq (ordered mode).
+		// it is written once all batches with lower sequence numbers have been written.
+		void flush(std::uint64_t seq) { owner.submit(*this, seq); }
+
+		// returns the number of bytes currently buffered in this shard.
+		std::size_t size() const noexcept { return used; }
+	};
+
+private: // -- data -- //
+
+	cfile &out;
+	const std::size_t buffer_size;
+	const bool ordered;
+	const std::uint64_t id; // distinguishes writers in the per-thread shard caches (never reused)
+
+	// a submitted shard buffer (ordered mode) - the first size bytes of data.
+	struct batch
+	{
+		std::vector<char> data;
+		std::size_t size;
+	};
+
+	std::mutex mtx; // guards shards, next_seq, pending, spare and (in ordered mode) the writes to out
+	std::vector<std::unique_ptr<shard>> shards;
+	std::uint64_t next_seq = 0;
+	std::map<std::uint64_t, batch> pending; // submitted batches waiting for their turn
+	std::vector<std::vector<char>> spare;    // buffers of written batches, handed back to shards on submit
+
+	const std::shared_ptr<char> alive = std::make_shared<char>(); // expires with the writer (see cache())
+
+	static std::uint64_t next_id()
+	{
+		static std::atomic<std::uint64_t> counter{ 0 };
+		return counter.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	struct cache_entry
+	{
+		std::uint64_t id;
+		shard *s;
+		std::weak_ptr<char> alive; // expired once the writer is gone - the entry is dropped on the next miss
+	};
+	// the calling thread's shards of every writer it has used.
+	static std::vector<cache_entry> &cache()
+	{
+		thread_local std::vector<cache_entry> c;
+		return c;
+	}
+
+	// writes raw bytes to the file - one locked fwrite() (the FILE lock is enough when unordered).
+	void emit(const char *ptr, std::size_t count)
+	{
+		if (count == 0) return;
+		if (ordered)
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			out.write(const_cast<char*>(ptr), 1, count);
+		}
+		else out.write(const_cast<char*>(ptr), 1, count);
+	}
+
+	void submit(shard &s)
+	{
+		if (ordered) return; // ordered shards only leave through flush(seq)
+		out.write(s.buf.data(), 1, s.used);
+		s.used = 0;
+	}
+	void submit(shard &s, std::uint64_t seq)
+	{
+		batch b{ std::move(s.buf), s.used };
+		s.used = 0;
+
+		std::lock_guard<std::mutex> lock(mtx);
+		// the shard carries on in the buffer of a batch that has been written (only allocated while warming up)
+		if (!spare.empty())
+		{
+			s.buf = std::move(spare.back());
+			spare.pop_back();
+		}
+		else s.buf.resize(buffer_size);
+
+		if (seq > next_seq)
+		{
+			pending.emplace(seq, std::move(b));
+			return;
+		}
+		// seq < next_seq only happens for a batch that flush() skipped over - it is written as it comes, like next_seq
+		write_batch(b);
+		if (seq == next_seq) ++next_seq;
+		for (auto it = pending.begin(); it != pending.end() && it->first == next_seq; it = pending.erase(it), ++next_seq)
+		{
+			write_batch(it->second);
+		}
+	}
+	// writes a batch and keeps its buffer for reuse (mtx must be held).
+	void write_batch(batch &b)
+	{
+		out.write(b.data.data(), 1, b.size);
+		spare.push_back(std::move(b.data));
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates a writer that funnels into file (which must outlive it) using per-thread buffers of size bytes.
+	// if in_order is true, shards are only written through shard::flush(seq) and in sequence order.
+	explicit sharded_writer(cfile &file, std::size_t size = 1 << 20, bool in_order = false)
+		: out(file), buffer_size(std::max<std::size_t>(size, 64)), ordered(in_order), id(next_id()) {}
+
+	sharded_writer(const sharded_writer&) = delete;
+	sharded_writer &operator=(const sharded_writer&) = delete;
+
+	// flushes everything that is still buffered - see flush().
+	~sharded_writer()
+	{
+		flush();
+		std::vector<cache_entry> &c = cache();
+		c.erase(std::remove_if(c.begin(), c.end(), [&](const cache_entry &e) { return e.id == id; }), c.end());
+	}
+
+public: // -- output -- //
+
+	// returns the calling thread's shard, creating it on first use.
+	shard &local()
+	{
+		std::vector<cache_entry> &c = cache();
+		for (const cache_entry &e : c) if (e.id == id) return *e.s;
+
+		// first use on this thread - also a good time to forget the writers that are gone
+		c.erase(std::remove_if(c.begin(), c.end(), [](const cache_entry &e) { return e.alive.expired(); }), c.end());
+		shard *s;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			shards.emplace_back(new shard(*this));
+			s = shards.back().get();
+		}
+		c.push_back(cache_entry{ id, s, alive });
+		return *s;
+	}
+
+	// writes out every shard's buffered data, then flushes the file.
+	// in ordered mode, batches still waiting for a missing sequence number are written in order after the gap,
+	// followed by any unsubmitted shard data. the sequence then continues one past the last batch written, so a later
+	// flush(seq) with the next number is written right away (the missing batches are written whenever they arrive).
+	// must not race with threads that are writing to their shards.
+	void flush()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		for (auto &p : pending) write_batch(p.second);
+		if (!pending.empty()) next_seq = pending.rbegin()->first + 1;
+		pending.clear();
+		for (auto &s : shards)
+		{
+			out.write(s->buf.data(), 1, s->used);
+			s->used = 0;
+		}
+		out.flush();
+	}
+};
+
+#endif
@@ -0,0 +1,456 @@
+#ifndef DRAGAZO_SHM_CHANNEL_H
+#define DRAGAZO_SHM_CHANNEL_H
+
+#ifdef __linux__
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <new>
+
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "format_output.h"
+
+// represents one end of a single-producer single-consumer byte channel in shared memory.
+// the ring lives in a memfd, so it can be shared by fork() or by passing fd() to another process and calling attach().
+// the data region is mapped twice back to back so every read/write sees contiguous memory, even across the wrap point.
+// blocked ends briefly spin and then sleep on a futex in the shared header.
+// each end records its process id in the header when it first reads/writes. a blocked end notices when the other one has
+// closed its handle, and every poll_ms it checks that the other end's process still exists (so both must be in the same
+// pid namespace): a reader then sees eof, and a writer gives up and reports error(). set_timeout() bounds every wait.
+// exactly one thread (in any process) may write and exactly one may read at a time.
+// the output/input functions mirror those of cfile so code can switch transports.
+class shm_channel : public format_output<shm_channel>
+{
+private: // -- data -- //
+
+	friend class format_output<shm_channel>;
+
+	struct alignas(64) header
+	{
+		alignas(64) std::atomic<std::uint64_t> head;         // total bytes written (owned by the writer)
+		alignas(64) std::atomic<std::uint64_t> tail;         // total bytes read (owned by the reader)
+		alignas(64) std::atomic<std::uint32_t> data_seq;     // futex word the reader sleeps on
+		std::atomic<std::uint32_t> reader_waiting;
+		alignas(64) std::atomic<std::uint32_t> space_seq;    // futex word the writer sleeps on
+		std::atomic<std::uint32_t> writer_waiting;
+		alignas(64) std::atomic<std::uint32_t> closed;       // set by close_write() - no more data will arrive
+		std::atomic<std::int32_t> reader_pid;                // process of the reading end (0 = none yet, -1 = it closed)
+		std::atomic<std::int32_t> writer_pid;                // process of the writing end (0 = none yet, -1 = it closed)
+		std::uint64_t capacity;                              // size of the data region (power of 2)
+	};
+
+	static constexpr int spin_limit = 4096; // polls before a blocked end goes to sleep (multi-core machines only)
+	static constexpr int yield_limit = 16;  // times a blocked end yields the cpu before it goes to sleep
+	static constexpr int poll_ms = 100;     // how often a sleeping end checks that the other end's process still exists
+
+	int fd_ = -1;               // the memfd backing the channel
+	void *map = nullptr;        // base of the whole mapping (header + data + data mirror)
+	std::size_t map_size = 0;
+	header *h = nullptr;
+	char *data = nullptr;       // start of the (doubly mapped) data region
+	std::uint64_t cap = 0;
+
+	std::uint64_t cached_tail = 0; // writer's last view of tail (avoids touching the reader's cache line)
+	std::uint64_t cached_head = 0; // reader's last view of head
+
+	bool reading = false, writing = false; // this handle has registered as the reading/writing end
+	bool failed = false;                   // an operation gave up (other end gone or timed out)
+	long timeout_ms = -1;                  // longest a single wait may take (-1 = forever)
+
+	static std::size_t header_size() { return std::max<std::size_t>(sizeof(header), (std::size_t)::sysconf(_SC_PAGESIZE)); }
+
+	// returns false if it timed out.
+	static bool futex_wait(std::atomic<std::uint32_t> &word, std::uint32_t expected, long ms)
+	{
+		const timespec t{ (std::time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+		return ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT, expected, &t, nullptr, 0) == 0 || errno != ETIMEDOUT;
+	}
+	static void futex_wake(std::atomic<std::uint32_t> &word)
+	{
+		::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+	}
+	static void cpu_relax()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+
+	// maps an already sized memfd - returns false (and unmaps everything) on failure.
+	bool map_fd(int fd, std::uint64_t capacity)
+	{
+		const std::size_t hs = header_size();
+		const std::size_t total = hs + 2 * capacity;
+
+		// reserve the whole range, then map the file over it twice so the data region is mirrored
+		char *base = static_cast<char*>(::mmap(nullptr, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (base == MAP_FAILED) return false;
+		if (::mmap(base, hs + capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+			|| ::mmap(base + hs + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, hs) == MAP_FAILED)
+		{
+			::munmap(base, total);
+			return false;
+		}
+
+		fd_ = fd;
+		map = base;
+		map_size = total;
+		h = reinterpret_cast<header*>(base);
+		data = base + hs;
+		cap = capacity;
+		cached_tail = h->tail.load(std::memory_order_acquire);
+		cached_head = h->head.load(std::memory_order_acquire);
+		return true;
+	}
+
+	// wakes the other end if it is asleep - the fence orders our index store before the waiting flag load.
+	static void notify(std::atomic<std::uint32_t> &waiting, std::atomic<std::uint32_t> &seq)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_relaxed))
+		{
+			seq.fetch_add(1, std::memory_order_release);
+			futex_wake(seq);
+		}
+	}
+	// returns true if the end whose process id is in pid is gone - it closed its handle, or (with probe) its process died.
+	static bool gone(std::atomic<std::int32_t> &pid, bool probe)
+	{
+		std::int32_t p = pid.load(std::memory_order_acquire);
+		if (p < 0) return true;
+		if (!probe || p == 0 || ::kill(p, 0) == 0 || errno != ESRCH) return false;
+		pid.compare_exchange_strong(p, -1); // remember it, so later checks are cheap
+		return true;
+	}
+
+	// blocks until ready() holds - spins first, then sleeps on seq. gone(probe) says whether the other end is gone, and is
+	// probed every poll_ms while asleep. returns false if it gave up instead: the other end is gone or the timeout expired.
+	template<typename F, typename G>
+	bool wait(std::atomic<std::uint32_t> &waiting, std::atomic<std::uint32_t> &seq, F &&ready, G &&gone_fn)
+	{
+		// spinning on a single core only delays the other end
+		static const int spins = ::sysconf(_SC_NPROCESSORS_ONLN) > 1 ? spin_limit : 0;
+		for (int i = 0; i < spins; ++i)
+		{
+			if (ready()) return true;
+			cpu_relax();
+		}
+		for (int i = 0; i < yield_limit; ++i)
+		{
+			if (ready()) return true;
+			::sched_yield();
+		}
+		const auto start = std::chrono::steady_clock::now();
+		for (bool probe = false; !ready(); )
+		{
+			if (gone_fn(probe)) return ready();
+			long sleep = poll_ms;
+			if (timeout_ms >= 0)
+			{
+				const long left = timeout_ms - (long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+				if (left <= 0) return false;
+				sleep = std::min(sleep, left);
+			}
+
+			const std::uint32_t s = seq.load(std::memory_order_acquire);
+			waiting.store(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			probe = !ready() && !futex_wait(seq, s, sleep);
+			waiting.store(0, std::memory_order_relaxed);
+		}
+		return true;
+	}
+
+	// registers this handle as the reading/writing end of the channel.
+	void register_end(bool &flag, std::atomic<std::int32_t> &pid)
+	{
+		flag = true;
+		pid.store((std::int32_t)::getpid(), std::memory_order_release);
+	}
+
+	// returns the number of bytes the writer can currently write (refreshing the cached tail only when needed).
+	std::size_t writable(std::size_t want)
+	{
+		const std::uint64_t head = h->head.load(std::memory_order_relaxed);
+		if (cap - (head - cached_tail) < want) cached_tail = h->tail.load(std::memory_order_acquire);
+		return cap - (head - cached_tail);
+	}
+	// returns the number of bytes the reader can currently read (refreshing the cached head only when needed).
+	std::size_t readable(std::size_t want)
+	{
+		const std::uint64_t tail = h->tail.load(std::memory_order_relaxed);
+		if (cached_head - tail < want) cached_head = h->head.load(std::memory_order_acquire);
+		return cached_head - tail;
+	}
+
+	// publishes count bytes that were written at the head.
+	void commit_write(std::size_t count)
+	{
+		h->head.store(h->head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+		notify(h->reader_waiting, h->data_seq);
+	}
+	// releases count bytes that were consumed at the tail.
+	void commit_read(std::size_t count)
+	{
+		h->tail.store(h->tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+		notify(h->writer_waiting, h->space_seq);
+	}
+
+	// blocks until at least need bytes (clamped to capacity) are free and returns a pointer to the free region (its size in
+	// avail). want is how much the caller would like - the reader's position is only re-read if less than that is known
+	// to be free. returns null (and sets error()) if the reader is gone or the timeout expired.
+	char *reserve(std::size_t want, std::size_t need, std::size_t &avail)
+	{
+		if (!writing) register_end(writing, h->writer_pid);
+		need = std::min<std::size_t>(need, cap);
+		if (gone(h->reader_pid, false)
+			|| ((avail = writable(want)) < need && !wait(h->writer_waiting, h->space_seq, [&] { return (avail = writable(want)) >= need; }, [&](bool probe) { return gone(h->reader_pid, probe); })))
+		{
+			failed = true;
+			avail = 0;
+			return nullptr;
+		}
+		return data + (h->head.load(std::memory_order_relaxed) & (cap - 1));
+	}
+
+	// text larger than the whole ring is formatted on the side and streamed through write().
+	char *output_area(std::size_t count, std::size_t &avail) { return h && count <= cap ? reserve(count, count, avail) : nullptr; }
+	void output_commit(std::size_t count) { commit_write(count); }
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates an unlinked channel.
+	shm_channel() = default;
+
+	// creates a new channel with room for at least capacity bytes.
+	// equivalent to calling create(capacity).
+	explicit shm_channel(std::size_t capacity) { create(capacity); }
+
+	shm_channel(shm_channel &&other) noexcept { swap(other); }
+	shm_channel &operator=(shm_channel &&other) noexcept { close(); swap(other); return *this; }
+
+	shm_channel(const shm_channel&) = delete;
+	shm_channel &operator=(const shm_channel&) = delete;
+
+	~shm_channel() { close(); }
+
+	void swap(shm_channel &other) noexcept
+	{
+		std::swap(fd_, other.fd_);
+		std::swap(map, other.map);
+		std::swap(map_size, other.map_size);
+		std::swap(h, other.h);
+		std::swap(data, other.data);
+		std::swap(cap, other.cap);
+		std::swap(cached_tail, other.cached_tail);
+		std::swap(cached_head, other.cached_head);
+		std::swap(reading, other.reading);
+		std::swap(writing, other.writing);
+		std::swap(failed, other.failed);
+		std::swap(timeout_ms, other.timeout_ms);
+	}
+
+public: // -- channel state -- //
+
+	// creates a new channel backed by a fresh memfd and links it to this handle.
+	// capacity is rounded up to a power of 2 that is at least one page.
+	// if this handle is already linked, it is first closed.
+	// returns true on success, otherwise this handle is left unlinked.
+	bool create(std::size_t capacity)
+	{
+		close();
+
+		std::uint64_t c = (std::uint64_t)::sysconf(_SC_PAGESIZE);
+		while (c < capacity) c <<= 1;
+
+		int fd = ::memfd_create("shm_channel", MFD_CLOEXEC);
+		if (fd < 0) return false;
+		if (::ftruncate(fd, header_size() + c) != 0 || !map_fd(fd, c)) { ::close(fd); return false; }
+
+		new (h) header(); // the memfd is zero filled, but make the atomics' lifetimes official
+		h->capacity = c;
+		return true;
+	}
+
+	// links this handle to an existing channel given the memfd returned by fd() in another handle/process.
+	// this handle takes ownership of fd (even on failure).
+	// if this handle is already linked, it is first closed.
+	// returns true on success, otherwise this handle is left unlinked.
+	bool attach(int fd)
+	{
+		close();
+		if (fd < 0) return false;
+
+		struct stat st;
+		header probe;
+		if (::fstat(fd, &st) != 0 || ::pread(fd, &probe.capacity, sizeof(probe.capacity), offsetof(header, capacity)) != (ssize_t)sizeof(probe.capacity)
+			|| probe.capacity == 0 || (std::uint64_t)st.st_size != header_size() + probe.capacity || !map_fd(fd, probe.capacity))
+		{
+			::close(fd);
+			return false;
+		}
+		return true;
+	}
+
+	// unmaps the channel (if any) and enters the unlinked state.
+	// the other end learns that this one is gone: a reader sees eof once it has drained the channel, a writer's blocked
+	// (and later) writes fail. a writer should still call close_write() first to end the stream on purpose.
+	void close()
+	{
+		if (h)
+		{
+			// only the process that registered an end can leave it (not e.g. a forked child exiting with a copy)
+			const std::int32_t self = (std::int32_t)::getpid();
+			std::int32_t p = self;
+			if (reading && h->reader_pid.compare_exchange_strong(p, -1)) notify(h->writer_waiting, h->space_seq);
+			p = self;
+			if (writing && h->writer_pid.compare_exchange_strong(p, -1)) notify(h->reader_waiting, h->data_seq);
+		}
+		if (map) ::munmap(map, map_size);
+		if (fd_ >= 0) ::close(fd_);
+		fd_ = -1;
+		map = nullptr;
+		map_size = 0;
+		h = nullptr;
+		data = nullptr;
+		cap = 0;
+		cached_tail = cached_head = 0;
+		reading = writing = failed = false;
+	}
+
+	// signals that no more data will be written - the reader sees eof once it has drained the channel.
+	void close_write()
+	{
+		if (!h) return;
+		h->closed.store(1, std::memory_order_release);
+		notify(h->reader_waiting, h->data_seq);
+	}
+
+	// returns the memfd backing this channel (e.g. to pass to another process), or -1 if unlinked.
+	int fd() const noexcept { return fd_; }
+	// returns the capacity of the channel in bytes (0 if unlinked).
+	std::size_t capacity() const noexcept { return (std::size_t)cap; }
+
+	// returns true if this handle is currently linked to a channel.
+	explicit operator bool() const noexcept { return h != nullptr; }
+	// returns true if this handle is currently unlinked.
+	bool operator!() const noexcept { return h == nullptr; }
+
+	// returns nonzero if the writer has closed the channel and all data has been read.
+	int eof() { return !h || (h->closed.load(std::memory_order_acquire) && readable(1) == 0); }
+
+	// returns nonzero if a read or write gave up because the other end is gone or the timeout expired.
+	int error() const noexcept { return failed; }
+	// clears the error state.
+	void clearerr() noexcept { failed = false; }
+
+	// bounds how long a single blocking read/write waits for the other end (-1, the default, waits as long as it takes).
+	void set_timeout(long ms) noexcept { timeout_ms = ms < 0 ? -1 : ms; }
+
+	// writes are published as they happen, so this only has to make sure a sleeping reader is awake.
+	// returns 0 for parity with cfile::flush() / fflush().
+	int flush()
+	{
+		if (!h) return EOF;
+		notify(h->reader_waiting, h->data_seq);
+		return 0;
+	}
+
+public: // -- input -- //
+
+	// reads (count) elements of size (size) from the channel, blocking until they are available or eof.
+	// returns the number of complete elements read.
+	std::size_t read(void *ptr, std::size_t size, std::size_t count)
+	{
+		if (!h) return 0;
+		if (!reading) register_end(reading, h->reader_pid);
+		const std::size_t total = size * count;
+		char *dest = static_cast<char*>(ptr);
+		std::size_t done = 0;
+
+		while (done < total)
+		{
+			const std::size_t want = std::min<std::size_t>(total - done, cap);
+			std::size_t avail = readable(want);
+			if (avail == 0)
+			{
+				if (!wait(h->reader_waiting, h->data_seq, [&] { return (avail = readable(want)) != 0 || h->closed.load(std::memory_order_acquire); },
+					[&](bool probe) { return gone(h->writer_pid, probe); }))
+				{
+					if (gone(h->writer_pid, false)) h->closed.store(1, std::memory_order_release); // nothing more can arrive
+					else failed = true; // timed out
+				}
+				if (avail == 0 && (avail = readable(want)) == 0) break; // closed and drained (or gave up)
+			}
+
+			const std::size_t n = std::min(avail, total - done);
+			std::memcpy(dest + done, data + (h->tail.load(std::memory_order_relaxed) & (cap - 1)), n);
+			commit_read(n);
+			done += n;
+		}
+		return size ? done / size : 0;
+	}
+	// convenience function - passes correct size parameter to read() based on T.
+	// additionally, guarantees that T is a valid type to be read in this manner.
+	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t read(T *ptr, std::size_t count) { return read(static_cast<void*>(ptr), sizeof(T), count); }
+	// convenience function - passes correct size and count parameters to read() based on T and length of array.
+	// additionally, guarantees that T is a valid type to be read in this manner.
+	template<typename T, int len, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	std::size_t read(T(&ptr)[len]) { return read(static_cast<void*>(ptr), sizeof(T), len); }
+
+	// gets a character from the channel, blocking until one is available.
+	// returns EOF once the writer has closed the channel and it has been drained.
+	int getc()
+	{
+		unsigned char ch;
+		return read(&ch, 1, 1) == 1 ? ch : EOF;
+	}
+
+public: // -- output -- //
+
+	using format_output<shm_channel>::write;
+
+	// writes (count) elements of size (size) to the channel (binary data), blocking while the channel is full.
+	// data is copied in as space frees up, so a large write streams through the ring rather than waiting for it to drain.
+	// returns the number of complete elements written - fewer than count only if the reader is gone or the timeout expired.
+	std::size_t write(const void *ptr, std::size_t size, std::size_t count)
+	{
+		if (!h) return 0;
+		const std::size_t total = size * count;
+		const char *src = static_cast<const char*>(ptr);
+
+		std::size_t done = 0;
+		while (done < total)
+		{
+			std::size_t avail;
+			char *dest = reserve(total - done, 1, avail);
+			if (!dest) break;
+			const std::size_t n = std::min(avail, total - done);
+			std::memcpy(dest, src + done, n);
+			commit_write(n);
+			done += n;
+		}
+		return size ? done / size : 0;
+	}
+};
+
+#endif
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef DRAGAZO_TEE_CFILE_H
+#define DRAGAZO_TEE_CFILE_H
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "cfile.h"
+#include "format_output.h"
+
+// writes the same output to several cfiles at once.
+// everything is formatted/copied once into a shared buffer, which is handed to every target as a whole when it fills up
+// (or on flush()), so the formatting cost doesn't grow with the number of targets.
+// pump() forwards the contents of another stream to every target - on linux, when the source and all targets are pipes,
+// the data is duplicated kernel-side with tee() and never copied through user space.
+// the targets are not owned and must outlive the tee_cfile (which flushes its buffer on destruction).
+class tee_cfile : public format_output<tee_cfile>
+{
+private: // -- data -- //
+
+	friend class format_output<tee_cfile>;
+
+	std::vector<cfile*> targets;
+	std::vector<char> buf;
+	std::size_t used = 0;
+
+	// makes room for count more bytes - returns false if they can never fit (the caller then writes them directly).
+	bool make_room(std::size_t count)
+	{
+		if (buf.size() - used >= count) return true;
+		drain();
+		return count <= buf.size();
+	}
+
+	// hands the buffered bytes to every target.
+	void drain()
+	{
+		if (used == 0) return;
+		for (cfile *t : targets) t->write(buf.data(), 1, used);
+		used = 0;
+	}
+
+	void write_direct(const char *ptr, std::size_t count)
+	{
+		for (cfile *t : targets) t->write(const_cast<char*>(ptr), 1, count);
+	}
+
+	char *output_area(std::size_t count, std::size_t &avail)
+	{
+		if (!make_room(count)) return nullptr;
+		avail = buf.size() - used;
+		return buf.data() + used;
+	}
+	void output_commit(std::size_t count) { used += count; }
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates a tee with no targets and a buffer of buffer_size bytes.
+	explicit tee_cfile(std::size_t buffer_size = 64 * 1024) : buf(std::max<std::size_t>(buffer_size, 64)) {}
+	// creates a tee writing to the given targets.
+	tee_cfile(std::initializer_list<std::reference_wrapper<cfile>> files, std::size_t buffer_size = 64 * 1024) : tee_cfile(buffer_size)
+	{
+		for (cfile &f : files) add(f);
+	}
+
+	tee_cfile(const tee_cfile&) = delete;
+	tee_cfile &operator=(const tee_cfile&) = delete;
+
+	~tee_cfile() { drain(); }
+
+public: // -- targets -- //
+
+	// adds a target - buffered output is handed to the existing targets first.
+	void add(cfile &file)
+	{
+		drain();
+		targets.push_back(&file);
+	}
+	// removes a target - buffered output is handed to it (and the others) first.
+	void remove(cfile &file)
+	{
+		drain();
+		targets.erase(std::remove(targets.begin(), targets.end(), &file), targets.end());
+	}
+
+	// returns the number of targets.
+	std::size_t size() const noexcept { return targets.size(); }
+
+	// hands the buffered output to every target and flushes them all.
+	void flush()
+	{
+		drain();
+		for (cfile *t : targets) t->flush();
+	}
+
+public: // -- output -- //
+
+	using format_output<tee_cfile>::write;
+
+	// writes (count) elements of size (size) to every target (binary data).
+	// returns count.
+	std::size_t write(const void *ptr, std::size_t size, std::size_t count)
+	{
+		const std::size_t total = size * count;
+		if (!make_room(total)) write_direct(static_cast<const char*>(ptr), total);
+		else
+		{
+			std::memcpy(buf.data() + used, ptr, total);
+			used += total;
+		}
+		return count;
+	}
+
+public: // -- transfer -- //
+
+	// forwards up to len bytes (or until eof) from src to every target and returns the number of bytes forwarded.
+	// bytes src has already buffered are forwarded first. after that, on linux, if src and every target are pipes,
+	// the data is duplicated with tee() into all but the last target and then spliced into the last one (a single target
+	// just gets it spliced in, as much as each call moves).
+	// otherwise it is copied through a user buffer.
+	std::size_t pump(cfile &src, std::size_t len = (std::size_t)-1)
+	{
+		std::size_t total = 0;
+		if (!src || targets.empty()) return 0;
+
+		// forward whatever stdio already buffered (reading it issues no system calls)
+		drain();
+		for (std::size_t avail; total < len && (avail = std::min(src.in_avail(), len - total)) > 0; )
+		{
+			const std::size_t n = src.read(buf.data(), 1, std::min(avail, buf.size()));
+			write_direct(buf.data(), n);
+			total += n;
+		}
+		if (total == len) return total;
+		flush(); // raw writes below must not overtake buffered output
+
+#ifdef __linux__
+		const int in = ::fileno(src);
+		auto is_pipe = [](int fd) { struct stat st; return ::fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode); };
+		bool pipes = is_pipe(in);
+		for (cfile *t : targets) pipes = pipes && is_pipe(::fileno(*t));
+
+		if (pipes && targets.size() == 1)
+		{
+			// nothing to duplicate - move whatever each splice gets straight into the target
+			const int out = ::fileno(*targets[0]);
+			while (total < len)
+			{
+				ssize_t m = ::splice(in, nullptr, out, nullptr, std::min<std::size_t>(len - total, 1 << 20), SPLICE_F_MOVE);
+				if (m < 0 && errno == EINTR) continue;
+				if (m <= 0) break;
+				total += (std::size_t)m;
+			}
+			return total;
+		}
+		if (pipes)
+		{
+			std::vector<std::size_t> got(targets.size());
+			while (total < len)
+			{
+				// the first tee decides how much this round moves - the other targets must receive the same bytes
+				ssize_t n = ::tee(in, ::fileno(*targets[0]), std::min<std::size_t>(len - total, 1 << 20), 0);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) break;
+
+				bool short_tee = false;
+				got[0] = (std::size_t)n;
+				for (std::size_t i = 1; i + 1 < targets.size(); ++i)
+				{
+					ssize_t m;
+					do m = ::tee(in, ::fileno(*targets[i]), (std::size_t)n, 0); while (m < 0 && errno == EINTR);
+					got[i] = m > 0 ? (std::size_t)m : 0;
+					short_tee = short_tee || got[i] < (std::size_t)n;
+				}
+
+				if (!short_tee)
+				{
+					// consume the round by splicing it into the last target - the bytes are already in src, so this only
+					// takes more than one call if the last target is short of space
+					const int out = ::fileno(*targets.back());
+					std::size_t moved = 0;
+					while (moved < (std::size_t)n)
+					{
+						ssize_t m = ::splice(in, nullptr, out, nullptr, (std::size_t)n - moved, SPLICE_F_MOVE);
+						if (m < 0 && errno == EINTR) continue;
+						if (m <= 0) break;
+						moved += (std::size_t)m;
+					}
+					total += moved;
+					if (moved < (std::size_t)n) return total; // the last target failed
+				}
+				else
+				{
+					// some pipe was too full for the whole round - consume it through user space and fill in the gaps
+					std::vector<char> tmp((std::size_t)n);
+					std::size_t have = 0;
+					while (have < tmp.size())
+					{
+						ssize_t m = ::read(in, tmp.data() + have, tmp.size() - have);
+						if (m < 0 && errno == EINTR) continue;
+						if (m <= 0) break;
+						have += (std::size_t)m;
+					}
+					for (std::size_t i = 0; i < targets.size(); ++i)
+					{
+						const std::size_t from = i + 1 < targets.size() ? std::min(got[i], have) : 0;
+						targets[i]->write(tmp.data() + from, 1, have - from);
+						targets[i]->flush();
+					}
+					total += have;
+					if (have < tmp.size()) return total;
+				}
+			}
+			return total;
+		}
+#endif
+
+		// portable path - one read, many writes
+		while (total < len)
+		{
+			const std::size_t n = src.read(buf.data(), 1, std::min(buf.size(), len - total));
+			if (n == 0) break;
+			write_direct(buf.data(), n);
+			total += n;
+		}
+		return total;
+	}
+};
+
+#endif
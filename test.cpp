@@ -3,8 +3,36 @@
 #include <random>
 #include <iostream>
 #include <iomanip>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
 
 #include "cfile.h"
+#include "buffer_pool.h"
+#include "deferred_close.h"
+#include "shm_channel.h"
+#include "append_log.h"
+#include "sharded_writer.h"
+#include "wal.h"
+#include "log_sink.h"
+#include "tee_cfile.h"
+#include "flush_scheduler.h"
+#include "rotating_cfile.h"
+#include "partitioned_writer.h"
+#include "adaptive_cfile.h"
+#include "cfile_cache.h"
+#include "direct_file.h"
+#include "csv_reader.h"
+#include "csv_writer.h"
+#include "parallel_parser.h"
+#include "format_pipeline.h"
 
 template<bool integral>
 void write_benchmark(const char *file, std::size_t vals)
@@ -278,21 +306,1625 @@ void read_benchmark(const char *file)
 	std::cerr << '\n';
 }
 
-int main(int argc, const char *argv[])
+void sharded_writer_benchmark(const char *file, std::size_t vals)
 {
-	if (argc != 2)
+	using namespace std::chrono;
+
+	const std::size_t threads = 8;
+	std::cerr << "sharded writer benchmark (" << threads << " threads)\n";
+
+	// splits vals across the threads and times each thread running print(i) for its share
+	auto run = [&](const char *name, auto &&print)
 	{
-		std::cerr << "usage: " << argv[0] << " [test size]\n";
-		return 1;
+		auto start = high_resolution_clock::now();
+		{
+			std::vector<std::thread> workers;
+			for (std::size_t t = 0; t < threads; ++t) workers.emplace_back([&, t]
+			{
+				for (std::size_t i = t; i < vals; i += threads) print(i);
+			});
+			for (auto &w : workers) w.join();
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << name << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	};
+
+	{
+		cfile f(file, "wb");
+		run("  shared cfile: ", [&](std::size_t i) { f.printf("%zu\n", i); });
+	}
+	{
+		cfile f(file, "wb");
+		sharded_writer w(f);
+		run("sharded_writer: ", [&](std::size_t i) { w.local().printf("%zu\n", i); });
+	}
+	{
+		// ordered mode - flush() writes the batches held behind a gap and the sequence carries on after them
+		{
+			cfile f(file, "wb");
+			sharded_writer w(f, 64, true);
+			sharded_writer::shard &s = w.local();
+			s.puts("0"); s.flush(0);
+			s.puts("2"); s.flush(2);
+			w.flush();
+			s.puts("3"); s.flush(3);
+			f.flush();
+			const long before_missing = f.tell();
+			s.puts("1"); s.flush(1);
+			std::cerr << "  ordered flush: " << (before_missing == 3 ? "ok" : "MISMATCH");
+		}
+		cfile f(file, "rb");
+		char text[5] = {};
+		f.read(text, 1, 4);
+		std::cerr << ", file \"" << text << "\"\n";
 	}
-	
-	auto count = atoll(argv[1]);
 
-	write_benchmark<true>("data.dat", count);
-	read_benchmark<true>("data.dat");
+	std::cerr << '\n';
+}
 
-	write_benchmark<false>("data-f.dat", count);
-	read_benchmark<false>("data-f.dat");
+void log_sink_benchmark(const char *file, std::size_t vals)
+{
+	using namespace std::chrono;
+
+	std::cerr << "log sink benchmark (producer side)\n";
+
+	// times the logging calls only, then the time until everything has reached the file
+	auto run = [&](const char *name, auto &&log, auto &&finish)
+	{
+		auto start = high_resolution_clock::now();
+		for (std::size_t i = 0; i < vals; ++i) log(i);
+		auto mid = high_resolution_clock::now();
+		finish();
+		auto stop = high_resolution_clock::now();
+		std::cerr << name << duration_cast<nanoseconds>(mid - start).count() / (long long)std::max<std::size_t>(vals, 1) << " ns/call - "
+			<< duration_cast<milliseconds>(stop - start).count() << " ms total\n";
+	};
+
+	{
+		cfile f(file, "wb");
+		run("       cfile printf: ", [&](std::size_t i) { f.printf("request %zu took %f ms (%s)\n", i, i * 0.5, "ok"); }, [&] { f.flush(); });
+	}
+	{
+		cfile f(file, "wb");
+		log_sink sink(f);
+		run("    log_sink (text): ", [&](std::size_t i) { sink.log(LOG_SINK_ID("request %zu took %f ms (%s)\n"), i, i * 0.5, "ok"); }, [&] { sink.flush(); });
+	}
+	{
+		cfile f(file, "wb");
+		log_sink::options o;
+		o.mode = log_sink::output_mode::binary;
+		log_sink sink(f, o);
+		run("  log_sink (binary): ", [&](std::size_t i) { sink.log(LOG_SINK_ID("request %zu took %f ms (%s)\n"), i, i * 0.5, "ok"); }, [&] { sink.flush(); });
+	}
+	{
+		// decoding the binary log must reproduce what printf() writes
+		std::string expected;
+		{
+			cfile text(std::tmpfile());
+			for (std::size_t i = 0; i < vals; ++i) text.printf("request %zu took %f ms (%s)\n", i, i * 0.5, "ok");
+			text.seek(0);
+			for (int c; (c = text.getc()) != EOF; ) expected += (char)c;
+		}
+		cfile in(file, "rb"), decoded(std::tmpfile());
+		const bool ok = log_sink::decode(in, decoded);
+		decoded.seek(0);
+		std::string got;
+		for (int c; (c = decoded.getc()) != EOF; ) got += (char)c;
+		std::cerr << "             decode: " << (ok && got == expected ? "ok" : "MISMATCH") << '\n';
+	}
+
+	std::cerr << '\n';
+}
+
+void tee_cfile_benchmark(const char *file_a, const char *file_b, std::size_t vals)
+{
+	using namespace std::chrono;
+
+	std::cerr << "tee benchmark (2 targets)\n";
+
+	{
+		auto start = high_resolution_clock::now();
+		{
+			cfile a(file_a, "wb"), b(file_b, "wb");
+			for (std::size_t i = 0; i < vals; ++i)
+			{
+				a.printf("%zu %f\n", i, i * 0.5);
+				b.printf("%zu %f\n", i, i * 0.5);
+			}
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << "    printf per target: " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	}
+	{
+		auto start = high_resolution_clock::now();
+		{
+			cfile a(file_a, "wb"), b(file_b, "wb");
+			tee_cfile t{ a, b };
+			for (std::size_t i = 0; i < vals; ++i) t.printf("%zu %f\n", i, i * 0.5);
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << "            tee_cfile: " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	}
+#ifdef __linux__
+	// pump() between pipes - one target (splice), two targets (tee + splice) and three targets where the middle pipe is
+	// too small to take a whole round (the user space fallback). every target has to receive exactly the source bytes.
+	for (int config = 0; config < 3; ++config)
+	{
+		const std::size_t bytes = 8 << 20, targets = (std::size_t)config + 1;
+		int src[2], dst[3][2];
+		if (::pipe(src) != 0) break;
+		for (std::size_t i = 0; i < targets; ++i) if (::pipe(dst[i]) != 0) return;
+		if (config == 2) ::fcntl(dst[1][1], F_SETPIPE_SZ, 4096);
+
+		std::thread producer([&]
+		{
+			std::vector<unsigned char> chunk(12345);
+			for (std::size_t done = 0; done < bytes; )
+			{
+				const std::size_t n = std::min(chunk.size(), bytes - done);
+				for (std::size_t i = 0; i < n; ++i) chunk[i] = (unsigned char)((done + i) * 31 >> 3);
+				for (std::size_t w = 0; w < n; )
+				{
+					const ssize_t r = ::write(src[1], chunk.data() + w, n - w);
+					if (r <= 0) break;
+					w += (std::size_t)r;
+				}
+				done += n;
+			}
+			::close(src[1]);
+		});
+		std::vector<std::size_t> bad(targets), got(targets);
+		std::vector<std::thread> consumers;
+		for (std::size_t t = 0; t < targets; ++t) consumers.emplace_back([&, t]
+		{
+			unsigned char buf[65536];
+			for (ssize_t r; (r = ::read(dst[t][0], buf, sizeof(buf))) > 0; got[t] += (std::size_t)r)
+				for (ssize_t i = 0; i < r; ++i) bad[t] += buf[i] != (unsigned char)((got[t] + (std::size_t)i) * 31 >> 3);
+			::close(dst[t][0]);
+		});
+
+		std::size_t pumped;
+		{
+			cfile in(::fdopen(src[0], "rb"));
+			std::vector<cfile> outs;
+			for (std::size_t i = 0; i < targets; ++i) outs.emplace_back(::fdopen(dst[i][1], "wb"));
+			tee_cfile t;
+			for (cfile &o : outs) t.add(o);
+			pumped = t.pump(in);
+		}
+		producer.join();
+		for (auto &c : consumers) c.join();
+
+		bool ok = pumped == bytes;
+		for (std::size_t t = 0; t < targets; ++t) ok = ok && got[t] == bytes && bad[t] == 0;
+		static const char *const names[] = { "    pump (splice, 1 target): ", "      pump (tee, 2 targets): ", "pump (pipe full, 3 targets): " };
+		std::cerr << names[config] << pumped << " bytes " << (ok ? "ok" : "MISMATCH") << '\n';
+	}
+#endif
+
+	std::cerr << '\n';
+}
+
+void stream_buffer_benchmark(const char *file)
+{
+	using namespace std::chrono;
+
+	std::cerr << "stream buffer benchmark (1000 byte reads)\n";
+
+	buffer_pool pool;
+	auto run = [&](const char *name, auto &&open)
+	{
+		cfile f;
+		open(f);
+		char buf[1000];
+		std::size_t total = 0;
+		auto start = high_resolution_clock::now();
+		for (std::size_t n; (n = f.read(buf, 1, sizeof(buf))) != 0; ) total += n;
+		auto stop = high_resolution_clock::now();
+		const cfile::buffer_desc b = f.buffer_info();
+		std::cerr << name << duration_cast<microseconds>(stop - start).count() << " us (" << total << " bytes, " << (b.size >> 10) << " KiB buffer"
+			<< (b.owned ? ", owned" : "") << ")\n";
+	};
+
+	run("          default: ", [&](cfile &f) { f.open(file, "rb"); });
+	run("   set_buffer 64K: ", [&](cfile &f) { f.open(file, "rb"); f.set_buffer(64 << 10); });
+	run("    set_buffer 4M: ", [&](cfile &f) { f.open(file, "rb"); f.set_buffer(4 << 20); });
+	run(" set_buffer 4M/2M: ", [&](cfile &f) { f.open(file, "rb"); f.set_buffer(4 << 20, _IOFBF, 4096, true); });
+	run("          pool 1M: ", [&](cfile &f) { pool.open(f, file, "rb", 1 << 20); });
+	run("  pool 1M (again): ", [&](cfile &f) { pool.open(f, file, "rb", 1 << 20); });
+	std::cerr << "     (pool: " << pool.hits() << " hits, " << pool.misses() << " misses)\n";
+
+	std::cerr << '\n';
+}
+
+void adaptive_cfile_benchmark(const char *file, std::size_t vals)
+{
+	using namespace std::chrono;
+
+	std::cerr << "adaptive buffer benchmark\n";
+
+	static const char *const policies[] = { "initial", "small sequential", "large sequential", "random access" };
+	auto report = [](const adaptive_cfile &f)
+	{
+		const adaptive_cfile::stats &s = f.get_stats();
+		std::cerr << " (" << policies[(int)s.current] << ", " << (s.buffer_size >> 10) << " KiB buffer, " << s.resizes << " resizes)";
+	};
+
+	// small sequential writes
+	{
+		auto start = high_resolution_clock::now();
+		{
+			cfile f(file, "wb");
+			for (std::size_t i = 0; i < vals * 8; ++i) f.putc('0' + (int)(i % 10));
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << "     cfile putc: " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	}
+	{
+		auto start = high_resolution_clock::now();
+		{
+			adaptive_cfile f(file, "wb");
+			for (std::size_t i = 0; i < vals * 8; ++i) f.putc('0' + (int)(i % 10));
+			auto stop = high_resolution_clock::now();
+			std::cerr << "  adaptive putc: " << duration_cast<milliseconds>(stop - start).count() << " ms";
+			report(f);
+			std::cerr << '\n';
+		}
+	}
+
+	// random 16 byte reads - both must read the same bytes
+	std::vector<long> offsets(vals / 8);
+	{
+		std::mt19937 rng(0);
+		std::uniform_int_distribution<long> dist(0, (long)(vals * 8 - 16));
+		for (long &o : offsets) o = dist(rng);
+	}
+	{
+		cfile f(file, "rb");
+		char buf[16];
+		std::size_t sum = 0;
+		auto start = high_resolution_clock::now();
+		for (long o : offsets)
+		{
+			f.seek(o);
+			for (std::size_t i = 0, n = f.read(buf, 1, sizeof(buf)); i < n; ++i) sum += buf[i];
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << "   cfile random: " << duration_cast<milliseconds>(stop - start).count() << " ms (sum " << sum << ")\n";
+	}
+	{
+		adaptive_cfile f(file, "rb");
+		char buf[16];
+		std::size_t sum = 0;
+		auto start = high_resolution_clock::now();
+		for (long o : offsets)
+		{
+			f.seek(o);
+			for (std::size_t i = 0, n = f.read(buf, 1, sizeof(buf)); i < n; ++i) sum += buf[i];
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << "adaptive random: " << duration_cast<milliseconds>(stop - start).count() << " ms (sum " << sum << ")";
+		report(f);
+		std::cerr << '\n';
+	}
+
+	std::cerr << '\n';
+}
+
+void skip_benchmark(const char *file)
+{
+	using namespace std::chrono;
+
+	std::cerr << "skip benchmark\n";
+
+	auto run = [&](const char *name, auto &&work)
+	{
+		cfile f(file, "rb");
+		auto start = high_resolution_clock::now();
+		const std::size_t res = work(f);
+		auto stop = high_resolution_clock::now();
+		std::cerr << name << duration_cast<microseconds>(stop - start).count() << " us (" << res << ")\n";
+	};
+
+	// counting lines
+	run("        gets lines: ", [](cfile &f)
+	{
+		char line[256];
+		std::size_t n = 0;
+		while (f.gets(line)) ++n;
+		return n;
+	});
+	run("  skip_until lines: ", [](cfile &f)
+	{
+		std::size_t n = 0;
+		while (f.skip_until('\n') != EOF) ++n;
+		return n;
+	});
+
+	// reading 16 bytes out of every 4096
+	run("  read over 4080 B: ", [](cfile &f)
+	{
+		char buf[4080];
+		std::size_t sum = 0;
+		while (f.read(buf, 1, 16) == 16)
+		{
+			sum += (unsigned char)buf[0];
+			f.read(buf, 1, sizeof(buf));
+		}
+		return sum;
+	});
+	run("  skip over 4080 B: ", [](cfile &f)
+	{
+		char buf[16];
+		std::size_t sum = 0;
+		while (f.read(buf, 1, 16) == 16)
+		{
+			sum += (unsigned char)buf[0];
+			f.skip(4080);
+		}
+		return sum;
+	});
+
+	// a wide oriented stream can't have its byte buffer used - skip() has to seek instead
+	{
+		cfile f(file, "rb");
+		std::fwide(f, 1);
+		const std::size_t n = f.skip(10);
+		std::cerr << "       wide stream: skipped " << n << ", now at " << f.tell() << "\n";
+	}
+	// skipping (by seeking) past eof only counts the bytes that were there
+	{
+		cfile f(file, "rb");
+		f.seek(0, SEEK_END);
+		const long size = f.tell();
+		f.seek(size > 100 ? size - 100 : 0);
+		const long from = f.tell();
+		const std::size_t n = f.skip(1 << 20);
+		std::cerr << "     skip past eof: skipped " << n << " of " << (1 << 20) << " - "
+			<< (n == (std::size_t)(size - from) && f.tell() == size && f.getc() == EOF ? "ok" : "MISMATCH") << "\n";
+	}
+
+	std::cerr << '\n';
+}
+
+void peek_benchmark(const char *file, const char *check_file)
+{
+	using namespace std::chrono;
+
+	std::cerr << "peek benchmark (summing integers)\n";
+
+	auto run = [&](const char *name, auto &&parse)
+	{
+		cfile f(file, "rb");
+		auto start = high_resolution_clock::now();
+		const std::size_t sum = parse(f);
+		auto stop = high_resolution_clock::now();
+		std::cerr << name << duration_cast<microseconds>(stop - start).count() << " us (" << sum << ")\n";
+	};
+	auto digit = [](int ch) { return ch >= '0' && ch <= '9'; };
+
+	run("  getc + ungetc: ", [&](cfile &f)
+	{
+		std::size_t sum = 0;
+		for (int ch; (ch = f.getc()) != EOF; )
+		{
+			if (!digit(ch)) continue;
+			std::size_t v = ch - '0';
+			while (digit(ch = f.getc())) v = v * 10 + (ch - '0');
+			if (ch != EOF) f.ungetc(ch);
+			sum += v;
+		}
+		return sum;
+	});
+	run(" peek + consume: ", [&](cfile &f)
+	{
+		std::size_t sum = 0;
+		for (int ch; (ch = f.peek()) != EOF; )
+		{
+			if (!digit(ch))
+			{
+				f.consume(1);
+				continue;
+			}
+			std::size_t v = 0;
+			for (; digit(ch = f.peek()); f.consume(1)) v = v * 10 + (ch - '0');
+			sum += v;
+		}
+		return sum;
+	});
+	run("        peek(n): ", [&](cfile &f)
+	{
+		std::size_t sum = 0, v = 0;
+		for (cfile::input_span span; !(span = f.peek((std::size_t)-1)).empty(); f.consume(span.size()))
+		{
+			for (char ch : span)
+			{
+				if (digit(ch)) v = v * 10 + (ch - '0');
+				else
+				{
+					sum += v;
+					v = 0;
+				}
+			}
+		}
+		return sum + v;
+	});
+
+	// random mixes of every input operation against a reference, over many buffer sizes
+	std::mt19937 r{ 777 };
+	std::vector<char> data(200000);
+	for (char &ch : data) ch = r() % 8 == 0 ? '\n' : (char)('a' + r() % 26);
+	{
+		cfile f(check_file, "wb");
+		f.write(data.data(), 1, data.size());
+	}
+	const long size = (long)data.size();
+	std::size_t ops = 0, mismatches = 0;
+	for (int round = 0; round < 40; ++round)
+	{
+		cfile f(check_file, "rb");
+		if (round % 8 == 7) f.setvbuf(nullptr, _IONBF, 0);
+		else if (round % 8) f.set_buffer((std::size_t)1 << (round % 8 * 2 + 2));
+
+		long pos = 0;
+		bool can_unget = false;
+		auto at = [&](long p) { return p < size ? (int)(unsigned char)data[p] : EOF; };
+		for (int i = 0; i < 4000; ++i, ++ops)
+		{
+			bool ok = true, got = false;
+			const std::size_t left = pos < size ? (std::size_t)(size - pos) : 0; // a skip may have seeked past the end
+			switch (r() % 9)
+			{
+			case 0: { const int ch = f.getc(); ok = ch == at(pos); if (ch != EOF) { ++pos; got = true; } break; }
+			case 1: if (can_unget) { ok = f.ungetc(data[pos - 1]) == at(pos - 1); --pos; } break;
+			case 2: ok = f.peek() == at(pos); break;
+			case 3:
+			{
+				const cfile::input_span span = f.peek(1 + r() % 5000);
+				ok = span.empty() == (left == 0) && span.size() <= left && std::equal(span.begin(), span.end(), data.begin() + (long)(size - left));
+				const std::size_t n = span.empty() ? 0 : r() % (span.size() + 1);
+				f.consume(n);
+				pos += (long)n;
+				got = n > 0;
+				break;
+			}
+			case 4:
+			{
+				const std::size_t n = r() % 20000;
+				const std::size_t done = f.skip(n);
+				ok = done == n || done == left;
+				pos += (long)done;
+				break;
+			}
+			case 5:
+			{
+				const char delim = r() % 2 ? '\n' : (char)('a' + r() % 26);
+				const auto hit = std::find(data.end() - (long)left, data.end(), delim);
+				ok = f.skip_until(delim) == (hit != data.end() ? (unsigned char)delim : EOF);
+				pos = hit != data.end() ? (long)(hit - data.begin()) + 1 : std::max(pos, size);
+				break;
+			}
+			case 6:
+			{
+				char buf[3000];
+				const std::size_t n = r() % sizeof(buf);
+				const std::size_t done = f.read(buf, 1, n);
+				ok = done == std::min(n, left) && std::equal(buf, buf + done, data.end() - (long)left);
+				pos += (long)done;
+				got = done > 0;
+				break;
+			}
+			case 7: pos = (long)(r() % (std::size_t)size); f.clearerr(); ok = f.seek(pos) == 0; break;
+			default: ok = f.tell() == pos; break;
+			}
+			can_unget = got;
+			if (!ok) ++mismatches;
+		}
+	}
+	std::cerr << "  random input ops: " << ops << " ops, " << mismatches << " mismatches\n";
+
+	std::cerr << '\n';
+}
+
+void chunk_benchmark(const char *file)
+{
+	using namespace std::chrono;
+
+	std::cerr << "character counting benchmark (digits)\n";
+
+	auto run = [&](const char *name, auto &&count)
+	{
+		cfile f(file, "rb");
+		auto start = high_resolution_clock::now();
+		const std::size_t digits = count(f);
+		auto stop = high_resolution_clock::now();
+		std::cerr << name << duration_cast<milliseconds>(stop - start).count() << " ms (" << digits << ")\n";
+	};
+
+	run("       getc loop: ", [](cfile &f)
+	{
+		std::size_t n = 0;
+		for (int ch; (ch = f.getc()) != EOF; ) n += ch >= '0' && ch <= '9';
+		return n;
+	});
+	run("  for_each_chunk: ", [](cfile &f)
+	{
+		std::size_t n = 0;
+		f.for_each_chunk([&](cfile::input_span span) { for (char ch : span) n += ch >= '0' && ch <= '9'; });
+		return n;
+	});
+	run("        chunks(): ", [](cfile &f)
+	{
+		std::size_t n = 0;
+		for (cfile::input_span span : f.chunks()) for (char ch : span) n += ch >= '0' && ch <= '9';
+		return n;
+	});
+
+	std::cerr << '\n';
+}
+
+void csv_benchmark(const char *file, std::size_t rows)
+{
+	using namespace std::chrono;
+
+	std::cerr << "csv parsing benchmark\n";
+
+	{
+		cfile f(file, "wb");
+		for (std::size_t i = 0; i < rows; ++i) f.printf("%zu,item %zu,\"note %zu\",%f,%s\n", i, i % 1000, i * 7, i * 0.25, i % 3 ? "yes" : "no");
+	}
+
+	auto run = [&](const char *name, auto &&parse)
+	{
+		cfile f(file, "rb");
+		auto start = high_resolution_clock::now();
+		std::size_t fields = 0, bytes = 0;
+		parse(f, fields, bytes);
+		auto stop = high_resolution_clock::now();
+		const auto ms = duration_cast<milliseconds>(stop - start).count();
+		std::cerr << name << ms << " ms (" << fields << " fields, " << bytes << " field bytes)\n";
+	};
+
+	run("   fgets + strtok: ", [](cfile &f, std::size_t &fields, std::size_t &bytes)
+	{
+		char line[1024];
+		while (f.gets(line, sizeof(line)))
+		{
+			for (char *tok = std::strtok(line, ",\n"); tok; tok = std::strtok(nullptr, ",\n"))
+			{
+				++fields;
+				bytes += std::strlen(tok);
+			}
+		}
+	});
+	run("       csv_reader: ", [](cfile &f, std::size_t &fields, std::size_t &bytes)
+	{
+		csv_reader r(f);
+		while (r.next())
+		{
+			for (const csv_reader::field &field : r) bytes += field.size();
+			fields += r.size();
+		}
+	});
+
+	// writer -> reader round trip over the awkward cases: quoting, doubled quotes, embedded delimiters and line breaks,
+	// empty fields (including rows of a single empty field), long fields, \r\n line endings and rows that cross buffer refills
+	for (const char *eol : { "\n", "\r\n" })
+	{
+		const std::string pool[] = { "", "plain", "a,b", "say \"hi\"", "\"", "\"\"", "line1\nline2", "cr\r\nlf", "trailing\r", " spaced ",
+			std::string(5000, 'x') + "\"" + std::string(3000, ','), std::string(10000, 'y') };
+		std::mt19937 rng(42);
+		std::vector<std::vector<std::string>> expected(2000);
+		for (auto &row : expected)
+		{
+			row.resize(rng() % 4 == 0 ? 1 : 1 + rng() % 6);
+			for (auto &field : row) field = pool[rng() % (sizeof(pool) / sizeof(*pool))];
+		}
+		{
+			cfile f(file, "wb");
+			csv_writer w(f);
+			w.set_line_ending(eol);
+			for (const auto &row : expected)
+			{
+				for (const auto &field : row) w.field(field);
+				w.end_row();
+			}
+		}
+
+		cfile f(file, "rb");
+		csv_reader r(f);
+		std::size_t got = 0, bad = 0;
+		for (; r.next(); ++got)
+		{
+			if (got >= expected.size() || r.size() != expected[got].size()) { ++bad; continue; }
+			for (std::size_t i = 0; i < r.size(); ++i) bad += std::string(r[i].data(), r[i].size()) != expected[got][i];
+		}
+		std::cerr << (eol[0] == '\r' ? "  round trip crlf: " : "    round trip lf: ") << got << " rows, " << r.copied_rows() << " across refills - "
+			<< (got == expected.size() && bad == 0 ? "ok" : "MISMATCH") << '\n';
+	}
+
+	std::cerr << '\n';
+}
+
+void csv_write_benchmark(const char *file, std::size_t rows)
+{
+	using namespace std::chrono;
+
+	std::cerr << "csv writing benchmark\n";
+
+	const char *const names[] = { "alpha", "beta", "gamma, delta", "say \"hi\"" };
+
+	auto run = [&](const char *name, auto &&write)
+	{
+		double mb;
+		auto start = high_resolution_clock::now();
+		{
+			cfile f(file, "wb");
+			write(f);
+			mb = f.tell() / 1e6;
+		}
+		auto stop = high_resolution_clock::now();
+		const auto ms = duration_cast<milliseconds>(stop - start).count();
+		std::cerr << name << ms << " ms (" << (ms ? mb * 1000 / ms : 0) << " MB/s)\n";
+	};
+
+	run("     printf: ", [&](cfile &f)
+	{
+		for (std::size_t i = 0; i < rows; ++i) f.printf("%zu,%d,%s,%f\n", i, (int)(i % 1000) - 500, names[i & 1], i * 0.25);
+	});
+	run(" csv_writer: ", [&](cfile &f)
+	{
+		csv_writer w(f);
+		for (std::size_t i = 0; i < rows; ++i) w.row(i, (int)(i % 1000) - 500, names[i & 1], i * 0.25);
+	});
+	run("  (escaped): ", [&](cfile &f)
+	{
+		csv_writer w(f);
+		for (std::size_t i = 0; i < rows; ++i) w.row(i, (int)(i % 1000) - 500, names[2 + (i & 1)], i * 0.25);
+	});
+
+	// numbers must match printf() digit for digit - random values of every magnitude, precisions 0-9 and integer extremes
+	{
+		std::mt19937_64 rng(7);
+		std::string expected;
+		{
+			cfile f(file, "wb");
+			csv_writer w(f);
+			char buf[512];
+			for (std::size_t i = 0; i < 100000; ++i)
+			{
+				std::uint64_t bits = rng();
+				double v;
+				if (i % 2) v = (double)(std::int64_t)(bits >> (bits % 64)) / std::pow(10.0, (double)(rng() % 12)); // plain decimals
+				else std::memcpy(&v, &bits, sizeof(v));                                                           // any double
+				const int precision = (int)(rng() % 10);
+				w.set_precision(precision);
+				w.row(v);
+				std::snprintf(buf, sizeof(buf), "%.*f\n", precision, v);
+				expected += buf;
+			}
+			const long long ints[] = { 0, -1, 9, 10, 99, 100, -100, std::numeric_limits<long long>::max(), std::numeric_limits<long long>::min() };
+			for (long long v : ints)
+			{
+				w.row(v, (unsigned long long)v);
+				std::snprintf(buf, sizeof(buf), "%lld,%llu\n", v, (unsigned long long)v);
+				expected += buf;
+			}
+			for (std::size_t i = 0; i < 10000; ++i)
+			{
+				const std::int64_t v = (std::int64_t)rng() >> (rng() % 64);
+				w.row(v);
+				std::snprintf(buf, sizeof(buf), "%lld\n", (long long)v);
+				expected += buf;
+			}
+		}
+		cfile f(file, "rb");
+		std::string got(expected.size() + 1, '\0');
+		got.resize(f.read(&got[0], 1, got.size()));
+		std::cerr << "vs snprintf: " << (got == expected ? "ok" : "MISMATCH") << '\n';
+	}
+	// quoting and escaping, byte for byte
+	{
+		{
+			cfile f(file, "wb");
+			csv_writer w(f);
+			w.row("plain", "a,b", "say \"hi\"", "\"", "line\nbreak", "cr\rhere", "");
+			w.row("");
+			w.row(1, "", 2);
+		}
+		const char expected[] = "plain,\"a,b\",\"say \"\"hi\"\"\",\"\"\"\",\"line\nbreak\",\"cr\rhere\",\n\"\"\n1,,2\n";
+		cfile f(file, "rb");
+		char got[sizeof(expected) + 1] = {};
+		f.read(got, 1, sizeof(got) - 1);
+		std::cerr << "   escaping: " << (std::strcmp(got, expected) == 0 ? "ok" : "MISMATCH") << '\n';
+	}
+
+	std::cerr << '\n';
+}
+
+template<bool integral>
+void format_pipeline_benchmark(const char *file, std::size_t vals)
+{
+	using namespace std::chrono;
+
+	// the write_benchmark workload, with values derived from the record index so any thread can produce any record
+	typedef std::conditional_t<integral, unsigned, double> type;
+	auto value = [](std::uint64_t i) -> type
+	{
+		std::uint64_t z = (i + 1) * 0x9e3779b97f4a7c15ull;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z ^= z >> 31;
+		return integral ? (type)(z >> 33) : (type)((z >> 11) * (1.0 / 9007199254740992.0));
+	};
+	const char *const fmt = integral ? "%u\n" : "%f\n";
+
+	std::cerr << "format pipeline benchmark " << (integral ? "(integral)\n" : "(floating point)\n");
+
+	{
+		auto start = high_resolution_clock::now();
+		{
+			cfile f(file, "wb");
+			for (std::size_t i = 0; i < vals; ++i) f.printf(fmt, value(i));
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << "      cfile: " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	}
+
+	const std::size_t max_threads = std::max(std::thread::hardware_concurrency(), 4u);
+	for (std::size_t threads = 1; threads <= max_threads; threads *= 2)
+	{
+		format_pipeline::options o;
+		o.threads = threads;
+		format_pipeline p(o);
+
+		auto start = high_resolution_clock::now();
+		{
+			cfile f(file, "wb");
+			p.run(f, vals, [&](format_pipeline::buffer &b, std::uint64_t i) { b.printf(fmt, value(i)); });
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << std::setw(3) << threads << " threads: " << duration_cast<milliseconds>(stop - start).count() << " ms (" << p.get_stats().stalls << " stalls)\n";
+	}
+
+	std::cerr << '\n';
+}
+
+#ifdef __linux__
+void flush_scheduler_benchmark(const char *file, std::size_t bytes)
+{
+	using namespace std::chrono;
+
+	std::cerr << "flush scheduler benchmark (" << (bytes >> 20) << " MiB, 64 KiB writes)\n";
+
+	std::vector<char> block(64 << 10, 'x');
+	auto run = [&](const char *name, bool scheduled)
+	{
+		nanoseconds slowest{ 0 };
+		int r;
+		auto start = high_resolution_clock::now();
+		{
+			cfile f(file, "wb");
+			flush_scheduler s;
+			if (scheduled) s.add(f);
+			for (std::size_t done = 0; done < bytes; done += block.size())
+			{
+				auto t = high_resolution_clock::now();
+				f.write(block.data(), 1, block.size());
+				slowest = std::max<nanoseconds>(slowest, high_resolution_clock::now() - t);
+			}
+			if (scheduled) r = s.sync(f).get();
+			else
+			{
+				f.flush();
+				r = ::fdatasync(::fileno(f));
+			}
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << name << duration_cast<milliseconds>(stop - start).count() << " ms incl. sync (" << r << "), slowest write "
+			<< duration_cast<microseconds>(slowest).count() << " us\n";
+	};
+
+	run("   without scheduler: ", false);
+	run("      with scheduler: ", true);
+
+	// a pipe can't be synced - it is only flushed
+	int fds[2];
+	if (::pipe(fds) == 0)
+	{
+		cfile w(::fdopen(fds[1], "wb"));
+		flush_scheduler s;
+		w.puts("hello");
+		const int r = s.sync(w).get();
+		char buf[8];
+		const ssize_t n = ::read(fds[0], buf, sizeof(buf));
+		std::cerr << "           pipe sync: " << r << " (" << n << " bytes arrived)\n";
+		::close(fds[0]);
+	}
+
+	std::cerr << '\n';
+}
+
+void rotating_cfile_benchmark(const char *dir, std::size_t vals)
+{
+	using namespace std::chrono;
+
+	std::cerr << "rotating file benchmark (1 MiB segments)\n";
+
+	::mkdir(dir, 0755);
+	const std::string pattern = std::string(dir) + "/seg-%04llu.log";
+	for (unsigned long long i = 0; ; ++i) // segments left by an earlier run would be opened late (see rotating_cfile)
+	{
+		char path[256];
+		std::snprintf(path, sizeof(path), pattern.c_str(), i);
+		if (std::remove(path) != 0) break;
+	}
+	{
+		auto start = high_resolution_clock::now();
+		{
+			cfile f((std::string(dir) + "/plain.log").c_str(), "wb");
+			for (std::size_t i = 0; i < vals; ++i) f.printf("%zu %f\n", i, i * 0.5);
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << "         cfile: " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	}
+	{
+		rotating_cfile::options o;
+		o.max_size = 1 << 20;
+		std::size_t segments = 0;
+		o.on_rotated = [&](const std::string&) { ++segments; }; // on the worker - read after it has stopped
+		auto start = high_resolution_clock::now();
+		{
+			rotating_cfile f(pattern.c_str(), o);
+			for (std::size_t i = 0; i < vals; ++i) f.printf("%zu %f\n", i, i * 0.5);
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << "rotating_cfile: " << duration_cast<milliseconds>(stop - start).count() << " ms (" << segments << " segments)\n";
+	}
+
+	// segment 2's directory doesn't exist - rotating to it has to fail without losing writes, and after the retries
+	// the writer moves on to segment 3
+	const std::string base = std::string(dir) + "/sub";
+	::mkdir(base.c_str(), 0755);
+	::mkdir((base + "/0").c_str(), 0755);
+	::mkdir((base + "/1").c_str(), 0755);
+	::rmdir((base + "/2").c_str());
+	::mkdir((base + "/3").c_str(), 0755);
+	{
+		rotating_cfile::options o;
+		o.max_size = 10;
+		rotating_cfile f((base + "/%llu/seg.log").c_str(), o);
+		std::size_t written = 0;
+		for (int i = 0; i < 7; ++i) written += f.write("0123456789", 1, 10);
+		std::cerr << "  failed rotation: " << written << " of 70 bytes written, " << f.failed_rotations() << " failed rotations, now in "
+			<< f.path().substr(base.size()) << '\n';
+	}
+
+	// the next segment's file already exists - shutting down before reaching it must leave it alone
+	{
+		const std::string kept = std::string(dir) + "/kept-1.log";
+		{
+			cfile f(kept.c_str(), "wb");
+			f.puts("keep");
+		}
+		{
+			rotating_cfile f((std::string(dir) + "/kept-%llu.log").c_str());
+			f.puts("segment 0");
+		}
+		cfile f(kept.c_str(), "rb");
+		char text[8] = {};
+		f.read(text, 1, sizeof(text) - 1);
+		std::cerr << "    unused segment: " << (std::strcmp(text, "keep") == 0 ? "ok" : "MISMATCH") << '\n';
+	}
+
+	std::cerr << '\n';
+}
+
+void partitioned_writer_benchmark(const char *dir, std::size_t vals)
+{
+	using namespace std::chrono;
+
+	const std::size_t partitions = 256;
+	std::cerr << "partitioned writer benchmark (" << partitions << " partitions)\n";
+
+	::mkdir(dir, 0755);
+	const std::string pattern = std::string(dir) + "/part-%03llu";
+	auto record = [](std::size_t i, char *buf) { return std::snprintf(buf, 64, "%zu,%f\n", i, i * 0.5); };
+
+	{
+		auto start = high_resolution_clock::now();
+		{
+			std::vector<cfile> files(partitions);
+			char path[256], buf[64];
+			for (std::size_t i = 0; i < partitions; ++i)
+			{
+				std::snprintf(path, sizeof(path), pattern.c_str(), (unsigned long long)i);
+				files[i].open(path, "wb");
+			}
+			for (std::size_t i = 0; i < vals; ++i) files[(i * 2654435761u) % partitions].write(buf, 1, record(i, buf));
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << "   cfile per partition: " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	}
+	{
+		partitioned_writer::options o;
+		o.budget = 16 << 20;
+		o.slab_size = 16 << 10;
+		o.max_open = 32;
+		auto start = high_resolution_clock::now();
+		{
+			partitioned_writer w(pattern.c_str(), partitions, o);
+			char buf[64];
+			for (std::size_t i = 0; i < vals; ++i) w.write((i * 2654435761u) % partitions, buf, 1, record(i, buf));
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << "    partitioned_writer: " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	}
+
+	// partition files that can't be created - the data is dropped and reported, nothing is written through a null FILE*
+	{
+		partitioned_writer::options o;
+		o.slab_size = 64; // so the 100 byte writes take the direct path and the 1 byte ones are buffered
+		partitioned_writer w((std::string(dir) + "/missing/part-%llu").c_str(), 4, o);
+		char buf[100] = {};
+		for (std::size_t i = 0; i < 1000; ++i) w.write(i % 4, buf, 1, i % 2 ? 100 : 1);
+		w.flush();
+		std::cerr << "  missing directory: error() = " << w.error() << ", " << w.open_count() << " files open\n";
+	}
+
+	std::cerr << '\n';
+}
+
+void splice_benchmark(const char *file, std::size_t bytes)
+{
+	using namespace std::chrono;
+
+	std::cerr << "splice benchmark (pipe -> file)\n";
+
+	// runs a producer thread pushing bytes into a fresh pipe and times consume(pipe, file)
+	auto run = [&](const char *name, auto &&consume)
+	{
+		int p[2];
+		if (pipe(p) != 0) return;
+		std::thread producer([&]
+		{
+			std::vector<char> chunk(64 * 1024, 'x');
+			for (std::size_t left = bytes; left > 0; )
+			{
+				ssize_t n = write(p[1], chunk.data(), std::min(left, chunk.size()));
+				if (n <= 0) break;
+				left -= n;
+			}
+			close(p[1]);
+		});
+
+		std::size_t moved;
+		auto start = high_resolution_clock::now();
+		{
+			cfile src(fdopen(p[0], "rb")), dst(file, "wb");
+			moved = consume(src, dst);
+		}
+		auto stop = high_resolution_clock::now();
+		producer.join();
+		std::cerr << name << moved << " - " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	};
+
+	run("   copy loop: ", [](cfile &src, cfile &dst)
+	{
+		std::size_t total = 0;
+		std::vector<char> buf(64 * 1024);
+		for (std::size_t n; (n = src.read(buf.data(), 1, buf.size())) > 0; ) total += dst.write(buf.data(), 1, n);
+		return total;
+	});
+	run("   splice_to: ", [](cfile &src, cfile &dst) { return src.splice_to(dst); });
+
+	std::cerr << '\n';
+}
+
+void shm_channel_benchmark(std::size_t bytes)
+{
+	using namespace std::chrono;
+
+	std::cerr << "shm channel benchmark\n";
+
+	const std::size_t chunk = 64 * 1024;
+	auto gbps = [](std::size_t n, nanoseconds t) { return (double)n / (double)t.count(); };
+
+	{
+		int p[2];
+		if (pipe(p) != 0) return;
+		cfile out(fdopen(p[1], "wb")), in(fdopen(p[0], "rb"));
+		std::size_t got = 0;
+		auto start = high_resolution_clock::now();
+		std::thread consumer([&]
+		{
+			std::vector<char> buf(chunk);
+			for (std::size_t n; (n = in.read(buf.data(), 1, buf.size())) > 0; got += n);
+		});
+		{
+			std::vector<char> buf(chunk, 'x');
+			for (std::size_t left = bytes; left > 0; left -= std::min(left, chunk)) out.write(buf.data(), 1, std::min(left, chunk));
+			out.close();
+		}
+		consumer.join();
+		auto stop = high_resolution_clock::now();
+		std::cerr << "   pipe cfile: " << got << " - " << std::setprecision(3) << gbps(got, stop - start) << " GB/s\n";
+	}
+	{
+		shm_channel ch(256 * 1024);
+		std::size_t got = 0;
+		auto start = high_resolution_clock::now();
+		std::thread consumer([&]
+		{
+			std::vector<char> buf(chunk);
+			for (std::size_t n; (n = ch.read(buf.data(), 1, buf.size())) > 0; got += n);
+		});
+		{
+			std::vector<char> buf(chunk, 'x');
+			for (std::size_t left = bytes; left > 0; left -= std::min(left, chunk)) ch.write(buf.data(), 1, std::min(left, chunk));
+			ch.close_write();
+		}
+		consumer.join();
+		auto stop = high_resolution_clock::now();
+		std::cerr << "  shm_channel: " << got << " - " << std::setprecision(3) << gbps(got, stop - start) << " GB/s\n";
+	}
+	{
+		// ping-pong a small message to measure handoff latency
+		const int rounds = 10000;
+		shm_channel ping(4096), pong(4096);
+		std::thread echo([&]
+		{
+			for (std::uint64_t v; ping.read(&v, 1) == 1; pong.write(&v, 1));
+		});
+		auto start = high_resolution_clock::now();
+		for (std::uint64_t i = 0, v; i < (std::uint64_t)rounds; ++i)
+		{
+			ping.write(&i, 1);
+			pong.read(&v, 1);
+		}
+		auto stop = high_resolution_clock::now();
+		ping.close_write();
+		echo.join();
+		std::cerr << "  shm_channel: " << duration_cast<nanoseconds>(stop - start).count() / (2 * rounds) << " ns one-way latency\n";
+	}
+	{
+		// another process attaches to the channel by its memfd and sends back a checksum of what it read
+		shm_channel ch(64 * 1024), back(4096);
+		const pid_t child = ::fork();
+		if (child == 0)
+		{
+			shm_channel in, out;
+			if (!in.attach(::dup(ch.fd())) || !out.attach(::dup(back.fd()))) ::_exit(1);
+			std::uint64_t sum = 0;
+			unsigned char buf[4096];
+			for (std::size_t n; (n = in.read(buf, 1, sizeof(buf))) > 0; ) for (std::size_t i = 0; i < n; ++i) sum += buf[i];
+			out.write(&sum, 1);
+			out.close_write();
+			::_exit(0);
+		}
+		std::uint64_t expected = 0, got = ~(std::uint64_t)0;
+		std::vector<unsigned char> buf(chunk);
+		for (std::size_t i = 0; i < buf.size(); ++i) buf[i] = (unsigned char)(i * 7);
+		const std::size_t rounds = std::max<std::size_t>(bytes / chunk / 4, 1);
+		for (std::size_t r = 0; r < rounds; ++r)
+		{
+			ch.write(buf.data(), 1, buf.size());
+			for (unsigned char c : buf) expected += c;
+		}
+		ch.close_write();
+		back.read(&got, 1);
+		int status = 0;
+		::waitpid(child, &status, 0);
+		std::cerr << "   attach (fork): " << rounds * chunk << " bytes, checksum " << (got == expected ? "ok" : "MISMATCH") << '\n';
+	}
+	{
+		// a reader process that dies without draining the channel - the writer has to give up rather than block forever
+		shm_channel ch(4096);
+		const pid_t child = ::fork();
+		if (child == 0)
+		{
+			char c;
+			ch.read(&c, 1, 1);
+			::_exit(0);
+		}
+		ch.putc('x');
+		int status = 0;
+		::waitpid(child, &status, 0);
+
+		std::vector<char> buf(1 << 20, 'x');
+		auto start = high_resolution_clock::now();
+		const std::size_t n = ch.write(buf.data(), 1, buf.size());
+		auto stop = high_resolution_clock::now();
+		std::cerr << "     dead reader: " << n << " of " << buf.size() << " bytes written, error() = " << ch.error()
+			<< " after " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	}
+	{
+		// a reader that is alive but never reads - the timeout bounds the wait
+		shm_channel ch(4096);
+		ch.set_timeout(50);
+		std::vector<char> buf(1 << 20, 'x');
+		auto start = high_resolution_clock::now();
+		const std::size_t n = ch.write(buf.data(), 1, buf.size());
+		auto stop = high_resolution_clock::now();
+		std::cerr << "         timeout: " << n << " of " << buf.size() << " bytes written, error() = " << ch.error()
+			<< " after " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	}
+
+	std::cerr << '\n';
+}
+
+void append_log_benchmark(const char *file, std::size_t records)
+{
+	using namespace std::chrono;
+
+	std::cerr << "append log benchmark (" << records << " 100-byte records)\n";
+
+	// splits records across threads and times each thread running append(buf) for its share
+	auto run = [&](const char *name, std::size_t threads, auto &&append)
+	{
+		auto start = high_resolution_clock::now();
+		{
+			std::vector<std::thread> workers;
+			for (std::size_t t = 0; t < threads; ++t) workers.emplace_back([&, t]
+			{
+				char buf[100];
+				std::fill(std::begin(buf), std::end(buf), (char)('a' + t % 26));
+				for (std::size_t i = t; i < records; i += threads) append(buf);
+			});
+			for (auto &w : workers) w.join();
+		}
+		auto stop = high_resolution_clock::now();
+		std::cerr << name << std::setw(2) << threads << " threads: " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+	};
+
+	for (std::size_t threads = 1; threads <= 64; threads *= 2)
+	{
+		cfile f(file, "wb");
+		run("       cfile ", threads, [&](char (&buf)[100]) { f.write(buf); });
+	}
+	for (std::size_t threads = 1; threads <= 64; threads *= 2)
+	{
+		std::remove(file);
+		append_log log(file, 0);
+		run(" unbatched   ", threads, [&](char (&buf)[100]) { log.append(buf, sizeof(buf)); });
+	}
+	for (std::size_t threads = 1; threads <= 64; threads *= 2)
+	{
+		std::remove(file);
+		{
+			append_log log(file);
+			run("  append_log ", threads, [&](char (&buf)[100]) { log.append(buf, sizeof(buf)); });
+		}
+
+		// every record must read back intact - the pad records closing each block aren't counted as skipped
+		cfile f(file, "rb");
+		append_log::reader r(f);
+		std::size_t n = 0, bad = 0;
+		for (std::vector<char> payload; r.next(payload); ++n)
+		{
+			if (payload.size() != 100 || std::count(payload.begin(), payload.end(), payload[0]) != 100) ++bad;
+		}
+		if (n != records || bad != 0 || r.skipped_bytes() != 0)
+			std::cerr << "      reader: " << n << " records, " << bad << " bad, " << r.skipped_bytes() << " bytes skipped - MISMATCH\n";
+	}
+	{
+		// damage a log - a corrupted payload, a hole and a torn tail - and read back what survives
+		std::remove(file);
+		std::int64_t offs[4];
+		{
+			append_log log(file, 0);
+			for (int i = 0; i < 4; ++i) offs[i] = log.append(&i, sizeof(i));
+		}
+		{
+			cfile f(file, "r+b");
+			f.seek((long)offs[1] + (long)sizeof(append_log::record_header));
+			f.putc(0x55);                                                     // record 1: bad payload crc
+			const char zeros[8] = {};
+			f.seek((long)offs[2]);
+			f.write(zeros);                                                   // record 2: header wiped (a hole)
+		}
+		::truncate(file, (off_t)offs[3] + (off_t)sizeof(append_log::record_header) + 2); // record 3: torn
+
+		cfile f(file, "rb");
+		append_log::reader r(f);
+		std::vector<char> payload;
+		int v = -1;
+		if (r.next(payload) && payload.size() == sizeof(v)) std::memcpy(&v, payload.data(), sizeof(v));
+		const bool rest = !r.next(payload);
+		std::cerr << "     damaged: record 0 " << (v == 0 ? "ok" : "MISMATCH") << ", records 1-3 " << (rest ? "skipped" : "MISMATCH")
+			<< ", " << r.skipped_bytes() << " bytes skipped\n";
+	}
+
+	std::cerr << '\n';
+}
+
+void wal_benchmark(const char *file, std::size_t commits)
+{
+	using namespace std::chrono;
+
+	std::cerr << "wal benchmark (" << commits << " 64-byte commits)\n";
+
+	// splits commits across threads, each timing its own commit(buf) calls
+	auto run = [&](const char *name, std::size_t threads, auto &&commit)
+	{
+		std::atomic<long long> latency{ 0 };
+		auto start = high_resolution_clock::now();
+		{
+			std::vector<std::thread> workers;
+			for (std::size_t t = 0; t < threads; ++t) workers.emplace_back([&, t]
+			{
+				char buf[64] = {};
+				for (std::size_t i = t; i < commits; i += threads)
+				{
+					auto s = high_resolution_clock::now();
+					commit(buf);
+					latency += duration_cast<microseconds>(high_resolution_clock::now() - s).count();
+				}
+			});
+			for (auto &w : workers) w.join();
+		}
+		auto stop = high_resolution_clock::now();
+		const double secs = duration_cast<microseconds>(stop - start).count() / 1e6;
+		std::cerr << name << std::setw(2) << threads << " threads: " << std::setw(8) << (long long)(commits / secs) << " commits/s - "
+			<< latency / (long long)commits << " us avg latency\n";
+	};
+
+	for (std::size_t threads : { 1, 8, 32 })
+	{
+		std::remove(file);
+		cfile f(file, "wb");
+		std::mutex m;
+		run("  flush+fsync ", threads, [&](char (&buf)[64])
+		{
+			std::lock_guard<std::mutex> lock(m);
+			f.write(buf);
+			f.flush();
+			fdatasync(fileno(f));
+		});
+	}
+	for (std::size_t threads : { 1, 8, 32 })
+	{
+		std::remove(file);
+		wal log(file);
+		run("          wal ", threads, [&](char (&buf)[64]) { log.commit(buf); });
+	}
+	{
+		// recovery - a torn tail is cut off on open(), while damage before the last record makes open() fail
+		const std::uint64_t rec = append_log::record_size(sizeof(int));
+		auto fill = [&]
+		{
+			std::remove(file);
+			wal log(file);
+			for (int i = 0; i < 5; ++i) log.commit(i);
+		};
+		auto replay = [&]
+		{
+			std::vector<int> vals;
+			wal::recover(file, [&](const char *p, std::size_t n)
+			{
+				int v = -1;
+				if (n == sizeof(v)) std::memcpy(&v, p, n);
+				vals.push_back(v);
+			});
+			return vals;
+		};
+
+		fill();
+		::truncate(file, (off_t)(5 * rec - 3));
+		bool torn_ok;
+		{
+			wal log(file);
+			torn_ok = (bool)log && log.commit(5);
+		}
+		torn_ok = torn_ok && replay() == std::vector<int>{ 0, 1, 2, 3, 5 };
+
+		fill();
+		{
+			cfile f(file, "r+b");
+			f.seek((long)(2 * rec + sizeof(append_log::record_header)));
+			f.putc(0x55);
+		}
+		wal log;
+		const bool damaged_ok = !log.open(file) && log.damage_offset() == (std::int64_t)(2 * rec) && replay() == std::vector<int>{ 0, 1 };
+		struct stat st;
+		const bool kept = ::stat(file, &st) == 0 && (std::uint64_t)st.st_size == 5 * rec;
+		std::cerr << "     recovery: torn tail " << (torn_ok ? "ok" : "MISMATCH") << ", damaged record "
+			<< (damaged_ok && kept ? "ok" : "MISMATCH") << '\n';
+	}
+
+	std::cerr << '\n';
+}
+
+void deferred_close_benchmark(const char *dir, std::size_t files)
+{
+	using namespace std::chrono;
+
+	std::cerr << "deferred close benchmark (" << files << " files, 256K each)\n";
+
+	::mkdir(dir, 0755);
+	std::vector<char> block(256 << 10, 'x');
+	for (int deferred = 0; deferred < 2; ++deferred)
+	{
+		auto start = high_resolution_clock::now();
+		for (std::size_t i = 0; i < files; ++i)
+		{
+			cfile f((std::string(dir) + "/" + std::to_string(i)).c_str(), "wb");
+			if (deferred) deferred_close::enable(f);
+			f.write(block.data(), 1, block.size());
+		} // the close (and so the final write) happens here - or on the background thread
+		auto mid = high_resolution_clock::now();
+		const std::size_t failed = deferred_close::wait();
+		auto stop = high_resolution_clock::now();
+
+		std::cerr << (deferred ? "  deferred" : "    fclose") << ": " << duration_cast<milliseconds>(mid - start).count() << " ms in the caller, "
+			<< duration_cast<milliseconds>(stop - start).count() << " ms until closed (" << failed << " failed)\n";
+	}
+
+	std::cerr << '\n';
+}
+
+void cfile_cache_benchmark(const char *dir, std::size_t files, std::size_t accesses)
+{
+	using namespace std::chrono;
+
+	std::cerr << "cfile cache benchmark (" << files << " files, " << accesses << " random reads)\n";
+
+	::mkdir(dir, 0755);
+	std::vector<std::string> paths(files);
+	for (std::size_t i = 0; i < files; ++i)
+	{
+		paths[i] = std::string(dir) + "/" + std::to_string(i);
+		cfile f(paths[i].c_str(), "wb");
+		f.write(&i, 1);
+	}
+
+	// uniform picks any file, skewed sends 90% of the reads to 1% of the files
+	std::mt19937 r{ 12345 };
+	std::vector<std::size_t> uniform(accesses), skewed(accesses);
+	for (std::size_t i = 0; i < accesses; ++i)
+	{
+		uniform[i] = r() % files;
+		skewed[i] = r() % 10 != 0 ? r() % std::max<std::size_t>(files / 100, 1) : r() % files;
+	}
+
+	auto run = [&](const char *name, const std::vector<std::size_t> &order, auto &&read)
+	{
+		std::size_t sum = 0;
+		auto start = high_resolution_clock::now();
+		for (std::size_t i : order) sum += read(i);
+		auto stop = high_resolution_clock::now();
+		std::cerr << name << duration_cast<milliseconds>(stop - start).count() << " ms" << (sum == 0 ? " " : "") << '\n';
+	};
+	auto direct = [&](std::size_t i)
+	{
+		std::size_t v = 0;
+		cfile f(paths[i].c_str(), "rb");
+		f.read(&v, 1);
+		return v;
+	};
+
+	run("      uniform (fopen): ", uniform, direct);
+	{
+		cfile_cache cache;
+		run("      uniform (cache): ", uniform, [&](std::size_t i)
+		{
+			std::size_t v = 0;
+			auto f = cache.acquire(paths[i].c_str(), "rb");
+			f->seek(0);
+			f->read(&v, 1);
+			return v;
+		});
+	}
+	run("       skewed (fopen): ", skewed, direct);
+	{
+		cfile_cache cache;
+		run("       skewed (cache): ", skewed, [&](std::size_t i)
+		{
+			std::size_t v = 0;
+			auto f = cache.acquire(paths[i].c_str(), "rb");
+			f->seek(0);
+			f->read(&v, 1);
+			return v;
+		});
+	}
+
+	for (const auto &p : paths) std::remove(p.c_str());
+	::rmdir(dir);
+
+	std::cerr << '\n';
+}
+
+void direct_file_benchmark(const char *file, std::size_t bytes)
+{
+	using namespace std::chrono;
+
+	std::vector<char> block(1 << 20, 'x');
+	bytes = std::max<std::size_t>(bytes / block.size(), 1) * block.size();
+
+	std::cerr << "direct io benchmark (" << (bytes >> 20) << " MiB sequential)\n";
+
+	auto run = [&](const char *name, auto &&work)
+	{
+		auto start = high_resolution_clock::now();
+		work();
+		auto stop = high_resolution_clock::now();
+		const auto ms = duration_cast<milliseconds>(stop - start).count();
+		std::cerr << name << ms << " ms (" << (ms > 0 ? (long long)(bytes >> 20) * 1000 / ms : 0) << " MiB/s)\n";
+	};
+
+	run("     cfile write: ", [&]
+	{
+		cfile f(file, "wb");
+		for (std::size_t i = 0; i < bytes; i += block.size()) f.write(block.data(), 1, block.size());
+	});
+	run("      cfile read: ", [&]
+	{
+		cfile f(file, "rb");
+		while (f.read(block.data(), 1, block.size()) == block.size()) {}
+	});
+
+	bool direct = false;
+	run("    direct write: ", [&]
+	{
+		direct_file f(file, "wb");
+		direct = f.direct();
+		for (std::size_t i = 0; i < bytes; i += block.size()) f.write(block.data(), 1, block.size());
+	});
+	run("     direct read: ", [&]
+	{
+		direct_file f(file, "rb");
+		while (f.read(block.data(), 1, block.size()) == block.size()) {}
+	});
+	if (!direct) std::cerr << "    (filesystem rejected O_DIRECT - direct_file used cached io)\n";
+	{
+		// append mode writes at the end whatever the position says
+		{
+			direct_file f(file, "wb");
+			f.puts("hello");
+		}
+		std::size_t block_size;
+		{
+			direct_file f(file, "ab");
+			block_size = f.block_size();
+			f.puts("12");
+			f.seek(0);
+			f.puts("34");
+		}
+		cfile f(file, "rb");
+		char text[16] = {};
+		f.read(text, 1, sizeof(text) - 1);
+		std::cerr << "     append mode: " << (std::strcmp(text, "hello1234") == 0 ? "ok" : "MISMATCH") << " (block size " << block_size << ")\n";
+	}
+
+	std::cerr << '\n';
+}
+
+void preallocate_benchmark(const char *file, std::size_t bytes)
+{
+	using namespace std::chrono;
+
+	std::vector<char> block(64 << 10, 'x');
+	bytes = std::max<std::size_t>(bytes / block.size(), 1) * block.size();
+
+	std::cerr << "preallocation benchmark (" << (bytes >> 20) << " MiB, synced)\n";
+
+	auto run = [&](const char *name, bool prealloc)
+	{
+		std::remove(file);
+		auto start = high_resolution_clock::now();
+		{
+			cfile f(file, "wb");
+			if (prealloc) f.preallocate((long long)bytes);
+			for (std::size_t i = 0; i < bytes; i += block.size()) f.write(block.data(), 1, block.size());
+			f.flush();
+			::fdatasync(::fileno(f));
+		}
+		auto stop = high_resolution_clock::now();
+		const auto ms = duration_cast<milliseconds>(stop - start).count();
+		std::cerr << name << ms << " ms (" << (ms > 0 ? (long long)(bytes >> 20) * 1000 / ms : 0) << " MiB/s)\n";
+	};
+
+	run("       no preallocation: ", false);
+	run("     with preallocation: ", true);
+
+	std::cerr << '\n';
+}
+
+template<bool integral>
+void parallel_parse_benchmark(const char *file)
+{
+	using namespace std::chrono;
+
+	typedef std::conditional_t<integral, std::size_t, double> type;
+	const char *fmt = integral ? "%zu\n" : "%lf\n";
+
+	std::cerr << "parallel parse benchmark " << (integral ? "(integral)\n" : "(floating point)\n");
+
+	const std::size_t max_threads = std::max(std::thread::hardware_concurrency(), 4u);
+	for (std::size_t threads = 1; threads <= max_threads; threads *= 2)
+	{
+		parallel_parser p(file, threads);
+		{
+			// the same scanf() reader as read_benchmark, over each range
+			auto start = high_resolution_clock::now();
+			const std::vector<type> sums = p.run<type>([fmt](cfile &f, type &sum)
+			{
+				for (type temp; f.scanf(fmt, &temp) == 1; sum += temp);
+			});
+			auto stop = high_resolution_clock::now();
+			type sum = 0;
+			for (type s : sums) sum += s;
+			std::cerr << std::setw(3) << threads << " threads   scanf: " << sum << " - " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+		}
+		if (integral)
+		{
+			// hand written, straight from the mapped file
+			auto start = high_resolution_clock::now();
+			const std::vector<std::size_t> sums = p.run<std::size_t>([](cfile::input_span span, std::size_t &sum)
+			{
+				std::size_t v = 0;
+				for (char ch : span)
+				{
+					if (ch >= '0' && ch <= '9') v = v * 10 + (ch - '0');
+					else { sum += v; v = 0; }
+				}
+				sum += v;
+			});
+			auto stop = high_resolution_clock::now();
+			std::size_t sum = 0;
+			for (std::size_t s : sums) sum += s;
+			std::cerr << std::setw(3) << threads << " threads    span: " << sum << " - " << duration_cast<milliseconds>(stop - start).count() << " ms\n";
+		}
+	}
+
+	std::cerr << '\n';
+}
+
+#endif
+
+int main(int argc, const char *argv[])
+{
+	if (argc != 2)
+	{
+		std::cerr << "usage: " << argv[0] << " [test size]\n";
+		return 1;
+	}
+	
+	auto count = atoll(argv[1]);
+
+	write_benchmark<true>("data.dat", count);
+	read_benchmark<true>("data.dat");
+
+	write_benchmark<false>("data-f.dat", count);
+	read_benchmark<false>("data-f.dat");
+
+	sharded_writer_benchmark("data-w.dat", count);
+	log_sink_benchmark("data-log.dat", count);
+	tee_cfile_benchmark("data-t1.dat", "data-t2.dat", count);
+	stream_buffer_benchmark("data.dat");
+	adaptive_cfile_benchmark("data-a.dat", count);
+	skip_benchmark("data.dat");
+	peek_benchmark("data.dat", "data-pk.dat");
+	chunk_benchmark("data.dat");
+	csv_benchmark("data-csv.dat", count);
+	csv_write_benchmark("data-csv.dat", count);
+	format_pipeline_benchmark<true>("data-fp.dat", count);
+	format_pipeline_benchmark<false>("data-fp.dat", count);
+
+#ifdef __linux__
+	flush_scheduler_benchmark("data-fs.dat", count * 256);
+	rotating_cfile_benchmark("data-rot", count);
+	partitioned_writer_benchmark("data-part", count);
+	splice_benchmark("data-s.dat", count * 64);
+	shm_channel_benchmark(count * 64);
+	append_log_benchmark("data-l.dat", count);
+	wal_benchmark("data-wal.dat", count / 100);
+	deferred_close_benchmark("data-dc", 1000);
+	cfile_cache_benchmark("data-cache", std::min<std::size_t>(count, 100000), count);
+	direct_file_benchmark("data-d.dat", count * 256);
+	preallocate_benchmark("data-p.dat", count * 256);
+	parallel_parse_benchmark<true>("data.dat");
+	parallel_parse_benchmark<false>("data-f.dat");
+#endif
 
 	return 0;
 }
\ No newline at end of file
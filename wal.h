@@ -0,0 +1,244 @@
+#ifndef DRAGAZO_WAL_H
+#define DRAGAZO_WAL_H
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cfile.h"
+#include "append_log.h"
+
+// represents a write-ahead log with group commit.
+// committers append their record to the currently open batch and then wait until it is durable.
+// the first committer to find no flush in progress becomes the leader: it optionally lingers (up to max_delay, or until the
+// batch reaches max_batch bytes) to let more records join, then writes the whole batch with one write() and one fdatasync()
+// and wakes everyone in it. one of the committers that queued up meanwhile then leads the next batch.
+// records use the append_log framing (magic, length, crc32c of payload and header), so a torn tail is detected on recovery.
+class wal
+{
+public: // -- types -- //
+
+	struct options
+	{
+		std::size_t max_batch = 1 << 20;                   // a lingering leader stops waiting once the batch reaches this many bytes
+		std::chrono::microseconds max_delay{ 0 };          // how long a leader lingers for more records (0 = flush immediately)
+	};
+
+private: // -- data -- //
+
+	cfile file;
+	options opt;
+
+	std::mutex mtx;
+	std::condition_variable done;  // signalled when a batch becomes durable (or fails)
+	std::condition_variable grown; // signalled when the open batch reaches max_batch
+
+	std::vector<char> batch;       // framed records of the open batch
+	std::uint64_t open_seq = 1;    // sequence number of the open batch
+	std::uint64_t durable_seq = 0; // every batch up to and including this one is on disk
+	bool leading = false;          // a leader is currently collecting or flushing a batch
+	bool failed = false;           // a write or sync failed - the log refuses further commits
+	std::int64_t damage = -1;      // offset of the damaged record that made open() fail
+
+	// writes and syncs the open batch as the leader (mtx must be held by lock, and is released during the io).
+	void lead(std::unique_lock<std::mutex> &lock)
+	{
+		leading = true;
+		if (opt.max_delay.count() > 0 && batch.size() < opt.max_batch)
+		{
+			grown.wait_for(lock, opt.max_delay, [&] { return batch.size() >= opt.max_batch; });
+		}
+
+		std::vector<char> data;
+		data.swap(batch);
+		const std::uint64_t seq = open_seq++;
+		lock.unlock();
+
+		bool ok = file.write(data.data(), 1, data.size()) == data.size() && std::fflush(file) == 0 && sync_fd(::fileno(file)) == 0;
+
+		lock.lock();
+		if (ok) durable_seq = seq;
+		else failed = true;
+		leading = false;
+		done.notify_all();
+
+		// hand the buffer back so steady state does not allocate
+		if (batch.empty() && data.capacity() > batch.capacity())
+		{
+			data.clear();
+			batch.swap(data);
+		}
+	}
+
+	// returns true if the bytes of a log file from end on are a single torn record - one whose header runs past eof, one
+	// that ends at eof, or nothing but zeros (space the file system allocated before the data landed).
+	static bool torn_tail(const char *path, std::int64_t end)
+	{
+		cfile f(path, "rb");
+		struct stat st;
+		if (!f || ::fstat(::fileno(f), &st) != 0) return false;
+		if ((std::int64_t)st.st_size - end < (std::int64_t)sizeof(append_log::record_header)) return true;
+		if (::fseeko(f, (off_t)end, SEEK_SET) != 0) return false;
+
+		append_log::record_header h;
+		if (f.read(&h, 1) != 1) return false;
+		if (append_log::check_header(h)) return end + (std::int64_t)append_log::record_size(h.length) >= (std::int64_t)st.st_size;
+
+		const char *const raw = reinterpret_cast<const char*>(&h);
+		if (std::any_of(raw, raw + sizeof(h), [](char c) { return c != 0; })) return false;
+		for (int c; (c = f.getc()) != EOF; ) if (c != 0) return false;
+		return !f.error();
+	}
+
+	static int sync_fd(int fd)
+	{
+#if defined(__APPLE__)
+		return ::fsync(fd);
+#else
+		return ::fdatasync(fd);
+#endif
+	}
+
+public: // -- ctor / dtor / asgn -- //
+
+	// creates an unlinked log.
+	wal() = default;
+
+	// opens a log file - equivalent to calling open(path, o).
+	explicit wal(const char *path) { open(path); }
+	wal(const char *path, const options &o) { open(path, o); }
+
+	wal(const wal&) = delete;
+	wal &operator=(const wal&) = delete;
+
+public: // -- log state -- //
+
+	// opens (creating if needed) a log file for appending and links it to this handle.
+	// a torn tail left by a crash - the last record cut short or never written - is truncated away first (see recover()).
+	// damage anywhere before the last record is not a crash artifact, so then open() fails and leaves the file untouched
+	// for inspection - damage_offset() reports where the damage starts.
+	// must not race with commit(). returns true on success, otherwise this handle is left unlinked.
+	bool open(const char *path, const options &o)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		file.close();
+		opt = o;
+		batch.clear();
+		open_seq = 1;
+		durable_seq = 0;
+		leading = failed = false;
+		damage = -1;
+
+		const std::int64_t end = recover(path, [](const char*, std::size_t) {});
+		if (end < 0) return false;
+		if (!torn_tail(path, end))
+		{
+			damage = end;
+			return false;
+		}
+		if (::truncate(path, (off_t)end) != 0) return false;
+
+		// whole batches are written at once, so stdio buffering would only add a copy
+		if (!file.open(path, "ab") || file.setvbuf(nullptr, _IONBF, 0) != 0)
+		{
+			file.close();
+			return false;
+		}
+		return true;
+	}
+
+	// opens a log file with the default options.
+	bool open(const char *path) { return open(path, options()); }
+
+	// closes the log (if any) and enters the unlinked state - must not race with commit().
+	void close() { file.close(); }
+
+	// returns true if this handle is currently linked to a file.
+	explicit operator bool() const noexcept { return (bool)file; }
+	// returns true if this handle is currently unlinked.
+	bool operator!() const noexcept { return !file; }
+
+	// returns true if a write or sync has failed (after which commits are refused).
+	bool error() { std::lock_guard<std::mutex> lock(mtx); return failed; }
+	// returns the offset of the damaged record that made the last open() fail, or -1 if it didn't fail that way.
+	std::int64_t damage_offset() { std::lock_guard<std::mutex> lock(mtx); return damage; }
+
+public: // -- output -- //
+
+	// appends a record and blocks until it is durable on disk - safe to call from any number of threads at once.
+	// returns true on success, false if the batch holding it could not be written or synced.
+	bool commit(const void *ptr, std::size_t len)
+	{
+		if (len > append_log::max_record) return false;
+
+		const append_log::record_header h = append_log::make_header(ptr, len);
+		const std::size_t total = (std::size_t)append_log::record_size(len);
+
+		std::unique_lock<std::mutex> lock(mtx);
+		if (failed || !file) return false;
+
+		const std::size_t at = batch.size();
+		batch.resize(at + total, 0);
+		std::memcpy(batch.data() + at, &h, sizeof(h));
+		std::memcpy(batch.data() + at + sizeof(h), ptr, len);
+		if (batch.size() >= opt.max_batch) grown.notify_one();
+
+		const std::uint64_t seq = open_seq;
+		while (durable_seq < seq && !failed)
+		{
+			if (!leading) lead(lock);
+			else done.wait(lock);
+		}
+		return durable_seq >= seq;
+	}
+	// convenience function - commits the bytes of obj as a record.
+	// additionally, guarantees that T is a valid type to be written in this manner.
+	template<typename T, std::enable_if_t<std::is_trivially_copyable<T>::value, int> = 0>
+	bool commit(const T &obj) { return commit(&obj, sizeof(T)); }
+
+public: // -- input -- //
+
+	// replays the intact prefix of a log file, calling callback(data, size) for each record in order.
+	// reading stops at the first torn or damaged record - nothing after it was ever acknowledged as durable.
+	// returns the offset just past the last intact record (0 for a missing file), or -1 if the file can't be read.
+	template<typename F>
+	static std::int64_t recover(const char *path, F &&callback)
+	{
+		cfile f(path, "rb");
+		if (!f)
+		{
+			cfile probe(path, "ab"); // create it, so a missing log is simply empty
+			return probe ? 0 : -1;
+		}
+
+		std::int64_t end = 0;
+		std::vector<char> payload;
+		for (append_log::record_header h; f.read(&h, 1) == 1 && append_log::check_header(h); )
+		{
+			const std::size_t total = (std::size_t)append_log::record_size(h.length);
+			payload.resize(total - sizeof(h));
+			if (f.read(payload.data(), 1, payload.size()) != payload.size()) break;
+			if (append_log::crc32c(payload.data(), h.length) != h.data_crc) break;
+
+			callback((const char*)payload.data(), (std::size_t)h.length);
+			end += (std::int64_t)total;
+		}
+		return f.error() ? -1 : end;
+	}
+};
+
+#endif
+
+#endif